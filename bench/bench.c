@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lodepng.h"
+
+/*
+ * Benchmark driver of the stereo engines. Every engine is a command line
+ * such as "../ex7/ex7 --engine=volume", which is run in the directory of
+ * the program (ex8 loads its kernels from there) with --disp, --left,
+ * --right and --out added. The engines print "Stage <name>: <ms> ms"
+ * lines, the driver adds the wall time of the whole process. An
+ * "ISA: <name>" line, the CPU code path ex6 or ex7 picked, is reported as is.
+ *
+ *	./bench --runs=5 --scales=1,2 --disps=32,64 --format=csv \
+ *		"../ex7/ex7" "../ex8/ex8 --engine=tiled" > results.csv
+ */
+
+#define IN_L "../ex6/imageL.png"
+#define IN_R "../ex6/imageR.png"
+/* Scaled inputs and the outputs of the engines, in the current directory */
+#define SCALED_L "bench_L_%d.png"
+#define SCALED_R "bench_R_%d.png"
+#define SCALED_OUT "bench_out.png"
+
+#define MAX_ENGINES 16
+#define MAX_LIST 16
+#define MAX_RUNS 1000
+#define CMD_LEN 4096
+#define LINE_LEN 1024
+
+/* Stages the engines report, in the order of the CSV columns */
+#define N_STAGES 5
+static const char* stages[N_STAGES] = {
+	"load", "setup", "zncc", "post", "save"
+};
+
+/* Times of one engine, scale and disparity range */
+struct result {
+	int runs;
+	double wall[MAX_RUNS];
+	double stage[N_STAGES][MAX_RUNS];
+	int has_stage[N_STAGES];
+	char isa[16];
+};
+
+/* Prototypes */
+double now_ms(void);
+int parse_list(const char* str, int* list, int max);
+int scale_image(const char* in, const char* out, int factor,
+		unsigned int* w, unsigned int* h);
+int run_engine(const char* engine, const char* left, const char* right,
+		const char* out, int disp, struct result* r, int keep);
+double median(double* v, int n);
+double percentile(double* v, int n, double p);
+int cmp_double(const void* a, const void* b);
+void json_string(const char* str);
+void report(const char* format, const char* label, const char* engine,
+		unsigned int w, unsigned int h, int disp, struct result* r,
+		int first);
+
+
+
+
+/* Wall clock in ms */
+double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+
+/* Comma separated positive integers into list, returns their count */
+int parse_list(const char* str, int* list, int max)
+{
+	int n = 0;
+	char* end;
+
+	while (*str && n < max) {
+		list[n] = strtol(str, &end, 10);
+		if (end == str || list[n] < 1)
+			return 0;
+		n++;
+		str = *end == ',' ? end+1 : end;
+	}
+	return n;
+}
+
+
+/*
+ * Writes in, shrunk by factor with a box filter, to out. Leftover columns
+ * and rows at the right and bottom edges are dropped.
+ */
+int scale_image(const char* in, const char* out, int factor,
+		unsigned int* w, unsigned int* h)
+{
+	unsigned char* src;
+	unsigned char* dst;
+	unsigned int sw, sh;
+	unsigned int acc;
+	unsigned err;
+
+	err = lodepng_decode_file(&src, &sw, &sh, in, LCT_GREY, 8);
+	if (err) {
+		fprintf(stderr, "Error %u: %s\n", err,
+				lodepng_error_text(err));
+		return 1;
+	}
+	*w = sw / factor;
+	*h = sh / factor;
+	dst = malloc(*w * *h);
+
+	for (int i=0; i<*h; i++) {
+		for (int j=0; j<*w; j++) {
+			acc = 0;
+			for (int y=0; y<factor; y++)
+				for (int x=0; x<factor; x++)
+					acc += src[(i*factor+y)*sw +
+						j*factor+x];
+			dst[i * *w + j] = (acc + factor*factor/2) /
+				(factor*factor);
+		}
+	}
+
+	err = lodepng_encode_file(out, dst, *w, *h, LCT_GREY, 8);
+	free(src);
+	free(dst);
+	return err != 0;
+}
+
+
+/*
+ * Runs engine once and, when keep is set, adds its wall and stage times
+ * to r. Returns non-zero if the engine failed.
+ */
+int run_engine(const char* engine, const char* left, const char* right,
+		const char* out, int disp, struct result* r, int keep)
+{
+	char cmd[CMD_LEN];
+	char line[LINE_LEN];
+	char name[64];
+	const char* prog;
+	const char* args;
+	const char* slash;
+	FILE* pipe;
+	double t, ms;
+	int status;
+
+	/* "dir/prog args" runs as "cd dir && ./prog args" */
+	args = strchr(engine, ' ');
+	if (args == NULL)
+		args = engine + strlen(engine);
+	slash = engine;
+	for (const char* c=engine; c<args; c++)
+		if (*c == '/')
+			slash = c+1;
+	prog = slash;
+	if (slash == engine)
+		snprintf(cmd, sizeof(cmd), "./%s", engine);
+	else
+		snprintf(cmd, sizeof(cmd), "cd '%.*s' && ./%s",
+				(int)(slash-engine), engine, prog);
+	snprintf(cmd + strlen(cmd), sizeof(cmd) - strlen(cmd),
+			" --disp=%d --left='%s' --right='%s' --out='%s' 2>&1",
+			disp, left, right, out);
+
+	t = now_ms();
+	pipe = popen(cmd, "r");
+	if (pipe == NULL)
+		return 1;
+	while (fgets(line, sizeof(line), pipe) != NULL) {
+		if (keep)
+			sscanf(line, "ISA: %15s", r->isa);
+		if (!keep || r->runs >= MAX_RUNS ||
+		    sscanf(line, "Stage %63[^:]: %lf ms", name, &ms) != 2)
+			continue;
+		for (int s=0; s<N_STAGES; s++) {
+			if (strcmp(name, stages[s]) == 0) {
+				r->stage[s][r->runs] = ms;
+				r->has_stage[s] = 1;
+			}
+		}
+	}
+	status = pclose(pipe);
+	t = now_ms() - t;
+
+	if (status != 0) {
+		fprintf(stderr, "Failed: %s\n", cmd);
+		return 1;
+	}
+	if (keep && r->runs < MAX_RUNS)
+		r->wall[r->runs++] = t;
+	return 0;
+}
+
+
+int cmp_double(const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile, sorts v */
+double percentile(double* v, int n, double p)
+{
+	int rank;
+
+	qsort(v, n, sizeof(double), cmp_double);
+	rank = (int)(p/100 * n + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	return v[rank-1];
+}
+
+double median(double* v, int n)
+{
+	qsort(v, n, sizeof(double), cmp_double);
+	return n % 2 ? v[n/2] : (v[n/2-1] + v[n/2]) / 2;
+}
+
+
+void json_string(const char* str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			putchar('\\');
+		putchar(*str);
+	}
+	putchar('"');
+}
+
+
+/*
+ * One line of CSV or one object of the JSON array. Throughput is in
+ * million (pixel, disparity) pairs per second of the L2R search, from
+ * the median wall time and from the median zncc stage.
+ */
+void report(const char* format, const char* label, const char* engine,
+		unsigned int w, unsigned int h, int disp, struct result* r,
+		int first)
+{
+	double pairs = (double)w * h * disp;
+	double wall_med = median(r->wall, r->runs);
+	double wall_p95 = percentile(r->wall, r->runs, 95);
+	double stage_med[N_STAGES];
+	int z = 2;
+
+	for (int s=0; s<N_STAGES; s++)
+		if (r->has_stage[s])
+			stage_med[s] = median(r->stage[s], r->runs);
+
+	if (strcmp(format, "csv") == 0) {
+		if (first) {
+			printf("label,engine,width,height,disp,runs,"
+				"median_ms,p95_ms,mpd_s,zncc_mpd_s");
+			for (int s=0; s<N_STAGES; s++)
+				printf(",%s_ms", stages[s]);
+			printf(",isa\n");
+		}
+		printf("%s,\"%s\",%u,%u,%d,%d,%0.3f,%0.3f,%0.3f,", label,
+				engine, w, h, disp, r->runs, wall_med,
+				wall_p95, pairs / (wall_med*1000));
+		if (r->has_stage[z])
+			printf("%0.3f", pairs / (stage_med[z]*1000));
+		for (int s=0; s<N_STAGES; s++) {
+			printf(",");
+			if (r->has_stage[s])
+				printf("%0.3f", stage_med[s]);
+		}
+		printf(",%s\n", r->isa);
+	} else {
+		printf(first ? "[\n" : ",\n");
+		printf("  {\"label\": ");
+		json_string(label);
+		printf(", \"engine\": ");
+		json_string(engine);
+		printf(", \"width\": %u, \"height\": %u, \"disp\": %d, "
+			"\"runs\": %d,\n   \"median_ms\": %0.3f, "
+			"\"p95_ms\": %0.3f, \"mpd_s\": %0.3f", w, h, disp,
+			r->runs, wall_med, wall_p95,
+			pairs / (wall_med*1000));
+		if (r->has_stage[z])
+			printf(", \"zncc_mpd_s\": %0.3f",
+				pairs / (stage_med[z]*1000));
+		if (r->isa[0] != '\0') {
+			printf(", \"isa\": ");
+			json_string(r->isa);
+		}
+		printf(",\n   \"stages_ms\": {");
+		first = 1;
+		for (int s=0; s<N_STAGES; s++) {
+			if (!r->has_stage[s])
+				continue;
+			printf("%s\"%s\": %0.3f", first ? "" : ", ", stages[s],
+				stage_med[s]);
+			first = 0;
+		}
+		printf("}}");
+	}
+	fflush(stdout);
+}
+
+
+int main(int argc, char** argv)
+{
+	const char* inL = IN_L;
+	const char* inR = IN_R;
+	const char* format = "json";
+	const char* engines[MAX_ENGINES] = {
+		"../ex6/ex6", "../ex7/ex7", "../ex8/ex8"
+	};
+	int n_engines = 3;
+	int user_engines = 0;
+	int scales[MAX_LIST] = {1, 2};
+	int n_scales = 2;
+	int disps[MAX_LIST] = {32, 64};
+	int n_disps = 2;
+	int runs = 5;
+	int warmup = 1;
+	char label[64] = "";
+	char dir[FILENAME_MAX];
+	char left[FILENAME_MAX + 32];
+	char right[FILENAME_MAX + 32];
+	char out[FILENAME_MAX + 32];
+	unsigned int w[MAX_LIST], h[MAX_LIST], rh;
+	struct result* r;
+	FILE* git;
+	int first = 1;
+	int failed = 0;
+
+	for (int i=1; i<argc; i++) {
+		if (strncmp(argv[i], "--runs=", 7) == 0) {
+			runs = atoi(argv[i]+7);
+			if (runs < 1) runs = 1;
+			if (runs > MAX_RUNS) runs = MAX_RUNS;
+		} else if (strncmp(argv[i], "--warmup=", 9) == 0) {
+			warmup = atoi(argv[i]+9);
+		} else if (strncmp(argv[i], "--scales=", 9) == 0) {
+			n_scales = parse_list(argv[i]+9, scales, MAX_LIST);
+		} else if (strncmp(argv[i], "--disps=", 8) == 0) {
+			n_disps = parse_list(argv[i]+8, disps, MAX_LIST);
+		} else if (strcmp(argv[i], "--format=json") == 0) {
+			format = "json";
+		} else if (strcmp(argv[i], "--format=csv") == 0) {
+			format = "csv";
+		} else if (strncmp(argv[i], "--label=", 8) == 0) {
+			snprintf(label, sizeof(label), "%s", argv[i]+8);
+		} else if (strncmp(argv[i], "--left=", 7) == 0) {
+			inL = argv[i]+7;
+		} else if (strncmp(argv[i], "--right=", 8) == 0) {
+			inR = argv[i]+8;
+		} else if (argv[i][0] != '-' && user_engines < MAX_ENGINES) {
+			engines[user_engines++] = argv[i];
+		} else {
+			printf("Usage: %s [--runs=N] [--warmup=K] "
+				"[--scales=1,2,...] [--disps=32,64,...] "
+				"[--format=json|csv] [--label=L] [--left=PNG] "
+				"[--right=PNG] [\"dir/engine args\" ...]\n",
+				argv[0]);
+			return 3;
+		}
+	}
+	if (n_scales == 0 || n_disps == 0) {
+		printf("--scales and --disps take positive integers\n");
+		return 3;
+	}
+	if (user_engines)
+		n_engines = user_engines;
+
+	/* The commit the numbers belong to, unless --label says otherwise */
+	if (label[0] == '\0') {
+		git = popen("git rev-parse --short HEAD 2>/dev/null", "r");
+		if (git != NULL) {
+			if (fgets(label, sizeof(label), git) != NULL)
+				label[strcspn(label, "\n")] = '\0';
+			pclose(git);
+		}
+	}
+
+	/* The engines run elsewhere, so every path is absolute */
+	if (getcwd(dir, sizeof(dir)) == NULL)
+		return 1;
+	for (int s=0; s<n_scales; s++) {
+		sprintf(left, "%s/" SCALED_L, dir, scales[s]);
+		sprintf(right, "%s/" SCALED_R, dir, scales[s]);
+		if (scale_image(inL, left, scales[s], &w[s], &h[s]) ||
+		    scale_image(inR, right, scales[s], &w[s], &rh))
+			return 1;
+	}
+	sprintf(out, "%s/" SCALED_OUT, dir);
+
+	r = malloc(sizeof(struct result));
+	for (int e=0; e<n_engines; e++) {
+		for (int s=0; s<n_scales; s++) {
+			sprintf(left, "%s/" SCALED_L, dir, scales[s]);
+			sprintf(right, "%s/" SCALED_R, dir, scales[s]);
+			for (int d=0; d<n_disps; d++) {
+				fprintf(stderr, "%s: %ux%u, disp %d\n",
+					engines[e], w[s], h[s], disps[d]);
+				memset(r, 0, sizeof(struct result));
+				for (int i=0; i<warmup+runs; i++)
+					if (run_engine(engines[e], left, right,
+					    out, disps[d], r, i >= warmup))
+						break;
+				if (r->runs < runs) {
+					failed = 1;
+					continue;
+				}
+				report(format, label, engines[e], w[s], h[s],
+					disps[d], r, first);
+				first = 0;
+			}
+		}
+	}
+	if (strcmp(format, "json") == 0)
+		printf(first ? "[]\n" : "\n]\n");
+
+	free(r);
+	return failed;
+}
@@ -0,0 +1,79 @@
+#include "cl_buffer.h"
+
+/*
+ * Buffers of exactly the image size. Devices that share memory with the
+ * host (CPU runtimes, integrated GPUs) get zero-copy buffers: inputs wrap
+ * the host array with CL_MEM_USE_HOST_PTR and outputs are allocated by the
+ * runtime with CL_MEM_ALLOC_HOST_PTR and mapped instead of read back.
+ * Discrete devices get plain buffers and explicit transfers.
+ */
+int host_unified(cl_device_id dev)
+{
+	cl_bool unified = CL_FALSE;
+	cl_device_type type = 0;
+
+	clGetDeviceInfo(dev, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified),
+			&unified, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+	return unified || (type & CL_DEVICE_TYPE_CPU);
+}
+
+/* host has to outlive the buffer */
+cl_mem input_buffer(cl_context ctx, int unified, void* host, size_t size)
+{
+	cl_mem buff;
+	cl_int err;
+
+	buff = clCreateBuffer(ctx, CL_MEM_READ_ONLY | (unified ?
+			CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR), size, host,
+			&err);
+	if (err < 0) error(err, "clCreateBuffer (input)");
+	return buff;
+}
+
+cl_mem output_buffer(cl_context ctx, int unified, size_t size)
+{
+	cl_mem buff;
+	cl_int err;
+
+	/* Read-write, the post-processing kernels of ex8 read it back */
+	buff = clCreateBuffer(ctx, CL_MEM_READ_WRITE | (unified ?
+			CL_MEM_ALLOC_HOST_PTR : 0), size, NULL, &err);
+	if (err < 0) error(err, "clCreateBuffer (output)");
+	return buff;
+}
+
+/*
+ * Host view of an output buffer once the queue has finished with it: the
+ * mapping itself on unified devices, host after a blocking read otherwise.
+ * Give it back with unmap_output().
+ */
+unsigned char* map_output(cl_command_queue queue, int unified, cl_mem buff,
+	size_t size, unsigned char* host)
+{
+	unsigned char* ptr;
+	cl_int err;
+
+	if (unified) {
+		ptr = clEnqueueMapBuffer(queue, buff, CL_TRUE, CL_MAP_READ, 0,
+				size, 0, NULL, NULL, &err);
+		if (err < 0) error(err, "clEnqueueMapBuffer");
+		return ptr;
+	}
+	err = clEnqueueReadBuffer(queue, buff, CL_TRUE, 0, size, host, 0, NULL,
+			NULL);
+	if (err < 0) error(err, "clEnqueueReadBuffer");
+	return host;
+}
+
+void unmap_output(cl_command_queue queue, int unified, cl_mem buff,
+	unsigned char* ptr)
+{
+	cl_int err;
+
+	if (!unified)
+		return;
+	err = clEnqueueUnmapMemObject(queue, buff, ptr, 0, NULL, NULL);
+	if (err < 0) error(err, "clEnqueueUnmapMemObject");
+	clFinish(queue);
+}
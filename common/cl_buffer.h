@@ -0,0 +1,27 @@
+#ifndef CL_BUFFER_H
+#define CL_BUFFER_H
+
+#include <stddef.h>
+
+#if defined __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+/*
+ * Input and output buffers of ex4, ex8 and lpf, zero-copy where the device
+ * shares memory with the host. Failures go through the error() of the
+ * program.
+ */
+void error(cl_int err, char* func_name);
+
+int host_unified(cl_device_id dev);
+cl_mem input_buffer(cl_context ctx, int unified, void* host, size_t size);
+cl_mem output_buffer(cl_context ctx, int unified, size_t size);
+unsigned char* map_output(cl_command_queue queue, int unified, cl_mem buff,
+	size_t size, unsigned char* host);
+void unmap_output(cl_command_queue queue, int unified, cl_mem buff,
+	unsigned char* ptr);
+
+#endif
@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cl_cache.h"
+
+/*
+ * Device binaries of built programs are cached on disk next to the .cl
+ * file, one file per key. The key holds the build options, the device
+ * name, the driver version and a hash of the source; the file name is a
+ * hash of the key and the file starts with the key itself, so a change in
+ * any of them is a miss and the program is compiled again.
+ */
+unsigned long long fnv1a(const char* buf, size_t size)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+
+	for (size_t i=0; i<size; i++) {
+		hash ^= (unsigned char)buf[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+cl_program load_binary(cl_context ctx, cl_device_id dev, const char* path,
+	const char* key)
+{
+	cl_program program;
+	FILE	   *b_handle;
+	char	   *b_key;
+	unsigned char *b_buffer;
+	size_t	   key_size;
+	size_t	   b_size;
+	cl_int	   status;
+	cl_int	   err;
+
+	b_handle = fopen(path, "rb");
+	if (b_handle == NULL)
+		return NULL;
+
+	/* The stored key has to match the whole current one */
+	if (fread(&key_size, sizeof(size_t), 1, b_handle) != 1 ||
+	    key_size != strlen(key)) {
+		fclose(b_handle);
+		return NULL;
+	}
+	b_key = malloc(key_size);
+	if (fread(b_key, 1, key_size, b_handle) != key_size ||
+	    memcmp(b_key, key, key_size) != 0 ||
+	    fread(&b_size, sizeof(size_t), 1, b_handle) != 1) {
+		free(b_key);
+		fclose(b_handle);
+		return NULL;
+	}
+	free(b_key);
+
+	b_buffer = malloc(b_size);
+	if (fread(b_buffer, 1, b_size, b_handle) != b_size) {
+		free(b_buffer);
+		fclose(b_handle);
+		return NULL;
+	}
+	fclose(b_handle);
+
+	program = clCreateProgramWithBinary(ctx, 1, &dev, &b_size,
+			(const unsigned char**)&b_buffer, &status, &err);
+	free(b_buffer);
+	if (err < 0 || status < 0)
+		return NULL;
+	return program;
+}
+
+void save_binary(cl_program program, const char* path, const char* key)
+{
+	FILE	   *b_handle;
+	unsigned char *b_buffer;
+	char	   tmp_path[FILENAME_MAX];
+	size_t	   key_size = strlen(key);
+	size_t	   b_size;
+	cl_int	   err;
+
+	err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES,
+			sizeof(size_t), &b_size, NULL);
+	if (err < 0 || b_size == 0)
+		return;
+	b_buffer = malloc(b_size);
+	err = clGetProgramInfo(program, CL_PROGRAM_BINARIES,
+			sizeof(unsigned char*), &b_buffer, NULL);
+	if (err < 0) {
+		free(b_buffer);
+		return;
+	}
+
+	/* Written aside and renamed, a reader never sees half a file */
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+	b_handle = fopen(tmp_path, "wb");
+	if (b_handle != NULL) {
+		fwrite(&key_size, sizeof(size_t), 1, b_handle);
+		fwrite(key, 1, key_size, b_handle);
+		fwrite(&b_size, sizeof(size_t), 1, b_handle);
+		fwrite(b_buffer, 1, b_size, b_handle);
+		fclose(b_handle);
+		rename(tmp_path, path);
+	}
+	free(b_buffer);
+}
+
+/* Wall clock in ms */
+double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * Compiles the .cl file name with args for dev, or loads the binary a
+ * previous run cached for the same key. A build error prints the log and
+ * exits.
+ */
+cl_program build_program(cl_context ctx, cl_device_id dev, const char* name,
+	char* args)
+{
+	cl_program program;
+	FILE 	   *p_handle;
+	char 	   *p_buffer;
+	char 	   *p_log;
+	size_t 	   p_size;
+	size_t 	   log_size;
+	cl_int 	   err;
+	char	   dev_name[256] = "";
+	char	   driver[256] = "";
+	char	   *key;
+	char	   path[FILENAME_MAX];
+	double	   start;
+
+	p_handle = fopen(name, "r");
+	if (p_handle == NULL) {
+		perror("Couldn't find the file");
+		exit(1);
+	}
+	fseek(p_handle, 0, SEEK_END);
+	p_size = ftell(p_handle);
+	rewind(p_handle);
+	p_buffer = (char*)malloc(p_size+1);
+	p_buffer[p_size] = '\0';
+	fread(p_buffer, sizeof(char), p_size, p_handle);
+	fclose(p_handle);
+
+	clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(dev_name), dev_name, NULL);
+	clGetDeviceInfo(dev, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+	key = malloc(strlen(args) + strlen(dev_name) + strlen(driver) + 32);
+	sprintf(key, "%s\n%s\n%s\n%016llx", args, dev_name, driver,
+			fnv1a(p_buffer, p_size));
+	snprintf(path, sizeof(path), "%s.%016llx.bin", name,
+			fnv1a(key, strlen(key)));
+
+	start = now_ms();
+	program = load_binary(ctx, dev, path, key);
+	if (program != NULL &&
+	    clBuildProgram(program, 0, NULL, args, NULL, NULL) < 0) {
+		clReleaseProgram(program);
+		program = NULL;
+	}
+	if (program != NULL) {
+		printf("Program cache hit: %s, loaded in %0.3f ms\n", path,
+				now_ms() - start);
+		free(p_buffer);
+		free(key);
+		return program;
+	}
+
+	program = clCreateProgramWithSource(ctx, 1, (const char**)&p_buffer,
+			&p_size, &err);
+	if (err < 0) error(err, "clCreateProgramWithSource");
+	free(p_buffer);
+
+	err = clBuildProgram(program, 0, NULL, args, NULL, NULL);
+	if (err < 0) {
+		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 0,
+				NULL, &log_size);
+		p_log = (char *) malloc(log_size+1);
+		p_log[log_size] = '\0';
+		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG,
+			log_size+1, p_log, NULL);
+		printf("%s\n", p_log);
+		free(p_log);
+		exit(1);
+	}
+
+	save_binary(program, path, key);
+	printf("Program cache miss: %s, compiled in %0.3f ms\n", path,
+			now_ms() - start);
+	free(key);
+
+	return program;
+}
@@ -0,0 +1,26 @@
+#ifndef CL_CACHE_H
+#define CL_CACHE_H
+
+#include <stddef.h>
+
+#if defined __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+/*
+ * build_program() with its on-disk cache of device binaries, shared by
+ * ex4, ex8 and lpf. Failures go through the error() of the program.
+ */
+void error(cl_int err, char* func_name);
+
+cl_program build_program(cl_context ctx, cl_device_id dev, const char* name,
+	char* args);
+unsigned long long fnv1a(const char* buf, size_t size);
+cl_program load_binary(cl_context ctx, cl_device_id dev, const char* path,
+	const char* key);
+void save_binary(cl_program program, const char* path, const char* key);
+double now_ms(void);
+
+#endif
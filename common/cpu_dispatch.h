@@ -0,0 +1,98 @@
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+/*
+ * Runtime choice between the plain C, SSE4.1, AVX2 and AVX-512 variants of
+ * a kernel. A program compiles its variants with target attributes, so no
+ * -m flag is needed, lists them in a table indexed by ISA_* and picks one
+ * at startup:
+ *
+ *	static const kernel_func kernels[N_ISA] = {
+ *		kernel_scalar, ISA_VARIANT(kernel_sse41),
+ *		ISA_VARIANT(kernel_avx2), ISA_VARIANT(kernel_avx512)
+ *	};
+ *	...
+ *	} else if (isa_option(argv[i], &max_isa)) {
+ *	...
+ *	kernel = kernels[cpu_dispatch(max_isa)];
+ *
+ * The SIMD variants only exist on x86 (CPU_X86). Elsewhere ISA_VARIANT()
+ * leaves them out of the table and cpu_dispatch() always picks plain C.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_X86
+#include <immintrin.h>
+#define ISA_VARIANT(f) (f)
+#else
+#define ISA_VARIANT(f) NULL
+#endif
+
+#define ISA_SCALAR 0
+#define ISA_SSE41 1
+#define ISA_AVX2 2
+#define ISA_AVX512 3	/* AVX-512 F, BW and VL */
+#define N_ISA 4
+
+#define ISA_USAGE "[--isa=scalar|sse4.1|avx2|avx512]"
+
+static const char* const isa_names[N_ISA] = {
+	"scalar", "sse4.1", "avx2", "avx512"
+};
+
+/* The variant cpu_dispatch() picked */
+static int isa = ISA_SCALAR;
+
+/* The ISA_* of a --isa value, -1 when there is none */
+static inline int find_isa(const char* name)
+{
+	for (int k=0; k<N_ISA; k++)
+		if (strcmp(name, isa_names[k]) == 0)
+			return k;
+	return -1;
+}
+
+/*
+ * Sets max_isa from arg when it is a valid --isa=NAME and returns 1,
+ * returns 0 for anything else.
+ */
+static inline int isa_option(const char* arg, int* max_isa)
+{
+	int k;
+
+	if (strncmp(arg, "--isa=", 6) != 0 || (k = find_isa(arg+6)) < 0)
+		return 0;
+	*max_isa = k;
+	return 1;
+}
+
+/*
+ * The widest ISA_* that both the CPU and max_isa allow, also printed as
+ * "ISA: <name>" for the logs and bench. The CPU is asked once, through
+ * cpuid; __builtin_cpu_supports() also checks that the OS saves the AVX
+ * and AVX-512 registers.
+ */
+static inline int cpu_dispatch(int max_isa)
+{
+	int best = ISA_SCALAR;
+
+#ifdef CPU_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.1"))
+		best = ISA_SSE41;
+	if (__builtin_cpu_supports("avx2"))
+		best = ISA_AVX2;
+	if (__builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512bw") &&
+	    __builtin_cpu_supports("avx512vl"))
+		best = ISA_AVX512;
+#endif
+	isa = best < max_isa ? best : max_isa;
+	printf("ISA: %s\n", isa_names[isa]);
+	return isa;
+}
+
+#endif
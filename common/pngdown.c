@@ -0,0 +1,364 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "lodepng.h"
+#include "pngdown.h"
+
+/*
+ * PNG decode, grey conversion and downsampling in one pass over the
+ * scanlines. zlib inflates the IDAT chunks as they come into a buffer of
+ * two scanlines, the current one and the one its filter refers to; each is
+ * unfiltered in place, read as grey and added to the shrunk image right
+ * away. Only the file and the shrunk image are held: no full-resolution
+ * image, inflated, grey or RGBA, is ever built. Grey is the first
+ * channel, red for colour images, which is what
+ * lodepng_decode_file(..., LCT_GREY, 8) gives too.
+ * Interlaced images and bit depths other than 8 are decoded by lodepng
+ * and then shrunk the same way.
+ */
+
+/* The shrunk image while it is being summed */
+struct shrink {
+	unsigned w, h;
+	int f;
+	int filter;
+	unsigned out_w, out_h;
+	/* Weighted sums of every output pixel, and of one source row */
+	unsigned* acc;
+	unsigned* row;
+	/* Total weight of every output column and row */
+	unsigned* wsum_x;
+	unsigned* wsum_y;
+};
+
+static unsigned weight(int f, int filter, int i, int x);
+static void shrink_init(struct shrink* s, unsigned w, unsigned h, int f,
+		int filter);
+static void shrink_row(struct shrink* s, const unsigned char* px,
+		int stride, unsigned y);
+static unsigned char* shrink_finish(struct shrink* s);
+static unsigned char paeth(int a, int b, int c);
+static int unfilter(unsigned char* row, const unsigned char* prev,
+		int type, size_t len, int bpp);
+static unsigned decode_rows(struct shrink* s, const unsigned char* file,
+		size_t size, LodePNGState* state);
+
+
+/*
+ * Weight of source pixel x in output pixel i of one axis. The box covers
+ * f*i..f*i+f-1. The Gaussian is approximated by a triangle twice as wide,
+ * the box convolved with itself, measured in half pixels so that the
+ * centre of an even block is exact. Both are 1 pixel wide at f = 1.
+ */
+static unsigned weight(int f, int filter, int i, int x)
+{
+	int d;
+
+	if (filter == PNGDOWN_BOX)
+		return x / f == i;
+	d = abs(2*x - (2*f*i + f - 1));
+	return d < 2*f ? 2*f - d : 0;
+}
+
+static void shrink_init(struct shrink* s, unsigned w, unsigned h, int f,
+		int filter)
+{
+	s->w = w;
+	s->h = h;
+	s->f = f;
+	s->filter = filter;
+	s->out_w = (w + f-1) / f;
+	s->out_h = (h + f-1) / f;
+	s->acc = calloc((size_t)s->out_w * s->out_h, sizeof(unsigned));
+	s->row = malloc(s->out_w * sizeof(unsigned));
+	s->wsum_x = calloc(s->out_w, sizeof(unsigned));
+	s->wsum_y = calloc(s->out_h, sizeof(unsigned));
+
+	/* A source pixel only reaches its own block and the two next to it */
+	for (int x=0; x<w; x++)
+		for (int j=x/f-1; j<=x/f+1; j++)
+			if (j >= 0 && j < s->out_w)
+				s->wsum_x[j] += weight(f, filter, j, x);
+	for (int y=0; y<h; y++)
+		for (int i=y/f-1; i<=y/f+1; i++)
+			if (i >= 0 && i < s->out_h)
+				s->wsum_y[i] += weight(f, filter, i, y);
+}
+
+/* Adds source row y, whose grey values are stride bytes apart */
+static void shrink_row(struct shrink* s, const unsigned char* px,
+		int stride, unsigned y)
+{
+	unsigned wgt;
+	int f = s->f;
+
+	memset(s->row, 0, s->out_w * sizeof(unsigned));
+	if (s->filter == PNGDOWN_BOX) {
+		/* Every pixel is in exactly one block with weight 1 */
+		for (int x=0; x<s->w; x++)
+			s->row[x/f] += px[x*stride];
+		for (int j=0; j<s->out_w; j++)
+			s->acc[y/f*s->out_w + j] += s->row[j];
+		return;
+	}
+	for (int x=0; x<s->w; x++) {
+		for (int j=x/f-1; j<=x/f+1; j++) {
+			if (j < 0 || j >= s->out_w)
+				continue;
+			s->row[j] += weight(f, s->filter, j, x) * px[x*stride];
+		}
+	}
+
+	for (int i=(int)y/f-1; i<=(int)y/f+1; i++) {
+		if (i < 0 || i >= s->out_h)
+			continue;
+		wgt = weight(f, s->filter, i, y);
+		if (wgt == 0)
+			continue;
+		for (int j=0; j<s->out_w; j++)
+			s->acc[i*s->out_w + j] += wgt * s->row[j];
+	}
+}
+
+/* The rounded averages, frees everything else */
+static unsigned char* shrink_finish(struct shrink* s)
+{
+	unsigned char* out = malloc((size_t)s->out_w * s->out_h);
+	unsigned wsum;
+
+	for (int i=0; i<s->out_h; i++) {
+		for (int j=0; j<s->out_w; j++) {
+			wsum = s->wsum_x[j] * s->wsum_y[i];
+			out[i*s->out_w + j] = (s->acc[i*s->out_w + j] +
+					wsum/2) / wsum;
+		}
+	}
+	free(s->acc);
+	free(s->row);
+	free(s->wsum_x);
+	free(s->wsum_y);
+	return out;
+}
+
+
+static unsigned char paeth(int a, int b, int c)
+{
+	int pa = abs(b - c);
+	int pb = abs(a - c);
+	int pc = abs(a + b - 2*c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+/* PNG filters of one scanline, prev is NULL on the first one */
+static int unfilter(unsigned char* row, const unsigned char* prev,
+		int type, size_t len, int bpp)
+{
+	int a, b, c;
+
+	for (size_t i=0; i<len; i++) {
+		a = i >= bpp ? row[i-bpp] : 0;
+		b = prev != NULL ? prev[i] : 0;
+		c = i >= bpp && prev != NULL ? prev[i-bpp] : 0;
+		switch (type) {
+		case 0:
+			return 0;
+		case 1:
+			row[i] += a;
+			break;
+		case 2:
+			row[i] += b;
+			break;
+		case 3:
+			row[i] += (a + b) / 2;
+			break;
+		case 4:
+			row[i] += paeth(a, b, c);
+			break;
+		default:
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* 8-bit, non-interlaced images */
+static unsigned decode_rows(struct shrink* s, const unsigned char* file,
+		size_t size, LodePNGState* state)
+{
+	LodePNGColorMode* color = &state->info_png.color;
+	const unsigned char* end = file + size;
+	const unsigned char* chunk;
+	const unsigned char* data;
+	unsigned char* lines;
+	unsigned char* grey = NULL;
+	unsigned char* row;
+	unsigned char* prev = NULL;
+	unsigned char red[256];
+	z_stream zs;
+	size_t len;
+	unsigned err = 0;
+	unsigned y = 0;
+	int zerr;
+	int bpp;
+
+	switch (color->colortype) {
+	case LCT_GREY:
+	case LCT_PALETTE:
+		bpp = 1;
+		break;
+	case LCT_GREY_ALPHA:
+		bpp = 2;
+		break;
+	case LCT_RGB:
+		bpp = 3;
+		break;
+	default:
+		bpp = 4;
+	}
+	len = (size_t)s->w * bpp;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK)
+		return 83;
+	/* The scanline being inflated and the one before, with filter bytes */
+	lines = malloc(2 * (len+1));
+	row = lines;
+	zs.next_out = row;
+	zs.avail_out = len+1;
+	if (color->colortype == LCT_PALETTE)
+		grey = malloc(s->w);
+
+	/* Red of the palette entries, then the IDAT data chunk by chunk */
+	memset(red, 0, sizeof(red));
+	for (chunk=file+8; err==0 && y<s->h && chunk+12<=end;
+	    chunk=lodepng_chunk_next_const(chunk, end)) {
+		data = lodepng_chunk_data_const(chunk);
+		if (data + lodepng_chunk_length(chunk) > end)
+			break;
+		if (lodepng_chunk_type_equals(chunk, "PLTE")) {
+			for (int k=0; k<lodepng_chunk_length(chunk)/3 &&
+			    k<256; k++)
+				red[k] = data[3*k];
+			continue;
+		} else if (lodepng_chunk_type_equals(chunk, "IEND")) {
+			break;
+		} else if (!lodepng_chunk_type_equals(chunk, "IDAT")) {
+			continue;
+		}
+
+		zs.next_in = (unsigned char*)data;
+		zs.avail_in = lodepng_chunk_length(chunk);
+		while (y < s->h) {
+			/* Z_BUF_ERROR only means no progress, more input */
+			zerr = inflate(&zs, Z_NO_FLUSH);
+			if (zerr == Z_MEM_ERROR) {
+				err = 83;
+				break;
+			}
+			if (zerr != Z_OK && zerr != Z_STREAM_END &&
+			    zerr != Z_BUF_ERROR) {
+				err = 91;
+				break;
+			}
+			if (zs.avail_out > 0)
+				break;
+
+			if (unfilter(row+1, prev != NULL ? prev+1 : NULL,
+			    row[0], len, bpp)) {
+				err = 36;
+				break;
+			}
+			if (grey != NULL) {
+				for (int x=0; x<s->w; x++)
+					grey[x] = red[row[x+1]];
+				shrink_row(s, grey, 1, y);
+			} else {
+				shrink_row(s, row+1, bpp, y);
+			}
+			prev = row;
+			row = row == lines ? lines + len+1 : lines;
+			zs.next_out = row;
+			zs.avail_out = len+1;
+			y++;
+		}
+	}
+	if (err == 0 && y < s->h)
+		err = 91;
+
+	inflateEnd(&zs);
+	free(grey);
+	free(lines);
+	return err;
+}
+
+
+unsigned pngdown_decode_file(unsigned char** out, unsigned* w, unsigned* h,
+		unsigned* full_w, unsigned* full_h, const char* filename,
+		int factor, int filter)
+{
+	LodePNGState state;
+	struct shrink s;
+	unsigned char* file = NULL;
+	unsigned char* grey = NULL;
+	size_t size;
+	unsigned fw, fh;
+	unsigned err;
+
+	if (factor < 1)
+		factor = 1;
+	if (factor > PNGDOWN_MAX_FACTOR)
+		factor = PNGDOWN_MAX_FACTOR;
+
+	*out = NULL;
+	err = lodepng_load_file(&file, &size, filename);
+	if (err)
+		return err;
+	lodepng_state_init(&state);
+	err = lodepng_inspect(&fw, &fh, &state, file, size);
+	if (err) {
+		lodepng_state_cleanup(&state);
+		free(file);
+		return err;
+	}
+	if (full_w != NULL)
+		*full_w = fw;
+	if (full_h != NULL)
+		*full_h = fh;
+
+	shrink_init(&s, fw, fh, factor, filter);
+	if (state.info_png.interlace_method != 0 ||
+	    state.info_png.color.bitdepth != 8) {
+		err = lodepng_decode_memory(&grey, &fw, &fh, file, size,
+				LCT_GREY, 8);
+		for (unsigned y=0; err==0 && y<fh; y++)
+			shrink_row(&s, grey + (size_t)y*fw, 1, y);
+		free(grey);
+	} else {
+		err = decode_rows(&s, file, size, &state);
+	}
+	grey = shrink_finish(&s);
+	if (err == 0) {
+		*out = grey;
+		*w = s.out_w;
+		*h = s.out_h;
+	} else {
+		free(grey);
+	}
+
+	lodepng_state_cleanup(&state);
+	free(file);
+	return err;
+}
+
+void pngdown_upscale(const unsigned char* in, unsigned w, unsigned h,
+		unsigned char* out, unsigned out_w, unsigned out_h)
+{
+	for (unsigned i=0; i<out_h; i++)
+		for (unsigned j=0; j<out_w; j++)
+			out[i*out_w + j] = in[(size_t)i*h/out_h * w +
+				(size_t)j*w/out_w];
+}
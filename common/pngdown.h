@@ -0,0 +1,24 @@
+#ifndef PNGDOWN_H
+#define PNGDOWN_H
+
+/* Filters of pngdown_decode_file() */
+#define PNGDOWN_BOX 0
+#define PNGDOWN_GAUSS 1
+
+/* Largest factor, the sums of a tap block have to fit 32 bits */
+#define PNGDOWN_MAX_FACTOR 32
+
+/*
+ * Decodes a PNG file to 8-bit grey shrunk by factor, (w+factor-1)/factor x
+ * (h+factor-1)/factor, and sets the size of the file in full_w, full_h
+ * when they are not NULL. Returns a lodepng error code.
+ */
+unsigned pngdown_decode_file(unsigned char** out, unsigned* w, unsigned* h,
+		unsigned* full_w, unsigned* full_h, const char* filename,
+		int factor, int filter);
+
+/* Nearest-neighbour resize of in (w x h) to out (out_w x out_h) */
+void pngdown_upscale(const unsigned char* in, unsigned w, unsigned h,
+		unsigned char* out, unsigned out_w, unsigned out_h);
+
+#endif
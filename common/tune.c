@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tune.h"
+
+/*
+ * --tune keeps the fastest configuration of every kernel in TUNE_FILE,
+ * one line per key: "kernel|device|driver|shape<TAB>config<TAB>ms". The
+ * config is whatever the host program prints for its kernel, so the file
+ * can be shared by all of them.
+ */
+void tune_key(char* key, size_t size, cl_device_id dev, const char* kernel,
+	const char* shape)
+{
+	char dev_name[256] = "";
+	char driver[256] = "";
+
+	clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(dev_name), dev_name, NULL);
+	clGetDeviceInfo(dev, CL_DRIVER_VERSION, sizeof(driver), driver, NULL);
+	snprintf(key, size, "%s|%s|%s|%s", kernel, dev_name, driver, shape);
+}
+
+/* The stored config of key in conf, 0 if there is none */
+int tune_load(const char* key, char* conf, size_t size)
+{
+	FILE* t_handle;
+	char line[TUNE_LINE];
+	char* tab;
+	int found = 0;
+
+	t_handle = fopen(TUNE_FILE, "r");
+	if (t_handle == NULL)
+		return 0;
+	while (!found && fgets(line, sizeof(line), t_handle) != NULL) {
+		tab = strchr(line, '\t');
+		if (tab == NULL || tab-line != strlen(key) ||
+		    strncmp(line, key, tab-line) != 0)
+			continue;
+		snprintf(conf, size, "%s", tab+1);
+		/* Drop the time */
+		tab = strchr(conf, '\t');
+		if (tab != NULL)
+			*tab = '\0';
+		found = 1;
+	}
+	fclose(t_handle);
+	return found;
+}
+
+/* Replaces the line of key, or adds one */
+void tune_save(const char* key, const char* conf, double ms)
+{
+	FILE* t_handle;
+	char** lines = NULL;
+	char line[TUNE_LINE];
+	int n = 0;
+
+	t_handle = fopen(TUNE_FILE, "r");
+	if (t_handle != NULL) {
+		while (fgets(line, sizeof(line), t_handle) != NULL) {
+			if (strncmp(line, key, strlen(key)) == 0 &&
+			    line[strlen(key)] == '\t')
+				continue;
+			lines = realloc(lines, (n+1) * sizeof(char*));
+			lines[n++] = strdup(line);
+		}
+		fclose(t_handle);
+	}
+
+	t_handle = fopen(TUNE_FILE, "w");
+	if (t_handle == NULL) {
+		perror("Couldn't write " TUNE_FILE);
+		return;
+	}
+	for (int i=0; i<n; i++) {
+		fputs(lines[i], t_handle);
+		free(lines[i]);
+	}
+	fprintf(t_handle, "%s\t%s\t%0.3f\n", key, conf, ms);
+	fclose(t_handle);
+	free(lines);
+}
+
+/*
+ * A byte tune_sweep() fills the output with before every configuration:
+ * one the reference does not contain, so that bytes a configuration
+ * leaves unwritten fail the comparison instead of keeping the last result.
+ */
+unsigned char tune_poison(const unsigned char* ref, size_t size)
+{
+	char seen[256] = {0};
+
+	if (ref == NULL)
+		return 0xFF;
+	for (size_t i=0; i<size; i++)
+		seen[ref[i]] = 1;
+	for (int v=255; v>0; v--)
+		if (!seen[v])
+			return v;
+	return 0;
+}
+
+/*
+ * Runs every configuration of space and keeps the fastest one whose output
+ * matches: the size bytes of buff_out have to equal expected, or when it
+ * is NULL the output of the first configuration that runs. The winner is
+ * left current in space and stored under key. Returns its index, -1 when
+ * none ran.
+ */
+int tune_sweep(cl_command_queue queue, cl_mem buff_out, size_t size,
+	const void* expected, const char* key, struct tune_space* space)
+{
+	unsigned char* ref = NULL;
+	unsigned char* out;
+	unsigned char poison;
+	char conf[TUNE_LINE];
+	double ms;
+	double best_ms = -1;
+	cl_int err;
+	int best = -1;
+	int ok;
+
+	if (expected != NULL) {
+		ref = malloc(size);
+		memcpy(ref, expected, size);
+	}
+	out = malloc(size);
+	for (int i=0; i<space->n; i++) {
+		space->set(space->arg, i, conf, sizeof(conf));
+		poison = tune_poison(ref, size);
+		err = clEnqueueFillBuffer(queue, buff_out, &poison,
+				sizeof(poison), 0, size, 0, NULL, NULL);
+		if (err < 0) error(err, "clEnqueueFillBuffer (tune)");
+		ms = space->run(space->arg);
+		if (ms < 0)
+			continue;
+
+		err = clEnqueueReadBuffer(queue, buff_out, CL_TRUE, 0, size,
+				out, 0, NULL, NULL);
+		if (err < 0) error(err, "clEnqueueReadBuffer (tune)");
+		ok = ref == NULL || memcmp(ref, out, size) == 0;
+		if (ref == NULL) {
+			ref = out;
+			out = malloc(size);
+		}
+
+		printf("%s: %0.3f ms%s\n", conf, ms,
+				ok ? "" : " (wrong result)");
+		if (ok && (best_ms < 0 || ms < best_ms)) {
+			best_ms = ms;
+			best = i;
+		}
+	}
+	free(ref);
+	free(out);
+
+	if (best < 0)
+		return -1;
+	space->set(space->arg, best, conf, sizeof(conf));
+	printf("Best: %s, %0.3f ms\n", conf, best_ms);
+	tune_save(key, conf, best_ms);
+	return best;
+}
@@ -0,0 +1,44 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#include <stddef.h>
+
+#if defined __APPLE__
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+/*
+ * --tune of ex3, ex4, ex8 and lpf: the database in TUNE_FILE and the sweep
+ * over the launch configurations of one kernel. Failures go through the
+ * error() of the program.
+ */
+#define TUNE_FILE "tuning.db"
+#define TUNE_LINE 1024
+#define TUNE_RUNS 3
+
+/*
+ * The configurations a host sweeps. set() makes configuration i current
+ * and writes it in conf the way the database stores it, run() launches the
+ * current one TUNE_RUNS times and returns its best time in ms, < 0 when
+ * the device does not take it. Both get arg.
+ */
+struct tune_space {
+	int n;
+	void (*set)(void* arg, int i, char* conf, size_t size);
+	double (*run)(void* arg);
+	void* arg;
+};
+
+void error(cl_int err, char* func_name);
+
+void tune_key(char* key, size_t size, cl_device_id dev, const char* kernel,
+	const char* shape);
+int tune_load(const char* key, char* conf, size_t size);
+void tune_save(const char* key, const char* conf, double ms);
+unsigned char tune_poison(const unsigned char* ref, size_t size);
+int tune_sweep(cl_command_queue queue, cl_mem buff_out, size_t size,
+	const void* expected, const char* key, struct tune_space* space);
+
+#endif
@@ -1,16 +1,183 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "lodepng.h"
 
-int main(void)
+/*
+ * The grey loop has a variant for AVX-512F, AVX2, SSE4.1 and plain C,
+ * picked at startup, see cpu_dispatch.h and --isa.
+ */
+#include "../common/cpu_dispatch.h"
+
+/* Turns the RGBA bytes from <= i < to grey, see main */
+typedef void (*grey_func)(unsigned char* image, size_t from, size_t to);
+
+/* grey() variant, see cpu_dispatch() */
+grey_func grey;
+
+void grey_scalar(unsigned char* image, size_t from, size_t to)
+{
+	unsigned i, gray;
+
+	for (i=from; i<to; i+=4) {
+		gray = 0x2126*image[i] + 0.7152*image[i+1] + 0.0722*image[i+2];
+		if (gray < 128)
+			gray = 0;
+		image[i] = gray;
+		image[i+1] = gray;
+		image[i+2] = gray;
+	}
+}
+
+#ifdef CPU_X86
+/*
+ * The SIMD variants take R, G and B of every pixel to double and do the
+ * same multiplies and adds in the same order as grey_scalar(), so the
+ * image is the same. The low byte of the grey is then copied to R, G and
+ * B with one multiply by 0x010101, the alpha byte is kept.
+ */
+
+/* 4 pixels at a time, the rest in plain C */
+__attribute__((target("sse4.1")))
+void grey_sse41(unsigned char* image, size_t from, size_t to)
+{
+	const __m128i byte = _mm_set1_epi32(0xFF);
+	const __m128i alpha = _mm_set1_epi32(0xFF000000);
+	__m128i px, r, g, b, lo, hi, gray;
+	size_t i;
+
+	for (i=from; i+16<=to; i+=16) {
+		px = _mm_loadu_si128((__m128i*)(image+i));
+		r = _mm_mullo_epi32(_mm_and_si128(px, byte),
+			_mm_set1_epi32(0x2126));
+		g = _mm_and_si128(_mm_srli_epi32(px, 8), byte);
+		b = _mm_and_si128(_mm_srli_epi32(px, 16), byte);
+		lo = _mm_cvttpd_epi32(_mm_add_pd(_mm_add_pd(
+			_mm_cvtepi32_pd(r),
+			_mm_mul_pd(_mm_set1_pd(0.7152), _mm_cvtepi32_pd(g))),
+			_mm_mul_pd(_mm_set1_pd(0.0722), _mm_cvtepi32_pd(b))));
+		r = _mm_srli_si128(r, 8);
+		g = _mm_srli_si128(g, 8);
+		b = _mm_srli_si128(b, 8);
+		hi = _mm_cvttpd_epi32(_mm_add_pd(_mm_add_pd(
+			_mm_cvtepi32_pd(r),
+			_mm_mul_pd(_mm_set1_pd(0.7152), _mm_cvtepi32_pd(g))),
+			_mm_mul_pd(_mm_set1_pd(0.0722), _mm_cvtepi32_pd(b))));
+		gray = _mm_unpacklo_epi64(lo, hi);
+		gray = _mm_andnot_si128(_mm_cmplt_epi32(gray,
+			_mm_set1_epi32(128)), gray);
+		gray = _mm_mullo_epi32(_mm_and_si128(gray, byte),
+			_mm_set1_epi32(0x010101));
+		px = _mm_or_si128(gray, _mm_and_si128(px, alpha));
+		_mm_storeu_si128((__m128i*)(image+i), px);
+	}
+	grey_scalar(image, i, to);
+}
+
+/* 8 pixels at a time, the rest in plain C */
+__attribute__((target("avx2")))
+void grey_avx2(unsigned char* image, size_t from, size_t to)
+{
+	const __m256i byte = _mm256_set1_epi32(0xFF);
+	const __m256i alpha = _mm256_set1_epi32(0xFF000000);
+	__m256i px, r, g, b, gray;
+	__m128i lo, hi;
+	size_t i;
+
+	for (i=from; i+32<=to; i+=32) {
+		px = _mm256_loadu_si256((__m256i*)(image+i));
+		r = _mm256_mullo_epi32(_mm256_and_si256(px, byte),
+			_mm256_set1_epi32(0x2126));
+		g = _mm256_and_si256(_mm256_srli_epi32(px, 8), byte);
+		b = _mm256_and_si256(_mm256_srli_epi32(px, 16), byte);
+		lo = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_add_pd(
+			_mm256_cvtepi32_pd(_mm256_castsi256_si128(r)),
+			_mm256_mul_pd(_mm256_set1_pd(0.7152),
+			_mm256_cvtepi32_pd(_mm256_castsi256_si128(g)))),
+			_mm256_mul_pd(_mm256_set1_pd(0.0722),
+			_mm256_cvtepi32_pd(_mm256_castsi256_si128(b)))));
+		hi = _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_add_pd(
+			_mm256_cvtepi32_pd(_mm256_extracti128_si256(r, 1)),
+			_mm256_mul_pd(_mm256_set1_pd(0.7152),
+			_mm256_cvtepi32_pd(_mm256_extracti128_si256(g, 1)))),
+			_mm256_mul_pd(_mm256_set1_pd(0.0722),
+			_mm256_cvtepi32_pd(_mm256_extracti128_si256(b, 1)))));
+		gray = _mm256_inserti128_si256(_mm256_castsi128_si256(lo),
+			hi, 1);
+		gray = _mm256_andnot_si256(_mm256_cmpgt_epi32(
+			_mm256_set1_epi32(128), gray), gray);
+		gray = _mm256_mullo_epi32(_mm256_and_si256(gray, byte),
+			_mm256_set1_epi32(0x010101));
+		px = _mm256_or_si256(gray, _mm256_and_si256(px, alpha));
+		_mm256_storeu_si256((__m256i*)(image+i), px);
+	}
+	grey_scalar(image, i, to);
+}
+
+/* 16 pixels at a time, the rest in plain C */
+__attribute__((target("avx512f")))
+void grey_avx512(unsigned char* image, size_t from, size_t to)
+{
+	const __m512i byte = _mm512_set1_epi32(0xFF);
+	const __m512i alpha = _mm512_set1_epi32(0xFF000000);
+	__m512i px, r, g, b, gray;
+	__m256i lo, hi;
+	size_t i;
+
+	for (i=from; i+64<=to; i+=64) {
+		px = _mm512_loadu_si512((void*)(image+i));
+		r = _mm512_mullo_epi32(_mm512_and_si512(px, byte),
+			_mm512_set1_epi32(0x2126));
+		g = _mm512_and_si512(_mm512_srli_epi32(px, 8), byte);
+		b = _mm512_and_si512(_mm512_srli_epi32(px, 16), byte);
+		lo = _mm512_cvttpd_epi32(_mm512_add_pd(_mm512_add_pd(
+			_mm512_cvtepi32_pd(_mm512_castsi512_si256(r)),
+			_mm512_mul_pd(_mm512_set1_pd(0.7152),
+			_mm512_cvtepi32_pd(_mm512_castsi512_si256(g)))),
+			_mm512_mul_pd(_mm512_set1_pd(0.0722),
+			_mm512_cvtepi32_pd(_mm512_castsi512_si256(b)))));
+		hi = _mm512_cvttpd_epi32(_mm512_add_pd(_mm512_add_pd(
+			_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(r, 1)),
+			_mm512_mul_pd(_mm512_set1_pd(0.7152),
+			_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(g, 1)))),
+			_mm512_mul_pd(_mm512_set1_pd(0.0722),
+			_mm512_cvtepi32_pd(_mm512_extracti64x4_epi64(b, 1)))));
+		gray = _mm512_inserti64x4(_mm512_castsi256_si512(lo), hi, 1);
+		gray = _mm512_maskz_mov_epi32(_mm512_cmpge_epi32_mask(gray,
+			_mm512_set1_epi32(128)), gray);
+		gray = _mm512_mullo_epi32(_mm512_and_si512(gray, byte),
+			_mm512_set1_epi32(0x010101));
+		px = _mm512_or_si512(gray, _mm512_and_si512(px, alpha));
+		_mm512_storeu_si512((void*)(image+i), px);
+	}
+	grey_scalar(image, i, to);
+}
+#endif
+
+/* The grey() of every ISA_* */
+const grey_func greys[N_ISA] = {
+	grey_scalar, ISA_VARIANT(grey_sse41), ISA_VARIANT(grey_avx2),
+	ISA_VARIANT(grey_avx512)
+};
+
+int main(int argc, char** argv)
 {
 	const char*   in = "image.png";
 	const char*   out = "output_image.png";
 
-	unsigned      error, width, height, i, gray;
+	unsigned      error, width, height;
 	unsigned char *image = 0;
 
 	size_t        buff_size;
+	int           max_isa = N_ISA-1;
+
+	for (int i=1; i<argc; i++) {
+		if (isa_option(argv[i], &max_isa))
+			continue;
+		printf("Usage: %s " ISA_USAGE "\n", argv[0]);
+		return 3;
+	}
+	grey = greys[cpu_dispatch(max_isa)];
 
 	/* Load and decode the image */
 	error = lodepng_decode32_file(&image, &width, &height, in);
@@ -31,15 +198,7 @@ int main(void)
 	 * Formula for luminance of a color by CIE:
 	 * 	L = 0.2126xR + 0.7152xG + 0.0722xB
 	 */
-
-	for (i=0; i<buff_size; i+=4) {
-		gray = 0x2126*image[i] + 0.7152*image[i+1] + 0.0722*image[i+2];
-		if (gray < 128)
-			gray = 0;
-		image[i] = gray;
-		image[i+1] = gray;
-		image[i+2] = gray;
-	}
+	grey(image, 0, buff_size);
 	
 	/* Write the image as output_image.png */
 	error = lodepng_encode32_file(out, image, width, height);	
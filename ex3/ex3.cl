@@ -1,22 +1,37 @@
-__kernel void mat_add(__global float* m1, 
+/*
+ * Each work-item adds PPW runs of VEC floats, the last run may be short.
+ * The host picks VEC and PPW with -D, see --tune.
+ */
+#ifndef VEC
+#define VEC 1
+#endif
+#ifndef PPW
+#define PPW 1
+#endif
+
+#define CAT(a, b) a##b
+#define XCAT(a, b) CAT(a, b)
+
+__kernel void mat_add(__global float* m1,
 		       __global float* m2,
-		       __global float* res)
+		       __global float* res,
+		       unsigned int n)
 {
-	int i = get_global_id(0);
-	res[i] = m1[i] + m2[i];
+	int first = get_global_id(0) * PPW * VEC;
+	int i;
 
-#if 0
-	int i = 10*get_global_id(0);
-	res[i+0] = m1[i+0] + m2[i+0];
-	res[i+1] = m1[i+1] + m2[i+1];
-	res[i+2] = m1[i+2] + m2[i+2];
-	res[i+3] = m1[i+3] + m2[i+3];
-	res[i+4] = m1[i+4] + m2[i+4];
-	res[i+5] = m1[i+5] + m2[i+5];
-	res[i+6] = m1[i+6] + m2[i+6];
-	res[i+7] = m1[i+7] + m2[i+7];
-	res[i+8] = m1[i+8] + m2[i+8];
-	res[i+9] = m1[i+9] + m2[i+9];
+	for (int p=0; p<PPW; p++) {
+		i = first + p*VEC;
+		if (i + VEC <= n) {
+#if VEC == 1
+			res[i] = m1[i] + m2[i];
+#else
+			XCAT(vstore, VEC)(XCAT(vload, VEC)(0, m1 + i) +
+				XCAT(vload, VEC)(0, m2 + i), 0, res + i);
 #endif
+		} else {
+			for (; i<n; i++)
+				res[i] = m1[i] + m2[i];
+		}
+	}
 }
-
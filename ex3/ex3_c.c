@@ -1,10 +1,23 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+/*
+ * add_m has a variant for AVX-512F, AVX2, SSE4.1 and plain C, picked at
+ * startup, see cpu_dispatch.h and --isa.
+ */
+#include "../common/cpu_dispatch.h"
+
 #define OUTPUT "output_c.txt"
 #define SIZE 500
 
+typedef void (*add_func)(float m1[][SIZE], float m2[][SIZE],
+	float res[][SIZE]);
+
+/* add_m() variant, see cpu_dispatch() */
+add_func add_m;
+
 void populate(float m1[][SIZE], float m2[][SIZE])
 {
 	int i, j;
@@ -16,7 +29,7 @@ void populate(float m1[][SIZE], float m2[][SIZE])
 	}
 }
 
-void add_m(float m1[][SIZE], float m2[][SIZE], float res[][SIZE])
+void add_m_scalar(float m1[][SIZE], float m2[][SIZE], float res[][SIZE])
 {
 	int i, j;
 	for (i=0; i<SIZE; i++)
@@ -24,6 +37,63 @@ void add_m(float m1[][SIZE], float m2[][SIZE], float res[][SIZE])
 			res[i][j] = m1[i][j] + m2[i][j];
 }
 
+#ifdef CPU_X86
+/*
+ * The matrices are contiguous, so the SIMD variants add them as one array
+ * of SIZE*SIZE floats and finish the last few elements in plain C.
+ */
+__attribute__((target("sse4.1")))
+void add_m_sse41(float m1[][SIZE], float m2[][SIZE], float res[][SIZE])
+{
+	float* a = m1[0];
+	float* b = m2[0];
+	float* c = res[0];
+	int i;
+
+	for (i=0; i+4<=SIZE*SIZE; i+=4)
+		_mm_storeu_ps(c+i, _mm_add_ps(_mm_loadu_ps(a+i),
+			_mm_loadu_ps(b+i)));
+	for (; i<SIZE*SIZE; i++)
+		c[i] = a[i] + b[i];
+}
+
+__attribute__((target("avx2")))
+void add_m_avx2(float m1[][SIZE], float m2[][SIZE], float res[][SIZE])
+{
+	float* a = m1[0];
+	float* b = m2[0];
+	float* c = res[0];
+	int i;
+
+	for (i=0; i+8<=SIZE*SIZE; i+=8)
+		_mm256_storeu_ps(c+i, _mm256_add_ps(_mm256_loadu_ps(a+i),
+			_mm256_loadu_ps(b+i)));
+	for (; i<SIZE*SIZE; i++)
+		c[i] = a[i] + b[i];
+}
+
+__attribute__((target("avx512f")))
+void add_m_avx512(float m1[][SIZE], float m2[][SIZE], float res[][SIZE])
+{
+	float* a = m1[0];
+	float* b = m2[0];
+	float* c = res[0];
+	int i;
+
+	for (i=0; i+16<=SIZE*SIZE; i+=16)
+		_mm512_storeu_ps(c+i, _mm512_add_ps(_mm512_loadu_ps(a+i),
+			_mm512_loadu_ps(b+i)));
+	for (; i<SIZE*SIZE; i++)
+		c[i] = a[i] + b[i];
+}
+#endif
+
+/* The add_m() of every ISA_* */
+const add_func adds[N_ISA] = {
+	add_m_scalar, ISA_VARIANT(add_m_sse41), ISA_VARIANT(add_m_avx2),
+	ISA_VARIANT(add_m_avx512)
+};
+
 void print_results(float res[][SIZE])
 {
 	int i, j;
@@ -39,10 +109,19 @@ void print_results(float res[][SIZE])
 			fprintf(out, "%f\n", res[i][j]);
 }
 
-int main(void)
+int main(int argc, char** argv)
 {
 	float m1[SIZE][SIZE], m2[SIZE][SIZE], res[SIZE][SIZE];
 	clock_t s, e, t;
+	int max_isa = N_ISA-1;
+
+	for (int i=1; i<argc; i++) {
+		if (isa_option(argv[i], &max_isa))
+			continue;
+		printf("Usage: %s " ISA_USAGE "\n", argv[0]);
+		return 3;
+	}
+	add_m = adds[cpu_dispatch(max_isa)];
 
 	populate(m1, m2);
 
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <time.h>
 
@@ -10,6 +11,7 @@
 #else
 #include <CL/cl.h>
 #endif
+#include "../common/tune.h"
 
 #define PROGRAM_FILE "ex3.cl"
 #define KERNEL_FUNC "mat_add"
@@ -17,6 +19,13 @@
 
 #define SIZE 500
 
+/* Launch of mat_add; a local size of 0 leaves it to the driver */
+struct config {
+	size_t local;
+	int vec;
+	int ppw;
+};
+
 void error(cl_int err, char* func_name)
 {
 	printf("Error %d in %s\n", err, func_name);
@@ -118,14 +127,15 @@ cl_program create_program(cl_context ctx)
 	return program;
 }
 
-cl_program build_program(cl_program program, cl_context ctx, cl_device_id dev)
+cl_program build_program(cl_program program, cl_context ctx, cl_device_id dev,
+	const char* args)
 {
 	char		*program_log;
 	size_t		log_size;
 	cl_int		err;
 
 	/* Build program */
-	err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+	err = clBuildProgram(program, 0, NULL, args, NULL, NULL);
 	if (err < 0) {
 		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG,
 			0, NULL, &log_size);
@@ -140,6 +150,127 @@ cl_program build_program(cl_program program, cl_context ctx, cl_device_id dev)
 	return program;
 }
 
+/*
+ * Builds mat_add for conf and runs it runs times over n floats. Returns
+ * the fastest run in ms, or -1 if the device does not take the launch.
+ */
+double run_mat_add(cl_context ctx, cl_device_id dev, cl_command_queue queue,
+	struct config* conf, cl_mem m1_buff, cl_mem m2_buff, cl_mem res_buff,
+	cl_uint n, int runs)
+{
+	cl_program	program;
+	cl_kernel	kernel;
+	cl_event	event;
+	cl_ulong	start, end;
+	cl_int		err;
+	size_t		global_item_size;
+	size_t		max_local;
+	double		best = -1;
+	char		args[64];
+
+	sprintf(args, "-DVEC=%d -DPPW=%d", conf->vec, conf->ppw);
+	program = create_program(ctx);
+	program = build_program(program, ctx, dev, args);
+	kernel = clCreateKernel(program, KERNEL_FUNC, &err);
+	if (err < 0) error(err, "clCreateKernel");
+
+	err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &m1_buff);
+	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &m2_buff);
+	err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &res_buff);
+	err |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &n);
+	if (err < 0) error(err, "clSetKernelArg");
+
+	clGetKernelWorkGroupInfo(kernel, dev, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(max_local), &max_local, NULL);
+	global_item_size = (n + conf->vec*conf->ppw - 1) /
+		(conf->vec*conf->ppw);
+	if (conf->local > 0)
+		global_item_size = (global_item_size + conf->local - 1) /
+			conf->local * conf->local;
+
+	for (int r=0; conf->local <= max_local && r<runs; r++) {
+		err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL,
+			&global_item_size, conf->local ? &conf->local : NULL,
+			0, NULL, &event);
+		if (err < 0)
+			break;
+		clWaitForEvents(1, &event);
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+			sizeof(start), &start, NULL);
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+			sizeof(end), &end, NULL);
+		clReleaseEvent(event);
+		if (best < 0 || (end-start)/1000000.0 < best)
+			best = (end-start)/1000000.0;
+	}
+
+	clReleaseKernel(kernel);
+	clReleaseProgram(program);
+	return best;
+}
+
+/* Sweep of tune_mat_add(), every local size, vector width and ppw */
+const size_t	tune_locals[] = {0, 4, 16, 32, 64, 128, 256};
+const int	tune_vecs[] = {1, 2, 4, 8, 16};
+const int	tune_ppws[] = {1, 2, 4, 8};
+#define N_TUNE_VECS (sizeof(tune_vecs)/sizeof(tune_vecs[0]))
+#define N_TUNE_PPWS (sizeof(tune_ppws)/sizeof(tune_ppws[0]))
+
+/* What the tune_space callbacks of mat_add work on */
+struct mat_add_tune {
+	cl_context		ctx;
+	cl_device_id		dev;
+	cl_command_queue	queue;
+	cl_mem			m1_buff,
+				m2_buff,
+				res_buff;
+	struct config		conf;
+};
+
+void mat_add_set(void* arg, int i, char* conf, size_t size)
+{
+	struct mat_add_tune* t = arg;
+
+	t->conf.local = tune_locals[i / (N_TUNE_VECS*N_TUNE_PPWS)];
+	t->conf.vec = tune_vecs[i / N_TUNE_PPWS % N_TUNE_VECS];
+	t->conf.ppw = tune_ppws[i % N_TUNE_PPWS];
+	snprintf(conf, size, "local=%zu vec=%d ppw=%d", t->conf.local,
+		t->conf.vec, t->conf.ppw);
+}
+
+double mat_add_run(void* arg)
+{
+	struct mat_add_tune* t = arg;
+
+	return run_mat_add(t->ctx, t->dev, t->queue, &t->conf, t->m1_buff,
+		t->m2_buff, t->res_buff, SIZE*SIZE, TUNE_RUNS);
+}
+
+/*
+ * --tune: a configuration only counts if its sum is right, res holds the
+ * expected one during the sweep.
+ */
+void tune_mat_add(cl_context ctx, cl_device_id dev, cl_command_queue queue,
+	cl_mem m1_buff, cl_mem m2_buff, cl_mem res_buff, const char* key,
+	float m1[][SIZE], float m2[][SIZE], float res[][SIZE],
+	struct config* best)
+{
+	struct mat_add_tune	t = {ctx, dev, queue, m1_buff, m2_buff,
+					res_buff, *best};
+	struct tune_space	space = {
+		sizeof(tune_locals)/sizeof(tune_locals[0]) * N_TUNE_VECS *
+			N_TUNE_PPWS,
+		mat_add_set, mat_add_run, &t
+	};
+
+	for (int i=0; i<SIZE; i++)
+		for (int j=0; j<SIZE; j++)
+			res[i][j] = m1[i][j] + m2[i][j];
+	if (tune_sweep(queue, res_buff, SIZE*SIZE*sizeof(float), res, key,
+	    &space) >= 0)
+		*best = t.conf;
+}
+
 void print_results(float res[][SIZE])
 {
 	FILE 	*out;
@@ -156,14 +287,12 @@ void print_results(float res[][SIZE])
 	fclose(out);
 }
 
-int main(void)
+int main(int argc, char** argv)
 {
 	/* Host devices, program and kernel structures */
 	cl_device_id 		device;
 	cl_context 		context;
 	cl_command_queue	queue;
-	cl_program 		program;
-	cl_kernel		kernel;
 
 	/* Data and buffers */
 	float			m1[SIZE][SIZE],
@@ -174,12 +303,19 @@ int main(void)
 				res_buff;
 	/* Misc */
 	cl_int			err;
-	clock_t 		s, e, t;
-	size_t 			local_item_size,
-				global_item_size;
-
-	local_item_size = 4;
-	global_item_size = SIZE*SIZE;
+	double			total;
+	struct config		conf = {4, 1, 1};
+	char			key[TUNE_LINE],
+				conf_str[TUNE_LINE],
+				shape[32];
+	int			tune = 0;
+
+	if (argc == 2 && strcmp(argv[1], "--tune") == 0) {
+		tune = 1;
+	} else if (argc > 1) {
+		printf("Usage: %s [--tune]\n", argv[0]);
+		return 3;
+	}
 
 	/* Populate matrices */
 	populate(m1, m2);
@@ -189,10 +325,6 @@ int main(void)
 	context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
 	if (err < 0) error(err, "clCreateContext");
 
-	/* Create and build the program */
-	program = create_program(context);
-	program = build_program(program, context, device);
-
 	/* Create buffers */
 	m1_buff = clCreateBuffer(context, CL_MEM_READ_ONLY |
 		CL_MEM_COPY_HOST_PTR, sizeof(m1), m1, &err);
@@ -205,7 +337,8 @@ int main(void)
 	if (err < 0) error(err, "clCreateBuffer_res");
 
 	/* Create command queue */
-	queue = clCreateCommandQueue(context, device, 0, &err);
+	queue = clCreateCommandQueue(context, device,
+		CL_QUEUE_PROFILING_ENABLE, &err);
 	if (err < 0) error(err, "clCreateCommandQueue");
 
 
@@ -217,25 +350,27 @@ int main(void)
 	if (err < 0) error(err, "EnqueueWriteBuffer");
 
 
-	/* Create Kernel */
-	kernel = clCreateKernel(program, KERNEL_FUNC, &err);
-	if (err < 0) error(err, "clCreateKernel");
-
-	/* Create kernel arguments */
-	err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &m1_buff);
-	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &m2_buff);
-	err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &res_buff);
-	if (err < 0) error(err, "clSetKernelArg");
-
-	s = clock();
-	/* Enqueue the command queue to device */
-	err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_item_size,
-		&local_item_size, 0, NULL, NULL);
-	e = clock();
-	if (err < 0) error(err, "clEnqueueNDRangeKernel");
+	/* Launch configuration: swept with --tune, else the stored one */
+	sprintf(shape, "%d", SIZE*SIZE);
+	tune_key(key, sizeof(key), device, KERNEL_FUNC, shape);
+	if (tune) {
+		tune_mat_add(context, device, queue, m1_buff, m2_buff,
+			res_buff, key, m1, m2, res, &conf);
+	} else if (tune_load(key, conf_str, sizeof(conf_str)) &&
+	    sscanf(conf_str, "local=%zu vec=%d ppw=%d", &conf.local,
+		    &conf.vec, &conf.ppw) == 3) {
+		printf("Tuned: %s\n", conf_str);
+	}
 
-	t = (e-s);
-	printf("clock ticks: %ld\n", t);
+	/* Build, enqueue and time the kernel */
+	total = run_mat_add(context, device, queue, &conf, m1_buff, m2_buff,
+		res_buff, SIZE*SIZE, 1);
+	if (total < 0) {
+		printf("The device does not take local size %zu\n",
+			conf.local);
+		exit(1);
+	}
+	printf("Kernel execution time: %0.3f ms\n", total);
 
 	/* Read output buffer */
 	err = clEnqueueReadBuffer(queue, res_buff, CL_TRUE, 0, sizeof(res),
@@ -249,12 +384,9 @@ int main(void)
 	clReleaseMemObject(m1_buff);
 	clReleaseMemObject(m2_buff);
 	clReleaseMemObject(res_buff);
-	clReleaseKernel(kernel);
 	clReleaseCommandQueue(queue);
-	clReleaseProgram(program);
 	clReleaseContext(context);
 
 	printf("\n");
 	return 0;
 }
-
@@ -1,6 +1,16 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <math.h>
 #include "lodepng.h"
+#include "../common/cl_buffer.h"
+#include "../common/cl_cache.h"
+#include "../common/tune.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 #if defined __APPLE__
@@ -11,10 +21,78 @@
 
 #define PROGRAM "ex4.cl"
 #define FUNC "moving_avg"
+#define F_BOX_ROWS "box_rows"
+#define F_BOX_COLS "box_cols"
+
+/* Pixels of one running sum of box_rows and box_cols */
+#define BOX_SEG 32
+
+#define F_CONV2D "conv2d"
+#define F_CONV_ROWS "conv_rows"
+#define F_CONV_COLS "conv_cols"
+
+/* Largest matrix and longest chain of --conv */
+#define CONV_MAX 15
+#define CONV_CHAIN 16
+
+/* Rank 1 test of conv_plan() and the Jacobi SVD behind it */
+#define CONV_RANK_EPS 1e-6
+#define SVD_EPS 1e-15
+#define SVD_SWEEPS 32
 
 #define INPUT "image.png"
 #define OUTPUT "output.png"
 
+/* Launch of moving_avg; a local size of 0 leaves it to the driver */
+struct config {
+	size_t local;
+	int ppw;
+};
+
+/* One filter of --conv, row and col are set when it is separable */
+struct conv {
+	char name[64];
+	int k;
+	float coef[CONV_MAX*CONV_MAX];
+	float bias;
+	int separable;
+	float row[CONV_MAX];
+	float col[CONV_MAX];
+};
+
+/* Where conv_chain() runs, on the host when ctx is NULL */
+struct conv_backend {
+	cl_context ctx;
+	cl_device_id dev;
+	cl_command_queue queue;
+};
+
+/*
+ * Filters --conv knows by name, coef * scale. The gradients are offset by
+ * bias so that negative responses stay visible.
+ */
+struct conv_preset {
+	const char* name;
+	int k;
+	float scale;
+	float bias;
+	float coef[25];
+};
+
+static const struct conv_preset conv_presets[] = {
+	{"box3", 3, 1/9.0f, 0, {1, 1, 1, 1, 1, 1, 1, 1, 1}},
+	{"gauss5", 5, 1/256.0f, 0, {
+		1,  4,  6,  4, 1,
+		4, 16, 24, 16, 4,
+		6, 24, 36, 24, 6,
+		4, 16, 24, 16, 4,
+		1,  4,  6,  4, 1}},
+	{"sharpen", 3, 1, 0, {0, -1, 0, -1, 5, -1, 0, -1, 0}},
+	{"sobel_x", 3, 1, 128, {-1, 0, 1, -2, 0, 2, -1, 0, 1}},
+	{"sobel_y", 3, 1, 128, {-1, -2, -1, 0, 0, 0, 1, 2, 1}},
+	{"laplace", 3, 1, 128, {0, 1, 0, 1, -4, 1, 0, 1, 0}},
+};
+
 void error(cl_int err, char* func_name)
 {
 	printf("Error %d in %s\n", err, func_name);
@@ -37,51 +115,609 @@ cl_device_id create_device(void)
 	return dev;
 }
 
-cl_program build_program(cl_context ctx, cl_device_id dev, const char* name)
+/*
+ * Builds moving_avg for conf and runs it runs times. Returns the fastest
+ * run in ms, or -1 if the device does not take the launch.
+ */
+double run_moving_avg(cl_context ctx, cl_device_id dev, cl_command_queue queue,
+	struct config* conf, cl_mem buff_in, cl_mem buff_out, unsigned width,
+	unsigned height, int runs)
 {
-	cl_program program;
-	FILE 	   *p_handle;
-	char 	   *p_buffer;
-	char 	   *p_log;
-	size_t 	   p_size;
-	size_t 	   log_size;
-	cl_int 	   err;
+	cl_program	 program;
+	cl_kernel	 kernel;
+	cl_event	 event;
+	cl_ulong	 start, end;
+	cl_int 		 err;
+	size_t		 global_item_size;
+	size_t		 max_local;
+	double		 best = -1;
+	char		 args[32];
 
-	p_handle = fopen(name, "r");
-	if (p_handle == NULL) {
-		perror("Couldn't find the file");
-		exit(1);
+	sprintf(args, "-DPPW=%d", conf->ppw);
+	program = build_program(ctx, dev, PROGRAM, args);
+	kernel = clCreateKernel(program, FUNC, &err);
+	if (err < 0) error(err, "clCreateKernel");
+
+	err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buff_in);
+	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &buff_out);
+	err |= clSetKernelArg(kernel, 2, sizeof(unsigned), (void*)&width);
+	err |= clSetKernelArg(kernel, 3, sizeof(unsigned), (void*)&height);
+	if (err < 0) error(err, "clSetKernelArg");
+
+	clGetKernelWorkGroupInfo(kernel, dev, CL_KERNEL_WORK_GROUP_SIZE,
+			sizeof(max_local), &max_local, NULL);
+	global_item_size = (width*height + conf->ppw-1) / conf->ppw;
+	if (conf->local > 0)
+		global_item_size = (global_item_size + conf->local-1) /
+			conf->local * conf->local;
+
+	for (int r=0; conf->local <= max_local && r<runs; r++) {
+		err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL,
+				&global_item_size,
+				conf->local ? &conf->local : NULL, 0, NULL,
+				&event);
+		if (err < 0)
+			break;
+		clWaitForEvents(1, &event);
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+				sizeof(start), &start, NULL);
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+				sizeof(end), &end, NULL);
+		clReleaseEvent(event);
+		if (best < 0 || (end-start)/1000000.0 < best)
+			best = (end-start)/1000000.0;
 	}
-	fseek(p_handle, 0, SEEK_END);
-	p_size = ftell(p_handle);
-	rewind(p_handle);
-	p_buffer = (char*)malloc(p_size+1);
-	p_buffer[p_size] = '\0';
-	fread(p_buffer, sizeof(char), p_size, p_handle);
-	fclose(p_handle);
-
-	program = clCreateProgramWithSource(ctx, 1, (const char**)&p_buffer,
-			&p_size, &err);
-	if (err < 0) error(err, "clCreateProgramWithSource");
-	free(p_buffer);
-
-	err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-	if (err < 0) {
-		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 0,
-				NULL, &log_size);
-		p_log = (char *) malloc(log_size+1);
-		p_log[log_size] = '\0';
-		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG,
-			log_size+1, p_log, NULL);
-		printf("%s\n", p_log);
-		free(p_log);
-		exit(1);
+
+	clReleaseKernel(kernel);
+	clReleaseProgram(program);
+	return best;
+}
+
+/* Sweep of tune_moving_avg(), every local size and pixels per work-item */
+const size_t tune_locals[] = {0, 16, 32, 64, 128, 256};
+const int tune_ppws[] = {1, 2, 4, 8};
+#define N_TUNE_PPWS (sizeof(tune_ppws)/sizeof(tune_ppws[0]))
+
+/* What the tune_space callbacks of moving_avg work on */
+struct moving_avg_tune {
+	cl_context ctx;
+	cl_device_id dev;
+	cl_command_queue queue;
+	cl_mem buff_in;
+	cl_mem buff_out;
+	unsigned width;
+	unsigned height;
+	struct config conf;
+};
+
+void moving_avg_set(void* arg, int i, char* conf, size_t size)
+{
+	struct moving_avg_tune* t = arg;
+
+	t->conf.local = tune_locals[i / N_TUNE_PPWS];
+	t->conf.ppw = tune_ppws[i % N_TUNE_PPWS];
+	snprintf(conf, size, "local=%zu ppw=%d", t->conf.local, t->conf.ppw);
+}
+
+double moving_avg_run(void* arg)
+{
+	struct moving_avg_tune* t = arg;
+
+	return run_moving_avg(t->ctx, t->dev, t->queue, &t->conf, t->buff_in,
+			t->buff_out, t->width, t->height, TUNE_RUNS);
+}
+
+/*
+ * --tune: the first configuration that runs gives the reference image,
+ * the others have to match it.
+ */
+void tune_moving_avg(cl_context ctx, cl_device_id dev, cl_command_queue queue,
+	cl_mem buff_in, cl_mem buff_out, unsigned width, unsigned height,
+	const char* key, struct config* best)
+{
+	struct moving_avg_tune t = {ctx, dev, queue, buff_in, buff_out, width,
+		height, *best};
+	struct tune_space space = {
+		sizeof(tune_locals)/sizeof(tune_locals[0]) * N_TUNE_PPWS,
+		moving_avg_set, moving_avg_run, &t
+	};
+
+	if (tune_sweep(queue, buff_out, width*height, NULL, key, &space) >= 0)
+		*best = t.conf;
+}
+
+/*
+ * --engine=box: box_rows then box_cols of ex4.cl over 2D ranges, with the
+ * horizontal sums in a device buffer of their own. Returns the summed
+ * kernel time in ms.
+ */
+double run_box(cl_context ctx, cl_device_id dev, cl_command_queue queue,
+	cl_mem buff_in, cl_mem buff_out, unsigned width, unsigned height,
+	int radius)
+{
+	cl_program	 program;
+	cl_kernel	 rows;
+	cl_kernel	 cols;
+	cl_mem		 buff_tmp;
+	cl_event	 events[2];
+	cl_ulong	 start, end;
+	cl_int 		 err;
+	size_t		 rows_size[2];
+	size_t		 cols_size[2];
+	double		 total = 0;
+	char		 args[32];
+
+	sprintf(args, "-DBOX_SEG=%d", BOX_SEG);
+	program = build_program(ctx, dev, PROGRAM, args);
+	rows = clCreateKernel(program, F_BOX_ROWS, &err);
+	if (err < 0) error(err, "clCreateKernel (box_rows)");
+	cols = clCreateKernel(program, F_BOX_COLS, &err);
+	if (err < 0) error(err, "clCreateKernel (box_cols)");
+
+	buff_tmp = clCreateBuffer(ctx, CL_MEM_READ_WRITE,
+			width*height*sizeof(cl_uint), NULL, &err);
+	if (err < 0) error(err, "clCreateBuffer (tmp)");
+
+	err = clSetKernelArg(rows, 0, sizeof(cl_mem), &buff_in);
+	err |= clSetKernelArg(rows, 1, sizeof(cl_mem), &buff_tmp);
+	err |= clSetKernelArg(rows, 2, sizeof(unsigned), (void*)&width);
+	err |= clSetKernelArg(rows, 3, sizeof(unsigned), (void*)&height);
+	err |= clSetKernelArg(rows, 4, sizeof(int), (void*)&radius);
+	err |= clSetKernelArg(cols, 0, sizeof(cl_mem), &buff_tmp);
+	err |= clSetKernelArg(cols, 1, sizeof(cl_mem), &buff_out);
+	err |= clSetKernelArg(cols, 2, sizeof(unsigned), (void*)&width);
+	err |= clSetKernelArg(cols, 3, sizeof(unsigned), (void*)&height);
+	err |= clSetKernelArg(cols, 4, sizeof(int), (void*)&radius);
+	if (err < 0) error(err, "clSetKernelArg");
+
+	rows_size[0] = (width + BOX_SEG-1) / BOX_SEG;
+	rows_size[1] = height;
+	cols_size[0] = width;
+	cols_size[1] = (height + BOX_SEG-1) / BOX_SEG;
+
+	/* In order queue, the column pass waits for the row pass */
+	err = clEnqueueNDRangeKernel(queue, rows, 2, NULL, rows_size, NULL,
+			0, NULL, &events[0]);
+	if (err < 0) error(err, "clEnqueueNDRangeKernel (box_rows)");
+	err = clEnqueueNDRangeKernel(queue, cols, 2, NULL, cols_size, NULL,
+			0, NULL, &events[1]);
+	if (err < 0) error(err, "clEnqueueNDRangeKernel (box_cols)");
+	clWaitForEvents(2, events);
+
+	for (int e=0; e<2; e++) {
+		clGetEventProfilingInfo(events[e], CL_PROFILING_COMMAND_START,
+				sizeof(start), &start, NULL);
+		clGetEventProfilingInfo(events[e], CL_PROFILING_COMMAND_END,
+				sizeof(end), &end, NULL);
+		clReleaseEvent(events[e]);
+		total += (end-start)/1000000.0;
+	}
+
+	clReleaseMemObject(buff_tmp);
+	clReleaseKernel(rows);
+	clReleaseKernel(cols);
+	clReleaseProgram(program);
+	return total;
+}
+
+/*
+ * --engine=cpu: the box filter of box_rows and box_cols on the host, with
+ * the same sums and rounding. Rows are split between OpenMP threads (build
+ * with -fopenmp). The column pass keeps one running sum per column and
+ * slides all of them down a row at a time, which the compiler vectorizes.
+ */
+void box_cpu(unsigned char* in, unsigned char* out, unsigned width,
+	unsigned height, int radius)
+{
+	const int	 w = width;
+	const int	 h = height;
+	const unsigned	 n = (2*radius+1) * (2*radius+1);
+	unsigned*	 tmp = malloc(w*h*sizeof(unsigned));
+
+	#pragma omp parallel
+	{
+		unsigned* sum = malloc(w*sizeof(unsigned));
+		unsigned* top;
+		unsigned* bottom;
+		unsigned s;
+		int nth = 1;
+		int th = 0;
+		int y0, y1;
+
+		#pragma omp for
+		for (int y=0; y<h; y++) {
+			unsigned char* row = in + y*w;
+
+			s = 0;
+			for (int k=-radius; k<=radius; k++)
+				s += row[k < 0 ? 0 : k >= w ? w-1 : k];
+			for (int x=0; x<w; x++) {
+				tmp[y*w+x] = s;
+				s += row[x+radius+1 < w ? x+radius+1 : w-1];
+				s -= row[x-radius > 0 ? x-radius : 0];
+			}
+		}
+
+#ifdef _OPENMP
+		nth = omp_get_num_threads();
+		th = omp_get_thread_num();
+#endif
+		/* Contiguous bands of rows, the sums start over in each */
+		y0 = (long)h * th / nth;
+		y1 = (long)h * (th+1) / nth;
+
+		for (int x=0; x<w; x++)
+			sum[x] = 0;
+		for (int k=y0-radius; k<=y0+radius && y0<y1; k++) {
+			top = tmp + (k < 0 ? 0 : k >= h ? h-1 : k)*w;
+			#pragma omp simd
+			for (int x=0; x<w; x++)
+				sum[x] += top[x];
+		}
+		for (int y=y0; y<y1; y++) {
+			top = tmp + (y+radius+1 < h ? y+radius+1 : h-1)*w;
+			bottom = tmp + (y-radius > 0 ? y-radius : 0)*w;
+			#pragma omp simd
+			for (int x=0; x<w; x++) {
+				out[y*w+x] = (sum[x] + n/2) / n;
+				sum[x] += top[x] - bottom[x];
+			}
+		}
+		free(sum);
+	}
+	free(tmp);
+}
+
+/*
+ * --conv: a chain of KxK convolutions, K odd and up to CONV_MAX. A matrix
+ * of rank 1, coef[i][j] = col[i] * row[j], runs as a row and a column pass
+ * (2K taps a pixel instead of K*K). conv_plan() finds those with an SVD.
+ */
+void conv_load_preset(const struct conv_preset* p, struct conv* c)
+{
+	snprintf(c->name, sizeof(c->name), "%s", p->name);
+	c->k = p->k;
+	c->bias = p->bias;
+	for (int i=0; i<p->k*p->k; i++)
+		c->coef[i] = p->coef[i] * p->scale;
+}
+
+/*
+ * A preset name, or a text file with K and then the K*K coefficients row
+ * by row. Returns 0 if spec is neither.
+ */
+int conv_load(const char* spec, struct conv* c)
+{
+	FILE* c_handle;
+	int ok;
+
+	for (int i=0; i<sizeof(conv_presets)/sizeof(conv_presets[0]); i++) {
+		if (strcmp(spec, conv_presets[i].name) == 0) {
+			conv_load_preset(&conv_presets[i], c);
+			return 1;
+		}
+	}
+
+	c_handle = fopen(spec, "r");
+	if (c_handle == NULL)
+		return 0;
+	snprintf(c->name, sizeof(c->name), "%s", spec);
+	c->bias = 0;
+	ok = fscanf(c_handle, "%d", &c->k) == 1 && c->k % 2 == 1 &&
+		c->k > 0 && c->k <= CONV_MAX;
+	for (int i=0; ok && i<c->k*c->k; i++)
+		ok = fscanf(c_handle, "%f", &c->coef[i]) == 1;
+	fclose(c_handle);
+	return ok;
+}
+
+/*
+ * One-sided Jacobi SVD of the kxk matrix a, row-major. The columns of
+ * u = a*V are rotated in pairs until they are orthogonal; then the singular
+ * values are their norms, u is normalized and v holds the right singular
+ * vectors as columns. Small k only, the sweeps are O(k^3).
+ */
+void svd_jacobi(int k, const double* a, double* u, double* s, double* v)
+{
+	double alpha, beta, gamma, zeta, t, cs, sn, tmp;
+	int rotated = 1;
+
+	memcpy(u, a, k*k*sizeof(double));
+	for (int i=0; i<k*k; i++)
+		v[i] = i/k == i%k;
+
+	for (int sweep=0; rotated && sweep<SVD_SWEEPS; sweep++) {
+		rotated = 0;
+		for (int p=0; p<k-1; p++) {
+		for (int q=p+1; q<k; q++) {
+			alpha = beta = gamma = 0;
+			for (int i=0; i<k; i++) {
+				alpha += u[i*k+p] * u[i*k+p];
+				beta += u[i*k+q] * u[i*k+q];
+				gamma += u[i*k+p] * u[i*k+q];
+			}
+			if (fabs(gamma) <= SVD_EPS * sqrt(alpha*beta))
+				continue;
+			rotated = 1;
+
+			zeta = (beta - alpha) / (2*gamma);
+			t = (zeta >= 0 ? 1 : -1) /
+				(fabs(zeta) + sqrt(1 + zeta*zeta));
+			cs = 1 / sqrt(1 + t*t);
+			sn = cs * t;
+			for (int i=0; i<k; i++) {
+				tmp = u[i*k+p];
+				u[i*k+p] = cs*tmp - sn*u[i*k+q];
+				u[i*k+q] = sn*tmp + cs*u[i*k+q];
+				tmp = v[i*k+p];
+				v[i*k+p] = cs*tmp - sn*v[i*k+q];
+				v[i*k+q] = sn*tmp + cs*v[i*k+q];
+			}
+		}
+		}
+	}
+
+	for (int j=0; j<k; j++) {
+		s[j] = 0;
+		for (int i=0; i<k; i++)
+			s[j] += u[i*k+j] * u[i*k+j];
+		s[j] = sqrt(s[j]);
+		for (int i=0; i<k; i++)
+			u[i*k+j] = s[j] > 0 ? u[i*k+j] / s[j] : 0;
+	}
+}
+
+/*
+ * Separable when every singular value but the largest, s1, is below
+ * CONV_RANK_EPS * s1. The passes are then sqrt(s1) times the singular
+ * vectors of s1, with the signs flipped so that the centre taps of both
+ * are not negative.
+ */
+void conv_plan(struct conv* c)
+{
+	double a[CONV_MAX*CONV_MAX];
+	double u[CONV_MAX*CONV_MAX];
+	double v[CONV_MAX*CONV_MAX];
+	double s[CONV_MAX];
+	double sign;
+	int k = c->k;
+	int p = 0;
+	double rest = 0;
+
+	for (int i=0; i<k*k; i++)
+		a[i] = c->coef[i];
+	svd_jacobi(k, a, u, s, v);
+	for (int j=1; j<k; j++)
+		if (s[j] > s[p])
+			p = j;
+	for (int j=0; j<k; j++)
+		if (j != p && s[j] > rest)
+			rest = s[j];
+
+	c->separable = rest <= CONV_RANK_EPS * s[p];
+	if (!c->separable)
+		return;
+	sign = u[k/2*k+p] < 0 ? -1 : 1;
+	for (int i=0; i<k; i++) {
+		c->col[i] = sign * sqrt(s[p]) * u[i*k+p];
+		c->row[i] = sign * sqrt(s[p]) * v[i*k+p];
+	}
+}
+
+/* Nearest, ties to even, and saturated, convert_uchar_sat_rte() of CL */
+unsigned char conv_round(float acc)
+{
+	acc = nearbyintf(acc);
+	return acc < 0 ? 0 : acc > 255 ? 255 : acc;
+}
+
+/* The host backend, the same taps in the same order as ex4.cl */
+void conv_host(struct conv* c, unsigned char* in, unsigned char* out,
+	float* tmp, int w, int h)
+{
+	const int r = c->k/2;
+
+	if (!c->separable) {
+		#pragma omp parallel for
+		for (int y=0; y<h; y++) {
+			for (int x=0; x<w; x++) {
+				float acc = c->bias;
+				int xx, yy;
+
+				for (int dy=-r; dy<=r; dy++) {
+					yy = y+dy < 0 ? 0 : y+dy >= h ? h-1 :
+						y+dy;
+					for (int dx=-r; dx<=r; dx++) {
+						xx = x+dx < 0 ? 0 : x+dx >= w ?
+							w-1 : x+dx;
+						acc += c->coef[(dy+r)*c->k +
+							dx+r] * in[yy*w+xx];
+					}
+				}
+				out[y*w+x] = conv_round(acc);
+			}
+		}
+		return;
 	}
 
-	return program;
+	#pragma omp parallel for
+	for (int y=0; y<h; y++) {
+		for (int x=0; x<w; x++) {
+			float acc = 0;
+			int xx;
+
+			for (int dx=-r; dx<=r; dx++) {
+				xx = x+dx < 0 ? 0 : x+dx >= w ? w-1 : x+dx;
+				acc += c->row[dx+r] * in[y*w+xx];
+			}
+			tmp[y*w+x] = acc;
+		}
+	}
+	#pragma omp parallel for
+	for (int y=0; y<h; y++) {
+		for (int x=0; x<w; x++) {
+			float acc = c->bias;
+			int yy;
+
+			for (int dy=-r; dy<=r; dy++) {
+				yy = y+dy < 0 ? 0 : y+dy >= h ? h-1 : y+dy;
+				acc += c->col[dy+r] * tmp[yy*w+x];
+			}
+			out[y*w+x] = conv_round(acc);
+		}
+	}
+}
+
+/* The OpenCL backend, one filter from buff_in to buff_out */
+double conv_device(struct conv_backend* be, struct conv* c, cl_mem buff_in,
+	cl_mem buff_out, cl_mem buff_tmp, unsigned w, unsigned h)
+{
+	cl_program	 program;
+	cl_kernel	 kernels[2];
+	cl_mem		 buff_coef[2];
+	cl_event	 events[2];
+	cl_ulong	 start, end;
+	cl_int		 err;
+	size_t		 global_size[2] = {w, h};
+	double		 total = 0;
+	int		 passes = c->separable ? 2 : 1;
+	char		 args[32];
+
+	sprintf(args, "-DCONV_R=%d", c->k/2);
+	program = build_program(be->ctx, be->dev, PROGRAM, args);
+
+	if (c->separable) {
+		kernels[0] = clCreateKernel(program, F_CONV_ROWS, &err);
+		if (err < 0) error(err, "clCreateKernel (conv_rows)");
+		kernels[1] = clCreateKernel(program, F_CONV_COLS, &err);
+		if (err < 0) error(err, "clCreateKernel (conv_cols)");
+		buff_coef[0] = clCreateBuffer(be->ctx, CL_MEM_READ_ONLY |
+				CL_MEM_COPY_HOST_PTR, c->k*sizeof(float),
+				c->row, &err);
+		if (err < 0) error(err, "clCreateBuffer (row)");
+		buff_coef[1] = clCreateBuffer(be->ctx, CL_MEM_READ_ONLY |
+				CL_MEM_COPY_HOST_PTR, c->k*sizeof(float),
+				c->col, &err);
+		if (err < 0) error(err, "clCreateBuffer (col)");
+
+		err = clSetKernelArg(kernels[0], 0, sizeof(cl_mem), &buff_in);
+		err |= clSetKernelArg(kernels[0], 1, sizeof(cl_mem),
+				&buff_tmp);
+		err |= clSetKernelArg(kernels[0], 4, sizeof(cl_mem),
+				&buff_coef[0]);
+		err |= clSetKernelArg(kernels[1], 0, sizeof(cl_mem),
+				&buff_tmp);
+	} else {
+		kernels[1] = clCreateKernel(program, F_CONV2D, &err);
+		if (err < 0) error(err, "clCreateKernel (conv2d)");
+		buff_coef[1] = clCreateBuffer(be->ctx, CL_MEM_READ_ONLY |
+				CL_MEM_COPY_HOST_PTR,
+				c->k*c->k*sizeof(float), c->coef, &err);
+		if (err < 0) error(err, "clCreateBuffer (coef)");
+
+		err = clSetKernelArg(kernels[1], 0, sizeof(cl_mem), &buff_in);
+	}
+	/* The last pass has the same arguments either way */
+	err |= clSetKernelArg(kernels[1], 1, sizeof(cl_mem), &buff_out);
+	err |= clSetKernelArg(kernels[1], 4, sizeof(cl_mem), &buff_coef[1]);
+	err |= clSetKernelArg(kernels[1], 5, sizeof(float), &c->bias);
+	for (int p=2-passes; p<2; p++) {
+		err |= clSetKernelArg(kernels[p], 2, sizeof(unsigned), &w);
+		err |= clSetKernelArg(kernels[p], 3, sizeof(unsigned), &h);
+	}
+	if (err < 0) error(err, "clSetKernelArg");
+
+	for (int p=2-passes; p<2; p++) {
+		err = clEnqueueNDRangeKernel(be->queue, kernels[p], 2, NULL,
+				global_size, NULL, 0, NULL, &events[p]);
+		if (err < 0) error(err, "clEnqueueNDRangeKernel (conv)");
+	}
+	for (int p=2-passes; p<2; p++) {
+		clWaitForEvents(1, &events[p]);
+		clGetEventProfilingInfo(events[p], CL_PROFILING_COMMAND_START,
+				sizeof(start), &start, NULL);
+		clGetEventProfilingInfo(events[p], CL_PROFILING_COMMAND_END,
+				sizeof(end), &end, NULL);
+		clReleaseEvent(events[p]);
+		total += (end-start)/1000000.0;
+		clReleaseKernel(kernels[p]);
+		clReleaseMemObject(buff_coef[p]);
+	}
+	clReleaseProgram(program);
+	return total;
+}
+
+void conv_report(struct conv* c, double ms)
+{
+	printf("Filter %s: %dx%d, %s, %0.3f ms\n", c->name, c->k, c->k,
+			c->separable ? "separable" : "2D", ms);
 }
 
+/*
+ * Runs the n filters of convs one after the other from in to out, on the
+ * host when be->ctx is NULL and on the device of be otherwise, where the
+ * image stays between the filters. Returns the time in ms, wall time on
+ * the host and kernel time on the device.
+ */
+double conv_chain(struct conv_backend* be, struct conv* convs, int n,
+	unsigned char* in, unsigned char* out, unsigned w, unsigned h)
+{
+	unsigned char*	 img[2];
+	cl_mem		 buff_img[2];
+	cl_mem		 buff_tmp;
+	cl_int		 err;
+	float*		 tmp;
+	double		 total = 0;
+	double		 ms;
+	size_t		 size = w*h;
+
+	for (int f=0; f<n; f++)
+		conv_plan(&convs[f]);
+
+	if (be->ctx == NULL) {
+		img[0] = malloc(size);
+		img[1] = malloc(size);
+		tmp = malloc(size*sizeof(float));
+		memcpy(img[0], in, size);
+		for (int f=0; f<n; f++) {
+			ms = now_ms();
+			conv_host(&convs[f], img[f%2], img[(f+1)%2], tmp, w, h);
+			ms = now_ms() - ms;
+			conv_report(&convs[f], ms);
+			total += ms;
+		}
+		memcpy(out, img[n%2], size);
+		free(img[0]);
+		free(img[1]);
+		free(tmp);
+		return total;
+	}
 
+	buff_img[0] = clCreateBuffer(be->ctx, CL_MEM_READ_WRITE |
+			CL_MEM_COPY_HOST_PTR, size, in, &err);
+	if (err < 0) error(err, "clCreateBuffer (conv)");
+	buff_img[1] = clCreateBuffer(be->ctx, CL_MEM_READ_WRITE, size, NULL,
+			&err);
+	if (err < 0) error(err, "clCreateBuffer (conv)");
+	buff_tmp = clCreateBuffer(be->ctx, CL_MEM_READ_WRITE,
+			size*sizeof(float), NULL, &err);
+	if (err < 0) error(err, "clCreateBuffer (conv tmp)");
+
+	for (int f=0; f<n; f++) {
+		ms = conv_device(be, &convs[f], buff_img[f%2],
+				buff_img[(f+1)%2], buff_tmp, w, h);
+		conv_report(&convs[f], ms);
+		total += ms;
+	}
+	err = clEnqueueReadBuffer(be->queue, buff_img[n%2], CL_TRUE, 0, size,
+			out, 0, NULL, NULL);
+	if (err < 0) error(err, "clEnqueueReadBuffer");
+
+	clReleaseMemObject(buff_img[0]);
+	clReleaseMemObject(buff_img[1]);
+	clReleaseMemObject(buff_tmp);
+	return total;
+}
 
 unsigned char* read_image(unsigned* width, unsigned* height)
 {
@@ -105,11 +741,12 @@ void write_image(unsigned char* image, unsigned width, unsigned height)
 }
 
 
-int main(void)
+int main(int argc, char** argv)
 {
 	/* For LodePNG */
 	unsigned char* 	 image = 0;
 	unsigned char*   image_out = 0;
+	unsigned char*   host_out = 0;
 	unsigned 	 width;
 	unsigned 	 height;
 	size_t 	 	 buff_size;
@@ -117,18 +754,74 @@ int main(void)
 	/* For openCL */
 	cl_device_id 	 device;
 	cl_context	 context;
-	size_t		 local_item_size;
-	size_t		 global_item_size;
-
-	cl_program	 program;
-	cl_kernel	 kernel;
-
 	cl_command_queue queue;
 
 	cl_mem		 buff_in;
 	cl_mem		 buff_out;
 
 	cl_int 		 err;
+	int		 unified;
+
+	/* For --tune */
+	struct config	 conf = {64, 1};
+	char		 key[TUNE_LINE];
+	char		 conf_str[TUNE_LINE];
+	char		 shape[32];
+	double		 total;
+	int		 tune = 0;
+
+	/* avg: moving_avg, box: box_rows + box_cols, cpu: box_cpu() */
+	const char*	 engine = "avg";
+	int		 radius = 2;
+
+	/* --conv replaces the engine, on the host with --engine=cpu */
+	struct conv	 convs[CONV_CHAIN];
+	struct conv_backend be = {NULL, NULL, NULL};
+	char		 spec[FILENAME_MAX];
+	const char*	 next;
+	int		 nconv = 0;
+
+
+	for (int i=1; i<argc; i++) {
+		if (strcmp(argv[i], "--tune") == 0) {
+			tune = 1;
+		} else if (strcmp(argv[i], "--engine=avg") == 0 ||
+		    strcmp(argv[i], "--engine=box") == 0 ||
+		    strcmp(argv[i], "--engine=cpu") == 0) {
+			engine = argv[i]+9;
+		} else if (strncmp(argv[i], "--radius=", 9) == 0) {
+			radius = atoi(argv[i]+9);
+			if (radius < 0) radius = 0;
+		} else if (strncmp(argv[i], "--conv=", 7) == 0) {
+			/* Comma-separated, applied left to right */
+			for (next=argv[i]+7; *next; ) {
+				if (nconv == CONV_CHAIN) {
+					printf("--conv: at most %d filters\n",
+						CONV_CHAIN);
+					return 3;
+				}
+				snprintf(spec, sizeof(spec), "%.*s",
+					(int)strcspn(next, ","), next);
+				next += strcspn(next, ",");
+				next += *next == ',';
+				if (!conv_load(spec, &convs[nconv++])) {
+					printf("--conv: no filter %s\n", spec);
+					return 3;
+				}
+			}
+		} else {
+			printf("Usage: %s [--tune] [--engine=avg|box|cpu] "
+				"[--radius=R] [--conv=FILTER,...]\n"
+				"FILTER is box3, gauss5, sharpen, sobel_x, "
+				"sobel_y, laplace or a file with K and KxK "
+				"coefficients\n", argv[0]);
+			return 3;
+		}
+	}
+	if (tune && (strcmp(engine, "avg") != 0 || nconv > 0)) {
+		printf("--tune tunes --engine=avg\n");
+		return 3;
+	}
 
 
 	/* Read image as grayscale and get the size of the image buffer */
@@ -137,74 +830,114 @@ int main(void)
 		printf("Could not read image!\n");
 		exit(1);
 	}
-	buff_size = width * height * 4 * sizeof(unsigned char);
+	buff_size = width * height * sizeof(unsigned char);
+
+	/* The host engines need no device */
+	if (nconv > 0 && strcmp(engine, "cpu") == 0) {
+		image_out = malloc(buff_size);
+		total = conv_chain(&be, convs, nconv, image, image_out,
+				width, height);
+		printf("Convolutions: %0.3f ms\n", total);
+		write_image(image_out, width, height);
+		free(image_out);
+		free(image);
+		return 0;
+	}
+	if (strcmp(engine, "cpu") == 0) {
+		image_out = malloc(buff_size);
+		total = now_ms();
+		box_cpu(image, image_out, width, height, radius);
+		total = now_ms() - total;
+		printf("Box filter, radius %d: %0.3f ms\n", radius, total);
+		write_image(image_out, width, height);
+		free(image_out);
+		free(image);
+		return 0;
+	}
 
 
-	/* openCL: create Device, context and work items */
+	/* openCL: create Device and context */
 	device = create_device();
 	context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
 	if (err < 0) error(err, "clCreateContext");
-	local_item_size = 64;
-	global_item_size =
-		ceil(buff_size/(float)local_item_size)*local_item_size;
-
-
-	/* openCL: create kernel and program */
-	program = build_program(context, device, PROGRAM);
-	kernel = clCreateKernel(program, FUNC, &err);
-	if (err < 0) error(err, "clCreateKernel");
 
 	/* openCL: create command queue */
-	queue = clCreateCommandQueue(context, device, 0, &err);
+	queue = clCreateCommandQueue(context, device,
+			CL_QUEUE_PROFILING_ENABLE, &err);
 	if (err < 0) error(err, "clCreateCommandQueue");
 
-
-	/* openCL: create buffers */
-	buff_in = clCreateBuffer(context, CL_MEM_READ_ONLY |
-			CL_MEM_COPY_HOST_PTR, buff_size, image, &err);
-	if (err < 0) error(err, "clCreateBuffer (buff_in)");
-	buff_out = clCreateBuffer(context, CL_MEM_WRITE_ONLY, buff_size, NULL,
-			&err);
-	if (err < 0) error(err, "clCreateBuffer (buff_out)");
+	if (nconv > 0) {
+		be.ctx = context;
+		be.dev = device;
+		be.queue = queue;
+		image_out = malloc(buff_size);
+		total = conv_chain(&be, convs, nconv, image, image_out,
+				width, height);
+		printf("Convolutions: %0.3f ms\n", total);
+		write_image(image_out, width, height);
+		clReleaseCommandQueue(queue);
+		clReleaseContext(context);
+		free(image_out);
+		free(image);
+		return 0;
+	}
 
 
-	/* openCL - kernel arguments */
-	err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buff_in);
-	if (err < 0) error(err, "clSetKernelArg 0");
-	err = clSetKernelArg(kernel, 1, sizeof(cl_mem), &buff_out);
-	if (err < 0) error(err, "clSetKernelArg 1");
-	err = clSetKernelArg(kernel, 2, sizeof(unsigned), (void*)&width);
-	if (err < 0) error(err, "clSetKernelArg 2");
-	err = clSetKernelArg(kernel, 3, sizeof(unsigned), (void*)&height);
-	if (err < 0) error(err, "clSetKernelArg 3");
+	/* openCL: create buffers, zero-copy where the device allows */
+	unified = host_unified(device);
+	buff_in = input_buffer(context, unified, image, buff_size);
+	buff_out = output_buffer(context, unified, buff_size);
+
+
+	/* Work items: swept with --tune, else the stored configuration */
+	sprintf(shape, "%ux%u", width, height);
+	tune_key(key, sizeof(key), device, FUNC, shape);
+	if (strcmp(engine, "box") == 0) {
+		/* Nothing to tune, every pixel costs the same */
+	} else if (tune) {
+		tune_moving_avg(context, device, queue, buff_in, buff_out,
+				width, height, key, &conf);
+	} else if (tune_load(key, conf_str, sizeof(conf_str)) &&
+	    sscanf(conf_str, "local=%zu ppw=%d", &conf.local,
+		    &conf.ppw) == 2) {
+		printf("Tuned: %s\n", conf_str);
+	}
 
 
-	/* openCL - execute the kernel */
-	err = clEnqueueNDRangeKernel(queue, kernel, CL_TRUE, NULL,
-			&global_item_size, &local_item_size, 0, NULL, NULL);
-	if (err < 0) error(err, "clEnqueueNDRangeKernel");
+	/* openCL - build and execute the kernel */
+	if (strcmp(engine, "box") == 0) {
+		total = run_box(context, device, queue, buff_in, buff_out,
+				width, height, radius);
+		printf("Box filter, radius %d\n", radius);
+	} else {
+		total = run_moving_avg(context, device, queue, &conf,
+				buff_in, buff_out, width, height, 1);
+	}
+	if (total < 0) {
+		printf("The device does not take local size %zu\n",
+				conf.local);
+		exit(1);
+	}
+	printf("Kernel execution time: %0.3f ms\n", total);
 
 
-	/* openCL - copy image back from the device */
-	image_out = (unsigned char*) malloc(buff_size);
-	err = clEnqueueReadBuffer(queue, buff_out, CL_TRUE, 0, buff_size,
-			image_out, 0, NULL, NULL);
-	if (err < 0) error(err, "clEnqueueNDRangeKernel");
+	/* openCL - map or copy the image back from the device */
+	host_out = unified ? NULL : (unsigned char*) malloc(buff_size);
+	image_out = map_output(queue, unified, buff_out, buff_size, host_out);
 
 
 	/* write image with lodepng */
 	write_image(image_out, width, height);
+	unmap_output(queue, unified, buff_out, image_out);
 
 
-	clReleaseKernel(kernel);
-	clReleaseProgram(program);
 	clReleaseMemObject(buff_in);
 	clReleaseMemObject(buff_out);
 	clReleaseCommandQueue(queue);
 	clReleaseContext(context);
 
 	free(image);
-	free(image_out);
+	free(host_out);
 
 	return 0;
 }
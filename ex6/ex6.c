@@ -1,21 +1,175 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
 
 #include "lodepng.h"
+#include "../common/pngdown.h"
+
+/*
+ * calc_zncc_simd has a cross_block() for AVX-512BW, AVX2, SSE4.1 and plain
+ * C, picked at startup, see cpu_dispatch.h and --isa.
+ */
+#include "../common/cpu_dispatch.h"
+
+/* Pixels of one cross_block() */
+#define SIMD_WIDTH 32
 
 #define MAX_DISP 64
 #define MIN_DISP 0
+#ifndef WIN_W
 #define WIN_W 18
+#endif
+#ifndef WIN_H
 #define WIN_H 14
-#define WIN_PIXELS WIN_W*WIN_H
+#endif
+#define WIN_PIXELS (WIN_W*WIN_H)
 #define THRESHOLD 12
 
+/*
+ * Rows of the window between two bound checks of --prune, and how far
+ * under cur_max the bound has to be before a candidate is dropped
+ */
+#define PRUNE_ROWS 4
+#define PRUNE_SLACK 1e-6
+
+/* Census neighbourhood of --engine=census, CENSUS_W*CENSUS_H-1 bits */
+#ifndef CENSUS_W
+#define CENSUS_W 9
+#endif
+#ifndef CENSUS_H
+#define CENSUS_H 7
+#endif
+#define CENSUS_WORDS ((CENSUS_W*CENSUS_H-1 + 63) / 64)
+
+/* The smaller window of --cost and --coarse */
+#ifndef COARSE_W
+#define COARSE_W 9
+#endif
+#ifndef COARSE_H
+#define COARSE_H 7
+#endif
+
+/* Deepest image pyramid of --engine=pyramid */
+#define MAX_LEVELS 8
+
+/* How zncc_score() turns the window sums into a score, see --mode */
+#define ZNCC_FLOAT 0
+#define ZNCC_INT 1
+
+typedef void (*zncc_func)(unsigned char* il, unsigned char* ir,
+		unsigned int w, unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map);
+
+typedef void (*cross_func)(unsigned char* il, unsigned char* ir,
+		unsigned int w, int x, int d, int y0, int y1,
+		unsigned int* out);
+
+/* A search with the signature of zncc_search(), see match.h */
+typedef long (*match_func)(unsigned char* il, unsigned char* ir,
+		unsigned int w, unsigned int h, int disp_min, int disp_max,
+		int* guess, int band, int* disp);
+
+struct matcher {
+	const char* cost;
+	int win_w;
+	int win_h;
+	match_func search;
+};
+
+int zncc_mode = ZNCC_FLOAT;
+
+/* Pyramid depth and refinement band, see --levels and --band */
+int pyr_levels = 3;
+int pyr_band = 2;
+
+/* Early termination of zncc_search, see --prune and --good */
+int prune = 0;
+float good_score = 2;
+long skip_pairs = 0;
+long skip_taps = 0;
+long skip_good = 0;
+
+/* cross_block() variant of calc_zncc_simd, see cpu_dispatch() */
+cross_func cross_block;
+
+/* Search of --engine=match and of the coarse pyramid levels, see --cost */
+match_func cost_search = NULL;
+match_func coarse_search = NULL;
+
 /* Prototypes */
 void calc_zncc(unsigned char* il, unsigned char* ir, unsigned int w,
 		unsigned int h, int disp_min, int disp_max,
 		unsigned char* disp_map);
 
+void calc_match(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map);
+
+match_func find_matcher(const char* spec);
+
+void calc_zncc_volume(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map);
+
+void calc_zncc_simd(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map);
+
+void calc_census(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map);
+
+void census_transform(unsigned char* img, unsigned int w, unsigned int h,
+		unsigned long long* desc);
+
+void calc_zncc_pyramid(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map);
+
+void calc_zncc_bidir(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_l2r, unsigned char* disp_r2l);
+
+long zncc_search(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max, int* guess,
+		int band, int* disp);
+
+void pyr_down(unsigned char* src, unsigned int w, unsigned int h,
+		unsigned char* dst);
+
+void cross_block_scalar(unsigned char* il, unsigned char* ir,
+		unsigned int w, int x, int d, int y0, int y1,
+		unsigned int* out);
+#ifdef CPU_X86
+void cross_block_sse41(unsigned char* il, unsigned char* ir,
+		unsigned int w, int x, int d, int y0, int y1,
+		unsigned int* out);
+void cross_block_avx2(unsigned char* il, unsigned char* ir,
+		unsigned int w, int x, int d, int y0, int y1,
+		unsigned int* out);
+void cross_block_avx512(unsigned char* il, unsigned char* ir,
+		unsigned int w, int x, int d, int y0, int y1,
+		unsigned int* out);
+#endif
+
+float zncc_score(unsigned int sum_left, unsigned int sum_right,
+		unsigned int sq_left, unsigned int sq_right, unsigned int cross,
+		int n, int p);
+
+float zncc_score_float(double sum_left, double sum_right, double sq_left,
+		double sq_right, double cross, int n, int p);
+
+float zncc_score_int(int sum_left, int sum_right, int sq_left, int sq_right,
+		int cross, int n, int p);
+
+void integral_image(unsigned char* img, unsigned int w, unsigned int h,
+		unsigned int* sat, unsigned int* sat_sq);
+
+unsigned int box_sum(unsigned int* sat, unsigned int w, int x0, int y0,
+		int x1, int y1);
+
 void cross_checking(unsigned char* left, unsigned char* right,
 		unsigned int size, unsigned char* out);
 
@@ -23,91 +177,1229 @@ void occlusion_filling(unsigned char* res, unsigned int size);
 
 void normalize(unsigned char* res, unsigned int size);
 
+double now_ms(void);
 
 
 
-void calc_zncc(unsigned char* il, unsigned char* ir, unsigned int w,
-		unsigned int h, int disp_min, int disp_max,
-		unsigned char* disp_map)
+
+/*
+ * Summed-area tables of I and I^2. Both are (w+1)x(h+1) with a zero first
+ * row and column so that box_sum() needs no special cases at the borders.
+ * The tables are plain unsigned ints and are allowed to wrap: a window sum
+ * is always below 2^32, so the four-corner difference is still exact.
+ */
+void integral_image(unsigned char* img, unsigned int w, unsigned int h,
+		unsigned int* sat, unsigned int* sat_sq)
+{
+	unsigned int row;
+	unsigned int row_sq;
+	unsigned int px;
+
+	for (int x=0; x<=w; x++) {
+		sat[x] = 0;
+		sat_sq[x] = 0;
+	}
+
+	for (int y=0; y<h; y++) {
+		row = 0;
+		row_sq = 0;
+		sat[(y+1)*(w+1)] = 0;
+		sat_sq[(y+1)*(w+1)] = 0;
+		for (int x=0; x<w; x++) {
+			px = img[y*w+x];
+			row += px;
+			row_sq += px*px;
+			sat[(y+1)*(w+1)+x+1] = sat[y*(w+1)+x+1] + row;
+			sat_sq[(y+1)*(w+1)+x+1] = sat_sq[y*(w+1)+x+1] + row_sq;
+		}
+	}
+}
+
+/*
+ * ZNCC of one window from its sums. The means are taken over the p pixels
+ * of the full window, WIN_PIXELS like the direct version always did, while
+ * n is the number of taps that were actually inside the image. Expanding
+ * the centered sums:
+ * sum (L-mL)(R-mR) = sum LR - mR*sum L - mL*sum R + n*mL*mR
+ * The terms are grouped so that swapping left and right gives bit for bit
+ * the same score.
+ */
+float zncc_score_float(double sum_left, double sum_right, double sq_left,
+		double sq_right, double cross, int n, int p)
 {
+	double mean_left = sum_left / p;
+	double mean_right = sum_right / p;
+	double nominator;
+	double denominator1;
+	double denominator2;
+
+	nominator = cross - (mean_right*sum_left + mean_left*sum_right)
+		+ n*(mean_left*mean_right);
+	denominator1 = sq_left - 2*mean_left*sum_left
+		+ n*mean_left*mean_left;
+	denominator2 = sq_right - 2*mean_right*sum_right
+		+ n*mean_right*mean_right;
+	return nominator / (sqrt(denominator1*denominator2));
+}
+
+/*
+ * Same score with the means folded in exactly. Multiplying the centered
+ * sums by p^2 leaves only integers, e.g.
+ * p^2 * sum (L-mL)(R-mR) = p^2*sum LR - (2p-n)*sum L*sum R,
+ * which fit in 64 bits for any sane window. Only the square root and the
+ * final division are done in floating point, in double like zncc_int() of
+ * ex8.cl, so the score does not depend on rounding in the sums. The window
+ * sums themselves are below 2^31.
+ */
+float zncc_score_int(int sum_left, int sum_right, int sq_left, int sq_right,
+		int cross, int n, int p)
+{
+	const long long p2 = (long long)p * p;
+	const long long k = 2*p - n;
+	long long nominator;
+	long long denominator1;
+	long long denominator2;
+
+	nominator = p2*cross - k*sum_left*sum_right;
+	denominator1 = p2*sq_left - k*sum_left*sum_left;
+	denominator2 = p2*sq_right - k*sum_right*sum_right;
+	return nominator / sqrt((double)denominator1*denominator2);
+}
+
+float zncc_score(unsigned int sum_left, unsigned int sum_right,
+		unsigned int sq_left, unsigned int sq_right, unsigned int cross,
+		int n, int p)
+{
+	if (zncc_mode == ZNCC_INT)
+		return zncc_score_int(sum_left, sum_right, sq_left, sq_right,
+				cross, n, p);
+	return zncc_score_float(sum_left, sum_right, sq_left, sq_right,
+			cross, n, p);
+}
+
+/* Sum over the pixels x0 <= x < x1, y0 <= y < y1 */
+unsigned int box_sum(unsigned int* sat, unsigned int w, int x0, int y0,
+		int x1, int y1)
+{
+	return sat[y1*(w+1)+x1] - sat[y0*(w+1)+x1]
+	     - sat[y1*(w+1)+x0] + sat[y0*(w+1)+x0];
+}
+
+
+/*
+ * The search behind calc_zncc. Every pixel tries the disparities
+ * guess-band..guess+band clipped to disp_min..disp_max, or the whole range
+ * when guess is NULL. The signed result goes to disp. Returns the number of
+ * (pixel, d) pairs that were scored.
+ *
+ * With prune set, a candidate is dropped every PRUNE_ROWS rows once an
+ * upper bound of its score falls below cur_max, which never changes the
+ * result beyond rounding. A pixel whose best score reaches good_score stops
+ * searching, which does. skip_* count what was left out.
+ */
+long zncc_search(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max, int* guess,
+		int band, int* disp)
+{
+	unsigned int* sat_l;
+	unsigned int* sat_l_sq;
+	unsigned int* sat_r;
+	unsigned int* sat_r_sq;
+
 	float cur_max;
-	float sum_left;
-	float sum_right;
-	int idx_l;
-	int idx_r;
-	float nominator=0;
-	float denominator1=0;
-	float denominator2=0;
-	float center_left;
-	float center_right;
+	unsigned int sum_left;
+	unsigned int sum_right;
+	unsigned int sq_left;
+	unsigned int sq_right;
+	unsigned int cross;
+	int x0, x1, y0, y1;
+	int n;
+	int lo, hi;
 	float zncc;
 	int disp_best=0;
+	long pairs = 0;
+	double mean_left, mean_right;
+	double total_left, total_right;
+	double part_nom, rest_left, rest_right;
+	unsigned int part_sum_left, part_sum_right;
+	int n_part, n_rest;
+	int pruned;
+
+	sat_l = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_l_sq = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_r = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_r_sq = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	integral_image(il, w, h, sat_l, sat_l_sq);
+	integral_image(ir, w, h, sat_r, sat_r_sq);
 
 	for (int i=0; i<h; i++) {
+		/* Rows of the window that are inside the image */
+		y0 = i-WIN_H/2 < 0 ? 0 : i-WIN_H/2;
+		y1 = i+WIN_H/2 > h ? h : i+WIN_H/2;
+
 	for (int j=0; j<w; j++) {
+		lo = disp_min;
+		hi = disp_max;
+		if (guess != NULL) {
+			if (lo < guess[i*w+j]-band) lo = guess[i*w+j]-band;
+			if (hi > guess[i*w+j]+band) hi = guess[i*w+j]+band;
+		}
 		cur_max = -1;
-		disp_best = disp_max;
+		disp_best = guess != NULL ? guess[i*w+j] : disp_max;
+
+	for (int d=lo; d<=hi; d++) {
+		/*
+		 * Clip the window so that both the left pixel x and the right
+		 * pixel x-d are inside the image. This is the same set of taps
+		 * the per-tap border check used to keep.
+		 */
+		x0 = j-WIN_W/2;
+		if (x0 < 0) x0 = 0;
+		if (x0 < d) x0 = d;
+		x1 = j+WIN_W/2;
+		if (x1 > w) x1 = w;
+		if (x1 > (int)w+d) x1 = w+d;
+		if (x0 >= x1)
+			continue;
+		n = (x1-x0) * (y1-y0);
+		pairs++;
+
+		/*
+		 * Means and variances straight from the integral images
+		 */
+		sum_left = box_sum(sat_l, w, x0, y0, x1, y1);
+		sum_right = box_sum(sat_r, w, x0-d, y0, x1-d, y1);
+		sq_left = box_sum(sat_l_sq, w, x0, y0, x1, y1);
+		sq_right = box_sum(sat_r_sq, w, x0-d, y0, x1-d, y1);
+
+		/* Centered sums of squares of the whole window, for --prune */
+		mean_left = (double)sum_left / WIN_PIXELS;
+		mean_right = (double)sum_right / WIN_PIXELS;
+		total_left = sq_left - 2*mean_left*sum_left
+			+ n*mean_left*mean_left;
+		total_right = sq_right - 2*mean_right*sum_right
+			+ n*mean_right*mean_right;
+
+		/* Only the cross term still needs the window */
+		cross = 0;
+		pruned = 0;
+		for (int y=y0; y<y1; y++) {
+			for (int x=x0; x<x1; x++)
+				cross += il[y*w+x] * ir[y*w+x-d];
+
+			if (!prune || (y+1-y0) % PRUNE_ROWS != 0 || y+1 == y1 ||
+			    total_left*total_right <= 0)
+				continue;
+
+			/*
+			 * Rows y0..y are done. By Cauchy-Schwarz the centered
+			 * cross sum of the remaining rows is at most
+			 * sqrt(rest_left*rest_right), and the centered sums of
+			 * squares of both parts come from the integral images.
+			 */
+			part_sum_left = box_sum(sat_l, w, x0, y0, x1, y+1);
+			part_sum_right = box_sum(sat_r, w, x0-d, y0, x1-d, y+1);
+			n_part = (x1-x0) * (y+1-y0);
+			n_rest = n - n_part;
+			part_nom = cross - mean_right*part_sum_left
+				- mean_left*part_sum_right
+				+ n_part*mean_left*mean_right;
+			rest_left = box_sum(sat_l_sq, w, x0, y+1, x1, y1)
+				- 2*mean_left*(sum_left-part_sum_left)
+				+ n_rest*mean_left*mean_left;
+			rest_right = box_sum(sat_r_sq, w, x0-d, y+1, x1-d, y1)
+				- 2*mean_right*(sum_right-part_sum_right)
+				+ n_rest*mean_right*mean_right;
+			if (rest_left < 0) rest_left = 0;
+			if (rest_right < 0) rest_right = 0;
+
+			if ((part_nom + sqrt(rest_left*rest_right))
+			    / sqrt(total_left*total_right)
+			    < cur_max - PRUNE_SLACK) {
+				skip_pairs++;
+				skip_taps += n_rest;
+				pruned = 1;
+				break;
+			}
+		}
+		if (pruned)
+			continue;
+
+		zncc = zncc_score(sum_left, sum_right, sq_left, sq_right,
+				cross, n, WIN_PIXELS);
+
+		if (zncc > cur_max) {
+			cur_max = zncc;
+			disp_best = d;
+		}
+
+		/* Good enough, stop the search */
+		if (cur_max >= good_score) {
+			skip_good += hi - d;
+			break;
+		}
+	}
+	disp[i*w+j] = disp_best;
+	}
+	}
+
+	free(sat_l);
+	free(sat_l_sq);
+	free(sat_r);
+	free(sat_r_sq);
+	return pairs;
+}
+
+
+void calc_zncc(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map)
+{
+	int* disp = malloc(w*h*sizeof(int));
+
+	zncc_search(il, ir, w, h, disp_min, disp_max, NULL, 0, disp);
+	for (int i=0; i<w*h; i++)
+		disp_map[i] = (unsigned char) abs(disp[i]);
+	free(disp);
+}
+
+
+/*
+ * Every cost of match.h for the WIN_W x WIN_H window and for the smaller
+ * COARSE_W x COARSE_H one, which suits the coarse pyramid levels.
+ */
+#define MATCH_NAME match_sad
+#define MATCH_COST SAD
+#define MATCH_W WIN_W
+#define MATCH_H WIN_H
+#include "match.h"
+
+#define MATCH_NAME match_ssd
+#define MATCH_COST SSD
+#define MATCH_W WIN_W
+#define MATCH_H WIN_H
+#include "match.h"
+
+#define MATCH_NAME match_ncc
+#define MATCH_COST NCC
+#define MATCH_W WIN_W
+#define MATCH_H WIN_H
+#include "match.h"
+
+#define MATCH_NAME match_zncc
+#define MATCH_COST ZNCC
+#define MATCH_W WIN_W
+#define MATCH_H WIN_H
+#include "match.h"
+
+#define MATCH_NAME match_sad_coarse
+#define MATCH_COST SAD
+#define MATCH_W COARSE_W
+#define MATCH_H COARSE_H
+#include "match.h"
+
+#define MATCH_NAME match_ssd_coarse
+#define MATCH_COST SSD
+#define MATCH_W COARSE_W
+#define MATCH_H COARSE_H
+#include "match.h"
+
+#define MATCH_NAME match_ncc_coarse
+#define MATCH_COST NCC
+#define MATCH_W COARSE_W
+#define MATCH_H COARSE_H
+#include "match.h"
+
+#define MATCH_NAME match_zncc_coarse
+#define MATCH_COST ZNCC
+#define MATCH_W COARSE_W
+#define MATCH_H COARSE_H
+#include "match.h"
+
+struct matcher matchers[] = {
+	{"sad", WIN_W, WIN_H, match_sad},
+	{"ssd", WIN_W, WIN_H, match_ssd},
+	{"ncc", WIN_W, WIN_H, match_ncc},
+	{"zncc", WIN_W, WIN_H, match_zncc},
+	{"sad", COARSE_W, COARSE_H, match_sad_coarse},
+	{"ssd", COARSE_W, COARSE_H, match_ssd_coarse},
+	{"ncc", COARSE_W, COARSE_H, match_ncc_coarse},
+	{"zncc", COARSE_W, COARSE_H, match_zncc_coarse},
+};
+
+/*
+ * The matcher of a --cost or --coarse value, COST or COST:WxH with the
+ * window one of the compiled ones, WIN_W x WIN_H by default. NULL when
+ * there is none.
+ */
+match_func find_matcher(const char* spec)
+{
+	const char* colon = strchr(spec, ':');
+	size_t len = colon != NULL ? colon - spec : strlen(spec);
+	int win_w = WIN_W;
+	int win_h = WIN_H;
+
+	if (colon != NULL && sscanf(colon+1, "%dx%d", &win_w, &win_h) != 2)
+		return NULL;
+	for (int i=0; i<sizeof(matchers)/sizeof(matchers[0]); i++) {
+		if (strlen(matchers[i].cost) == len &&
+		    strncmp(matchers[i].cost, spec, len) == 0 &&
+		    matchers[i].win_w == win_w && matchers[i].win_h == win_h)
+			return matchers[i].search;
+	}
+	return NULL;
+}
+
+/* calc_zncc with the cost and window of --cost */
+void calc_match(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map)
+{
+	int* disp = malloc(w*h*sizeof(int));
+
+	cost_search(il, ir, w, h, disp_min, disp_max, NULL, 0, disp);
+	for (int i=0; i<w*h; i++)
+		disp_map[i] = (unsigned char) abs(disp[i]);
+	free(disp);
+}
+
+
+/*
+ * Halves the image after a 5-tap binomial (1 4 6 4 1)/16 blur in both
+ * directions, repeating the edge pixels. dst is ((w+1)/2)x((h+1)/2).
+ */
+void pyr_down(unsigned char* src, unsigned int w, unsigned int h,
+		unsigned char* dst)
+{
+	static const int k[5] = {1, 4, 6, 4, 1};
+	unsigned int dw = (w+1)/2;
+	unsigned int dh = (h+1)/2;
+	unsigned int* tmp = malloc(dw*h*sizeof(unsigned int));
+	unsigned int acc;
+	int x, y;
+
+	/* Horizontal blur, keeping every other column */
+	for (int i=0; i<h; i++) {
+		for (int j=0; j<dw; j++) {
+			acc = 0;
+			for (int t=-2; t<=2; t++) {
+				x = 2*j+t;
+				if (x < 0) x = 0;
+				if (x >= w) x = w-1;
+				acc += k[t+2] * src[i*w+x];
+			}
+			tmp[i*dw+j] = acc;
+		}
+	}
+
+	/* Vertical blur, keeping every other row */
+	for (int i=0; i<dh; i++) {
+		for (int j=0; j<dw; j++) {
+			acc = 0;
+			for (int t=-2; t<=2; t++) {
+				y = 2*i+t;
+				if (y < 0) y = 0;
+				if (y >= h) y = h-1;
+				acc += k[t+2] * tmp[y*dw+j];
+			}
+			dst[i*dw+j] = (acc + 128) / 256;
+		}
+	}
+	free(tmp);
+}
+
+/*
+ * Coarse-to-fine calc_zncc. Both images are reduced pyr_levels-1 times,
+ * the coarsest level searches the whole (scaled) disparity range and every
+ * finer level only searches +-pyr_band around twice the disparity found
+ * one level up. With --coarse the levels above the full-size one use that
+ * cheaper matcher and only the last refinement is ZNCC.
+ */
+void calc_zncc_pyramid(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map)
+{
+	unsigned char* pyr_l[MAX_LEVELS];
+	unsigned char* pyr_r[MAX_LEVELS];
+	unsigned int pw[MAX_LEVELS];
+	unsigned int ph[MAX_LEVELS];
+	int* disp = NULL;
+	int* guess = NULL;
+	int levels = pyr_levels;
+	int scale, lo, hi;
+	long pairs = 0;
+
+	pyr_l[0] = il;
+	pyr_r[0] = ir;
+	pw[0] = w;
+	ph[0] = h;
+	for (int l=1; l<levels; l++) {
+		/* Stop before the window no longer fits */
+		if (pw[l-1] < 2*WIN_W || ph[l-1] < 2*WIN_H) {
+			levels = l;
+			break;
+		}
+		pw[l] = (pw[l-1]+1) / 2;
+		ph[l] = (ph[l-1]+1) / 2;
+		pyr_l[l] = malloc(pw[l]*ph[l]);
+		pyr_r[l] = malloc(pw[l]*ph[l]);
+		pyr_down(pyr_l[l-1], pw[l-1], ph[l-1], pyr_l[l]);
+		pyr_down(pyr_r[l-1], pw[l-1], ph[l-1], pyr_r[l]);
+	}
+
+	for (int l=levels-1; l>=0; l--) {
+		/* Disparity range of this level, rounded outwards */
+		scale = 1 << l;
+		lo = disp_min >= 0 ? disp_min/scale :
+			-((-disp_min+scale-1)/scale);
+		hi = disp_max >= 0 ? (disp_max+scale-1)/scale :
+			-(-disp_max/scale);
+
+		disp = malloc(pw[l]*ph[l]*sizeof(int));
+		if (guess != NULL) {
+			/* Upsample the estimate of the level above */
+			int* up = malloc(pw[l]*ph[l]*sizeof(int));
+			for (int i=0; i<ph[l]; i++) {
+				for (int j=0; j<pw[l]; j++) {
+					int ci = i/2 < ph[l+1] ? i/2 :
+						ph[l+1]-1;
+					int cj = j/2 < pw[l+1] ? j/2 :
+						pw[l+1]-1;
+					up[i*pw[l]+j] = 2*guess[ci*pw[l+1]+cj];
+				}
+			}
+			free(guess);
+			guess = up;
+		}
+		if (l > 0 && coarse_search != NULL)
+			pairs += coarse_search(pyr_l[l], pyr_r[l], pw[l],
+					ph[l], lo, hi, guess, pyr_band, disp);
+		else
+			pairs += zncc_search(pyr_l[l], pyr_r[l], pw[l], ph[l],
+					lo, hi, guess, pyr_band, disp);
+		free(guess);
+		guess = disp;
+	}
+
+	for (int i=0; i<w*h; i++)
+		disp_map[i] = (unsigned char) abs(disp[i]);
+	printf("Pyramid: %d levels, %ld (pixel, d) pairs, full search %ld\n",
+			levels, pairs, (long)w*h*(disp_max-disp_min+1));
+
+	for (int l=1; l<levels; l++) {
+		free(pyr_l[l]);
+		free(pyr_r[l]);
+	}
+	free(disp);
+}
+
+
+/*
+ * Disparity-major version of calc_zncc. For every d the product image
+ * L(x)*R(x-d) is box filtered with separable running sums (a row pass, then
+ * a column pass), which gives sum LR for every window at a constant cost per
+ * pixel regardless of WIN_W and WIN_H. The other sums come from the integral
+ * images, so one (pixel, d) pair costs O(1). The best score and disparity of
+ * every pixel are kept in buffers between the disparity passes.
+ */
+void calc_zncc_volume(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map)
+{
+	unsigned int* sat_l;
+	unsigned int* sat_l_sq;
+	unsigned int* sat_r;
+	unsigned int* sat_r_sq;
+	unsigned int* prod;	/* one row of L(x)*R(x-d) */
+	unsigned int* row_sum;	/* row pass, w x h */
+	unsigned int* col_sum;	/* column pass, one running sum per x */
+	float* best_score;
+	int* best_disp;
+
+	unsigned int run;
+	int x0, x1, y0, y1;
+	int p0, p1;
+	int n;
+	float zncc;
+
+	sat_l = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_l_sq = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_r = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_r_sq = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	integral_image(il, w, h, sat_l, sat_l_sq);
+	integral_image(ir, w, h, sat_r, sat_r_sq);
+
+	prod = malloc(w*sizeof(unsigned int));
+	row_sum = malloc(w*h*sizeof(unsigned int));
+	col_sum = malloc(w*sizeof(unsigned int));
+	best_score = malloc(w*h*sizeof(float));
+	best_disp = malloc(w*h*sizeof(int));
+
+	for (int i=0; i<w*h; i++) {
+		best_score[i] = -1;
+		best_disp[i] = disp_max;
+	}
 
 	for (int d=disp_min; d<=disp_max; d++) {
+		/* Columns where x-d is inside the image, the product is 0
+		 * elsewhere so the box filter clips the window for free */
+		p0 = d < 0 ? 0 : d;
+		p1 = d < 0 ? (int)w+d : (int)w;
+
+		/*
+		 * Row pass: row_sum(x) sums prod over [x-WIN_W/2, x+WIN_W/2)
+		 */
+		for (int y=0; y<h; y++) {
+			for (int x=0; x<w; x++)
+				prod[x] = 0;
+			for (int x=p0; x<p1; x++)
+				prod[x] = il[y*w+x] * ir[y*w+x-d];
+
+			run = 0;
+			for (int x=0; x<WIN_W/2-1 && x<w; x++)
+				run += prod[x];
+			for (int x=0; x<w; x++) {
+				if (x+WIN_W/2-1 < w)
+					run += prod[x+WIN_W/2-1];
+				if (x-WIN_W/2-1 >= 0)
+					run -= prod[x-WIN_W/2-1];
+				row_sum[y*w+x] = run;
+			}
+		}
+
 		/*
-		 * Calculate the mean
+		 * Column pass over [y-WIN_H/2, y+WIN_H/2), scoring as we go
 		 */
-		sum_left = 0;
-		sum_right = 0;
-		for (int win_y=-WIN_H/2; win_y<WIN_H/2; win_y++) {
-		for (int win_x=-WIN_W/2; win_x<WIN_W/2; win_x++) {
-			/* Border checking */
-                         if (i+win_y < 0     || i+win_y >= h ||
-			     j+win_x < 0     || j+win_x >= w ||
-			     j+win_x-d < 0   || j+win_x-d >= w)
-				 continue;
+		for (int x=0; x<w; x++)
+			col_sum[x] = 0;
+		for (int y=0; y<WIN_H/2-1 && y<h; y++)
+			for (int x=0; x<w; x++)
+				col_sum[x] += row_sum[y*w+x];
 
-			idx_l = w * (i+win_y) +j+win_x;
-			idx_r = w *(i+win_y)+j+win_x-d;
+		for (int i=0; i<h; i++) {
+			if (i+WIN_H/2-1 < h)
+				for (int x=0; x<w; x++)
+					col_sum[x] +=
+						row_sum[(i+WIN_H/2-1)*w+x];
+			if (i-WIN_H/2-1 >= 0)
+				for (int x=0; x<w; x++)
+					col_sum[x] -=
+						row_sum[(i-WIN_H/2-1)*w+x];
 
-			sum_left += il[idx_l];
-			sum_right += ir[idx_r];
+			y0 = i-WIN_H/2 < 0 ? 0 : i-WIN_H/2;
+			y1 = i+WIN_H/2 > h ? h : i+WIN_H/2;
+
+			for (int j=0; j<w; j++) {
+				/* Same clipping as calc_zncc */
+				x0 = j-WIN_W/2;
+				if (x0 < p0) x0 = p0;
+				x1 = j+WIN_W/2;
+				if (x1 > p1) x1 = p1;
+				if (x0 >= x1)
+					continue;
+				n = (x1-x0) * (y1-y0);
+
+				zncc = zncc_score(
+					box_sum(sat_l, w, x0, y0, x1, y1),
+					box_sum(sat_r, w, x0-d, y0, x1-d, y1),
+					box_sum(sat_l_sq, w, x0, y0, x1, y1),
+					box_sum(sat_r_sq, w, x0-d, y0, x1-d,
+						y1),
+					col_sum[j], n, WIN_PIXELS);
+
+				if (zncc > best_score[i*w+j]) {
+					best_score[i*w+j] = zncc;
+					best_disp[i*w+j] = d;
+				}
+			}
 		}
+	}
+
+	for (int i=0; i<w*h; i++)
+		disp_map[i] = (unsigned char) abs(best_disp[i]);
+
+	free(sat_l);
+	free(sat_l_sq);
+	free(sat_r);
+	free(sat_r_sq);
+	free(prod);
+	free(row_sum);
+	free(col_sum);
+	free(best_score);
+	free(best_disp);
+}
+
+
+/*
+ * Census descriptors of --engine=census: one bit per pixel of the
+ * CENSUS_W x CENSUS_H neighbourhood but the centre, set where it is darker
+ * than the centre, CENSUS_WORDS words per pixel. Neighbours outside the
+ * image are clamped to the edge.
+ */
+void census_transform(unsigned char* img, unsigned int w, unsigned int h,
+		unsigned long long* desc)
+{
+	unsigned long long word;
+	unsigned char c;
+	int bit, k;
+	int x, y;
+
+	for (int i=0; i<h; i++) {
+		for (int j=0; j<w; j++) {
+			c = img[i*w+j];
+			word = 0;
+			bit = 0;
+			k = 0;
+			for (int dy=-CENSUS_H/2; dy<=CENSUS_H/2; dy++) {
+				y = i+dy < 0 ? 0 : i+dy >= h ? h-1 : i+dy;
+				for (int dx=-CENSUS_W/2; dx<=CENSUS_W/2; dx++) {
+					if (dx == 0 && dy == 0)
+						continue;
+					x = j+dx < 0 ? 0 :
+						j+dx >= w ? w-1 : j+dx;
+					word |= (unsigned long long)
+						(img[y*w+x] < c) << bit;
+					if (++bit == 64) {
+						desc[(i*w+j)*CENSUS_WORDS+k++] =
+							word;
+						word = 0;
+						bit = 0;
+					}
+				}
+			}
+			if (bit)
+				desc[(i*w+j)*CENSUS_WORDS+k] = word;
+		}
+	}
+}
+
+
+/*
+ * Census matching with the layout of calc_zncc_volume: for every d the
+ * Hamming distances of the descriptors, XOR and popcount, are box filtered
+ * over the WIN_W x WIN_H window with the same clipping. The lowest mean
+ * distance wins, compared exactly as sum_a*n_b < sum_b*n_a, and ties keep
+ * the smaller d as in calc_zncc. The distance loop is what the compiler
+ * vectorizes, build with -mpopcnt or -march=native to get a hardware
+ * popcount.
+ */
+void calc_census(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map)
+{
+	unsigned long long* desc_l;
+	unsigned long long* desc_r;
+	unsigned int* dist;	/* one row of Hamming distances */
+	unsigned int* row_sum;	/* row pass, w x h */
+	unsigned int* col_sum;	/* column pass, one running sum per x */
+	unsigned int* best_sum;
+	int* best_n;
+	int* best_disp;
+
+	unsigned int run;
+	unsigned int hd;
+	int x0, x1, y0, y1;
+	int p0, p1;
+	int n;
+
+	desc_l = malloc(w*h*CENSUS_WORDS*sizeof(unsigned long long));
+	desc_r = malloc(w*h*CENSUS_WORDS*sizeof(unsigned long long));
+	census_transform(il, w, h, desc_l);
+	census_transform(ir, w, h, desc_r);
+
+	dist = malloc(w*sizeof(unsigned int));
+	row_sum = malloc(w*h*sizeof(unsigned int));
+	col_sum = malloc(w*sizeof(unsigned int));
+	best_sum = malloc(w*h*sizeof(unsigned int));
+	best_n = calloc(w*h, sizeof(int));
+	best_disp = malloc(w*h*sizeof(int));
+
+	for (int i=0; i<w*h; i++)
+		best_disp[i] = disp_max;
+
+	for (int d=disp_min; d<=disp_max; d++) {
+		/* Columns where x-d is inside the image */
+		p0 = d < 0 ? 0 : d;
+		p1 = d < 0 ? (int)w+d : (int)w;
+
+		/*
+		 * Row pass: row_sum(x) sums dist over [x-WIN_W/2, x+WIN_W/2)
+		 */
+		for (int y=0; y<h; y++) {
+			unsigned long long* dl = desc_l + y*w*CENSUS_WORDS;
+			unsigned long long* dr = desc_r + y*w*CENSUS_WORDS;
+
+			for (int x=0; x<w; x++)
+				dist[x] = 0;
+			for (int x=p0; x<p1; x++) {
+				hd = 0;
+				for (int k=0; k<CENSUS_WORDS; k++)
+					hd += __builtin_popcountll(
+						dl[x*CENSUS_WORDS+k] ^
+						dr[(x-d)*CENSUS_WORDS+k]);
+				dist[x] = hd;
+			}
+
+			run = 0;
+			for (int x=0; x<WIN_W/2-1 && x<w; x++)
+				run += dist[x];
+			for (int x=0; x<w; x++) {
+				if (x+WIN_W/2-1 < w)
+					run += dist[x+WIN_W/2-1];
+				if (x-WIN_W/2-1 >= 0)
+					run -= dist[x-WIN_W/2-1];
+				row_sum[y*w+x] = run;
+			}
 		}
-		sum_left /= WIN_PIXELS;
-		sum_right /= WIN_PIXELS;
 
 		/*
-		 * Calcucate ZNCC
+		 * Column pass over [y-WIN_H/2, y+WIN_H/2), scoring as we go
 		 */
-		nominator = 0;
-		denominator1 = 0;
-		denominator2 = 0;
+		for (int x=0; x<w; x++)
+			col_sum[x] = 0;
+		for (int y=0; y<WIN_H/2-1 && y<h; y++)
+			for (int x=0; x<w; x++)
+				col_sum[x] += row_sum[y*w+x];
+
+		for (int i=0; i<h; i++) {
+			if (i+WIN_H/2-1 < h)
+				for (int x=0; x<w; x++)
+					col_sum[x] +=
+						row_sum[(i+WIN_H/2-1)*w+x];
+			if (i-WIN_H/2-1 >= 0)
+				for (int x=0; x<w; x++)
+					col_sum[x] -=
+						row_sum[(i-WIN_H/2-1)*w+x];
 
-		for (int win_y=-WIN_H/2; win_y<WIN_H/2; win_y++) {
-		for (int win_x=-WIN_W/2; win_x<WIN_W/2; win_x++) {
-			/* Border checking */
-                        if (i+win_y < 0     || i+win_y >= h ||
-                            j+win_x < 0     || j+win_x >= w ||
-                            j+win_x-d < 0   || j+win_x-d >= w)
-                            continue;
-			idx_l = w * (i+win_y) +j+win_x;
-			idx_r = w *(i+win_y)+j+win_x-d;
+			y0 = i-WIN_H/2 < 0 ? 0 : i-WIN_H/2;
+			y1 = i+WIN_H/2 > h ? h : i+WIN_H/2;
 
-			center_left = il[idx_l] - sum_left;
-			center_right = ir[idx_r] - sum_right;
+			for (int j=0; j<w; j++) {
+				x0 = j-WIN_W/2;
+				if (x0 < p0) x0 = p0;
+				x1 = j+WIN_W/2;
+				if (x1 > p1) x1 = p1;
+				if (x0 >= x1)
+					continue;
+				n = (x1-x0) * (y1-y0);
 
-			nominator += center_left * center_right;
-			denominator1 += pow(center_left, 2);
-			denominator2 += pow(center_right, 2);
+				if (best_n[i*w+j] == 0 ||
+				    (unsigned long long)col_sum[j] *
+				    best_n[i*w+j] <
+				    (unsigned long long)best_sum[i*w+j] * n) {
+					best_sum[i*w+j] = col_sum[j];
+					best_n[i*w+j] = n;
+					best_disp[i*w+j] = d;
+				}
+			}
 		}
+	}
+
+	for (int i=0; i<w*h; i++)
+		disp_map[i] = (unsigned char) abs(best_disp[i]);
+
+	free(desc_l);
+	free(desc_r);
+	free(dist);
+	free(row_sum);
+	free(col_sum);
+	free(best_sum);
+	free(best_n);
+	free(best_disp);
+}
+
+
+/*
+ * sum L*R over the window rows y0..y1-1 for SIMD_WIDTH adjacent pixels, the
+ * first of which has its window starting at column x. The caller makes sure
+ * every tap is inside both images, so there is no border test here.
+ * Products of two uint8 fit exactly in an unsigned 16-bit lane and are
+ * widened to 32 bits before they are accumulated. All variants give the
+ * same sums.
+ */
+void cross_block_scalar(unsigned char* il, unsigned char* ir,
+		unsigned int w, int x, int d, int y0, int y1,
+		unsigned int* out)
+{
+	for (int k=0; k<SIMD_WIDTH; k++)
+		out[k] = 0;
+	for (int y=y0; y<y1; y++)
+		for (int t=0; t<WIN_W; t++)
+			for (int k=0; k<SIMD_WIDTH; k++)
+				out[k] += il[y*w+x+t+k] * ir[y*w+x+t+k-d];
+}
+
+#ifdef CPU_X86
+/* Four groups of 8 pixels */
+__attribute__((target("sse4.1")))
+void cross_block_sse41(unsigned char* il, unsigned char* ir,
+		unsigned int w, int x, int d, int y0, int y1,
+		unsigned int* out)
+{
+	__m128i acc[8];
+	__m128i l16, r16, p16;
+
+	for (int k=0; k<8; k++)
+		acc[k] = _mm_setzero_si128();
+
+	for (int y=y0; y<y1; y++) {
+		unsigned char* pl = il + y*w + x;
+		unsigned char* pr = ir + y*w + x - d;
+		for (int t=0; t<WIN_W; t++) {
+			for (int g=0; g<4; g++) {
+				l16 = _mm_cvtepu8_epi16(_mm_loadl_epi64(
+					(__m128i*)(pl+t+8*g)));
+				r16 = _mm_cvtepu8_epi16(_mm_loadl_epi64(
+					(__m128i*)(pr+t+8*g)));
+				p16 = _mm_mullo_epi16(l16, r16);
+				acc[2*g] = _mm_add_epi32(acc[2*g],
+					_mm_cvtepu16_epi32(p16));
+				acc[2*g+1] = _mm_add_epi32(acc[2*g+1],
+					_mm_unpackhi_epi16(p16,
+					_mm_setzero_si128()));
+			}
 		}
-		zncc = nominator / (sqrt(denominator1*denominator2));
+	}
+	for (int k=0; k<8; k++)
+		_mm_storeu_si128((__m128i*)(out+4*k), acc[k]);
+}
 
-		if (zncc > cur_max) {
-			cur_max = zncc;
-			disp_best = d;
+/* Two groups of 16 pixels */
+__attribute__((target("avx2")))
+void cross_block_avx2(unsigned char* il, unsigned char* ir,
+		unsigned int w, int x, int d, int y0, int y1,
+		unsigned int* out)
+{
+	__m256i acc[4];
+	__m256i l16, r16, p16;
+
+	for (int k=0; k<4; k++)
+		acc[k] = _mm256_setzero_si256();
+
+	for (int y=y0; y<y1; y++) {
+		unsigned char* pl = il + y*w + x;
+		unsigned char* pr = ir + y*w + x - d;
+		for (int t=0; t<WIN_W; t++) {
+			for (int g=0; g<2; g++) {
+				l16 = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+					(__m128i*)(pl+t+16*g)));
+				r16 = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+					(__m128i*)(pr+t+16*g)));
+				p16 = _mm256_mullo_epi16(l16, r16);
+				acc[2*g] = _mm256_add_epi32(acc[2*g],
+					_mm256_cvtepu16_epi32(
+					_mm256_castsi256_si128(p16)));
+				acc[2*g+1] = _mm256_add_epi32(acc[2*g+1],
+					_mm256_cvtepu16_epi32(
+					_mm256_extracti128_si256(p16, 1)));
+			}
 		}
 	}
-	disp_map[i*w+j] = (unsigned char) abs(disp_best);
+	for (int k=0; k<4; k++)
+		_mm256_storeu_si256((__m256i*)(out+8*k), acc[k]);
+}
+
+/* All 32 pixels at once */
+__attribute__((target("avx512f,avx512bw")))
+void cross_block_avx512(unsigned char* il, unsigned char* ir,
+		unsigned int w, int x, int d, int y0, int y1,
+		unsigned int* out)
+{
+	__m512i acc_lo = _mm512_setzero_si512();
+	__m512i acc_hi = _mm512_setzero_si512();
+	__m512i l16, r16, p16;
+
+	for (int y=y0; y<y1; y++) {
+		unsigned char* pl = il + y*w + x;
+		unsigned char* pr = ir + y*w + x - d;
+		for (int t=0; t<WIN_W; t++) {
+			l16 = _mm512_cvtepu8_epi16(
+				_mm256_loadu_si256((__m256i*)(pl+t)));
+			r16 = _mm512_cvtepu8_epi16(
+				_mm256_loadu_si256((__m256i*)(pr+t)));
+			p16 = _mm512_mullo_epi16(l16, r16);
+			acc_lo = _mm512_add_epi32(acc_lo, _mm512_cvtepu16_epi32(
+				_mm512_castsi512_si256(p16)));
+			acc_hi = _mm512_add_epi32(acc_hi, _mm512_cvtepu16_epi32(
+				_mm512_extracti64x4_epi64(p16, 1)));
+		}
 	}
+	_mm512_storeu_si512((void*)out, acc_lo);
+	_mm512_storeu_si512((void*)(out+16), acc_hi);
+}
+#endif
+
+/* The cross_block() of every ISA_* */
+const cross_func cross_blocks[N_ISA] = {
+	cross_block_scalar, ISA_VARIANT(cross_block_sse41),
+	ISA_VARIANT(cross_block_avx2), ISA_VARIANT(cross_block_avx512)
+};
+
+
+/*
+ * calc_zncc with the cross term computed for SIMD_WIDTH adjacent pixels at
+ * a time. Pixels whose window is inside both images for every disparity of
+ * the range go through cross_block() without any border checks, the
+ * remaining columns near the left and right edges are done in a separate
+ * scalar pass with the clipped window. All sums are exact integers and the
+ * score comes from zncc_score(), so the map is the same as calc_zncc's.
+ */
+void calc_zncc_simd(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map)
+{
+	unsigned int* sat_l;
+	unsigned int* sat_l_sq;
+	unsigned int* sat_r;
+	unsigned int* sat_r_sq;
+	unsigned int* cross;	/* sum LR of the current row and d */
+	float* cur_max;
+	int* disp_best;
+
+	int x0, x1, y0, y1;
+	int j_lo, j_hi;
+	int n;
+	float zncc;
+
+	sat_l = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_l_sq = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_r = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_r_sq = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	integral_image(il, w, h, sat_l, sat_l_sq);
+	integral_image(ir, w, h, sat_r, sat_r_sq);
+
+	cross = malloc(w*sizeof(unsigned int));
+	cur_max = malloc(w*sizeof(float));
+	disp_best = malloc(w*sizeof(int));
+
+	/* Columns whose full window fits for every d in the range */
+	j_lo = WIN_W/2 + (disp_max > 0 ? disp_max : 0);
+	j_hi = (int)w - WIN_W/2 + (disp_min < 0 ? disp_min : 0);
+
+	for (int i=0; i<h; i++) {
+		y0 = i-WIN_H/2 < 0 ? 0 : i-WIN_H/2;
+		y1 = i+WIN_H/2 > h ? h : i+WIN_H/2;
+
+		for (int j=0; j<w; j++) {
+			cur_max[j] = -1;
+			disp_best[j] = disp_max;
+		}
+
+	for (int d=disp_min; d<=disp_max; d++) {
+		/*
+		 * Interior, branch-free
+		 */
+		int j = j_lo;
+		for (; j+SIMD_WIDTH<=j_hi; j+=SIMD_WIDTH)
+			cross_block(il, ir, w, j-WIN_W/2, d, y0, y1, cross+j);
+
+		/*
+		 * Borders and the tail of the interior
+		 */
+		for (int k=0; k<w; k++) {
+			if (k >= j_lo && k < j)
+				continue;
+			x0 = k-WIN_W/2;
+			if (x0 < 0) x0 = 0;
+			if (x0 < d) x0 = d;
+			x1 = k+WIN_W/2;
+			if (x1 > w) x1 = w;
+			if (x1 > (int)w+d) x1 = w+d;
+
+			cross[k] = 0;
+			for (int y=y0; y<y1; y++)
+				for (int x=x0; x<x1; x++)
+					cross[k] += il[y*w+x] * ir[y*w+x-d];
+		}
+
+		/*
+		 * Scores
+		 */
+		for (int k=0; k<w; k++) {
+			x0 = k-WIN_W/2;
+			if (x0 < 0) x0 = 0;
+			if (x0 < d) x0 = d;
+			x1 = k+WIN_W/2;
+			if (x1 > w) x1 = w;
+			if (x1 > (int)w+d) x1 = w+d;
+			if (x0 >= x1)
+				continue;
+			n = (x1-x0) * (y1-y0);
+
+			zncc = zncc_score(
+				box_sum(sat_l, w, x0, y0, x1, y1),
+				box_sum(sat_r, w, x0-d, y0, x1-d, y1),
+				box_sum(sat_l_sq, w, x0, y0, x1, y1),
+				box_sum(sat_r_sq, w, x0-d, y0, x1-d, y1),
+				cross[k], n, WIN_PIXELS);
+
+			if (zncc > cur_max[k]) {
+				cur_max[k] = zncc;
+				disp_best[k] = d;
+			}
+		}
+	}
+		for (int j=0; j<w; j++)
+			disp_map[i*w+j] = (unsigned char) abs(disp_best[j]);
 	}
 
+	free(sat_l);
+	free(sat_l_sq);
+	free(sat_r);
+	free(sat_r_sq);
+	free(cross);
+	free(cur_max);
+	free(disp_best);
+}
+
+
+/*
+ * L2R and R2L in one pass. The score of left pixel x at disparity d and the
+ * score of right pixel x-d at -d compare the same two windows, so every
+ * window pair is scored once, like in calc_zncc_volume, and offered to both
+ * maps. Left pixel centres up to WIN_W/2 outside the image are scored too,
+ * since their windows still reach right pixels that R2L needs. R2L keeps
+ * the last maximum over increasing d, which is the first one over its own
+ * increasing disparities -d, so both maps match two calc_zncc calls.
+ */
+void calc_zncc_bidir(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_l2r, unsigned char* disp_r2l)
+{
+	const int pad = WIN_W/2;
+	const int wp = w + 2*pad;
+
+	unsigned int* sat_l;
+	unsigned int* sat_l_sq;
+	unsigned int* sat_r;
+	unsigned int* sat_r_sq;
+	unsigned int* prefix;	/* prefix sums of one row of L(x)*R(x-d) */
+	unsigned int* row_sum;	/* row pass, wp x h */
+	unsigned int* col_sum;	/* column pass, one running sum per x */
+	float* best_l2r;
+	float* best_r2l;
+	int* l2r;
+	int* r2l;
+
+	int x0, x1, y0, y1;
+	int p0, p1;
+	int n;
+	float zncc;
+
+	sat_l = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_l_sq = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_r = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_r_sq = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	integral_image(il, w, h, sat_l, sat_l_sq);
+	integral_image(ir, w, h, sat_r, sat_r_sq);
+
+	prefix = malloc((w+1)*sizeof(unsigned int));
+	row_sum = malloc(wp*h*sizeof(unsigned int));
+	col_sum = malloc(wp*sizeof(unsigned int));
+	best_l2r = malloc(w*h*sizeof(float));
+	best_r2l = malloc(w*h*sizeof(float));
+	l2r = malloc(w*h*sizeof(int));
+	r2l = malloc(w*h*sizeof(int));
+
+	for (int i=0; i<w*h; i++) {
+		best_l2r[i] = -1;
+		best_r2l[i] = -1;
+		l2r[i] = disp_max;
+		r2l[i] = -disp_min;
+	}
+
+	for (int d=disp_min; d<=disp_max; d++) {
+		p0 = d < 0 ? 0 : d;
+		p1 = d < 0 ? (int)w+d : (int)w;
+
+		/*
+		 * Row pass, window sums as prefix differences so that the
+		 * centres outside the image need no special cases
+		 */
+		for (int y=0; y<h; y++) {
+			prefix[0] = 0;
+			for (int x=0; x<w; x++)
+				prefix[x+1] = prefix[x] + (x >= p0 && x < p1 ?
+					il[y*w+x] * ir[y*w+x-d] : 0);
+
+			for (int x=-pad; x<(int)w+pad; x++) {
+				x0 = x-WIN_W/2 < 0 ? 0 : x-WIN_W/2;
+				x1 = x+WIN_W/2 > w ? w : x+WIN_W/2;
+				row_sum[y*wp+x+pad] = x0 < x1 ?
+					prefix[x1] - prefix[x0] : 0;
+			}
+		}
+
+		/*
+		 * Column pass over [y-WIN_H/2, y+WIN_H/2), scoring as we go
+		 */
+		for (int x=0; x<wp; x++)
+			col_sum[x] = 0;
+		for (int y=0; y<WIN_H/2-1 && y<h; y++)
+			for (int x=0; x<wp; x++)
+				col_sum[x] += row_sum[y*wp+x];
+
+		for (int i=0; i<h; i++) {
+			if (i+WIN_H/2-1 < h)
+				for (int x=0; x<wp; x++)
+					col_sum[x] +=
+						row_sum[(i+WIN_H/2-1)*wp+x];
+			if (i-WIN_H/2-1 >= 0)
+				for (int x=0; x<wp; x++)
+					col_sum[x] -=
+						row_sum[(i-WIN_H/2-1)*wp+x];
+
+			y0 = i-WIN_H/2 < 0 ? 0 : i-WIN_H/2;
+			y1 = i+WIN_H/2 > h ? h : i+WIN_H/2;
+
+			for (int j=-pad; j<(int)w+pad; j++) {
+				x0 = j-WIN_W/2;
+				if (x0 < p0) x0 = p0;
+				x1 = j+WIN_W/2;
+				if (x1 > p1) x1 = p1;
+				if (x0 >= x1)
+					continue;
+				n = (x1-x0) * (y1-y0);
+
+				zncc = zncc_score(
+					box_sum(sat_l, w, x0, y0, x1, y1),
+					box_sum(sat_r, w, x0-d, y0, x1-d, y1),
+					box_sum(sat_l_sq, w, x0, y0, x1, y1),
+					box_sum(sat_r_sq, w, x0-d, y0, x1-d,
+						y1),
+					col_sum[j+pad], n, WIN_PIXELS);
+
+				/* Left pixel j at d */
+				if (j >= 0 && j < w && zncc > best_l2r[i*w+j]) {
+					best_l2r[i*w+j] = zncc;
+					l2r[i*w+j] = d;
+				}
+				/* Right pixel j-d at -d */
+				if (j-d >= 0 && j-d < w && zncc > -1 &&
+				    zncc >= best_r2l[i*w+j-d]) {
+					best_r2l[i*w+j-d] = zncc;
+					r2l[i*w+j-d] = -d;
+				}
+			}
+		}
+	}
+
+	for (int i=0; i<w*h; i++) {
+		disp_l2r[i] = (unsigned char) abs(l2r[i]);
+		disp_r2l[i] = (unsigned char) abs(r2l[i]);
+	}
+
+	free(sat_l);
+	free(sat_l_sq);
+	free(sat_r);
+	free(sat_r_sq);
+	free(prefix);
+	free(row_sum);
+	free(col_sum);
+	free(best_l2r);
+	free(best_r2l);
+	free(l2r);
+	free(r2l);
 }
 
 
@@ -156,13 +1448,40 @@ void normalize(unsigned char* res, unsigned int size)
 	}
 }
 
+/* Wall clock in ms */
+double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
 
-int main(void)
+
+int main(int argc, char** argv)
 {
 	const char* inL = "imageL.png";
 	const char* inR = "imageR.png";
 	const char* out = "output.png";
 
+	/*
+	 * pixel: calc_zncc, volume: calc_zncc_volume, simd: calc_zncc_simd,
+	 * pyramid: calc_zncc_pyramid, bidir: calc_zncc_bidir,
+	 * census: calc_census, match: calc_match
+	 */
+	zncc_func zncc = calc_zncc;
+	int bidir = 0;
+	int max_disp = MAX_DISP;
+	int max_isa = N_ISA-1;
+	double t;
+
+	/* Input shrink of --down and --filter, output size of --upscale */
+	int down = 1;
+	int down_filter = PNGDOWN_BOX;
+	int upscale = 0;
+	unsigned int full_w, full_h;
+	unsigned char* big;
+
 	unsigned err;
 	unsigned char* imageL=0;
 	unsigned char* imageR=0;
@@ -173,13 +1492,94 @@ int main(void)
 	unsigned char* disp_r2l;
 	unsigned char* res;
 
-	/* Load images */
-	err = lodepng_decode_file(&imageL, &w, &h, inL, LCT_GREY, 8);
+	for (int i=1; i<argc; i++) {
+		if (strcmp(argv[i], "--mode=float") == 0) {
+			zncc_mode = ZNCC_FLOAT;
+		} else if (strcmp(argv[i], "--mode=int") == 0) {
+			zncc_mode = ZNCC_INT;
+		} else if (strcmp(argv[i], "--engine=pixel") == 0) {
+			zncc = calc_zncc;
+		} else if (strcmp(argv[i], "--engine=volume") == 0) {
+			zncc = calc_zncc_volume;
+		} else if (strcmp(argv[i], "--engine=simd") == 0) {
+			zncc = calc_zncc_simd;
+		} else if (strcmp(argv[i], "--engine=pyramid") == 0) {
+			zncc = calc_zncc_pyramid;
+		} else if (strcmp(argv[i], "--engine=bidir") == 0) {
+			bidir = 1;
+		} else if (strcmp(argv[i], "--engine=census") == 0) {
+			zncc = calc_census;
+		} else if (strcmp(argv[i], "--engine=match") == 0) {
+			zncc = calc_match;
+		} else if (strncmp(argv[i], "--cost=", 7) == 0 &&
+		    (cost_search = find_matcher(argv[i]+7)) != NULL) {
+			zncc = calc_match;
+		} else if (strncmp(argv[i], "--coarse=", 9) == 0 &&
+		    (coarse_search = find_matcher(argv[i]+9)) != NULL) {
+			zncc = calc_zncc_pyramid;
+		} else if (strncmp(argv[i], "--levels=", 9) == 0) {
+			pyr_levels = atoi(argv[i]+9);
+			if (pyr_levels < 1) pyr_levels = 1;
+			if (pyr_levels > MAX_LEVELS) pyr_levels = MAX_LEVELS;
+		} else if (strncmp(argv[i], "--band=", 7) == 0) {
+			pyr_band = atoi(argv[i]+7);
+		} else if (strcmp(argv[i], "--prune") == 0) {
+			prune = 1;
+		} else if (strncmp(argv[i], "--good=", 7) == 0) {
+			good_score = atof(argv[i]+7);
+		} else if (strncmp(argv[i], "--disp=", 7) == 0) {
+			max_disp = atoi(argv[i]+7);
+			if (max_disp < 1) max_disp = 1;
+		} else if (strncmp(argv[i], "--left=", 7) == 0) {
+			inL = argv[i]+7;
+		} else if (strncmp(argv[i], "--right=", 8) == 0) {
+			inR = argv[i]+8;
+		} else if (strncmp(argv[i], "--out=", 6) == 0) {
+			out = argv[i]+6;
+		} else if (strncmp(argv[i], "--down=", 7) == 0) {
+			down = atoi(argv[i]+7);
+			if (down < 1) down = 1;
+			if (down > PNGDOWN_MAX_FACTOR)
+				down = PNGDOWN_MAX_FACTOR;
+		} else if (strcmp(argv[i], "--filter=box") == 0) {
+			down_filter = PNGDOWN_BOX;
+		} else if (strcmp(argv[i], "--filter=gauss") == 0) {
+			down_filter = PNGDOWN_GAUSS;
+		} else if (strcmp(argv[i], "--upscale") == 0) {
+			upscale = 1;
+		} else if (isa_option(argv[i], &max_isa)) {
+		} else {
+			printf("Usage: %s "
+				"[--engine=pixel|volume|simd|pyramid|bidir|"
+				"census|match] "
+				"[--cost=sad|ssd|ncc|zncc[:%dx%d|:%dx%d]] "
+				"[--coarse=COST] "
+				"[--mode=float|int] [--levels=N] [--band=K] "
+				"[--prune] [--good=S] [--disp=N] [--left=PNG] "
+				"[--right=PNG] [--out=PNG] [--down=F] "
+				"[--filter=box|gauss] [--upscale] "
+				ISA_USAGE "\n",
+				argv[0], WIN_W, WIN_H, COARSE_W, COARSE_H);
+			return 3;
+		}
+	}
+
+	/* --disp is in pixels of the full-size images */
+	max_disp = (max_disp + down-1) / down;
+	if (cost_search == NULL)
+		cost_search = match_zncc;
+	cross_block = cross_blocks[cpu_dispatch(max_isa)];
+
+	/* Load images, shrunk by --down while they are decoded */
+	t = now_ms();
+	err = pngdown_decode_file(&imageL, &w, &h, &full_w, &full_h, inL,
+			down, down_filter);
 	if (err)
 		return 1;
 	temp = w*h;
 
-	err = lodepng_decode_file(&imageR, &w, &h, inR, LCT_GREY, 8);
+	err = pngdown_decode_file(&imageR, &w, &h, &full_w, &full_h, inR,
+			down, down_filter);
 	if (err)
 		return 1;
 	size = w*h;
@@ -189,17 +1589,33 @@ int main(void)
 		return 2;
 	}
 
+	printf("Stage load: %0.3f ms\n", now_ms() - t);
+
 	disp_l2r = calloc(size, sizeof(unsigned char));
 	disp_r2l = calloc(size, sizeof(unsigned char));
 
 	/* Calculate ZNCC */
-	printf("Calculating L2R\n");
-	calc_zncc(imageL, imageR, w, h, MIN_DISP, MAX_DISP, disp_l2r);
-	printf("Calculating R2L\n");
-	calc_zncc(imageR, imageL, w, h, -MAX_DISP, MIN_DISP, disp_r2l);
+	t = now_ms();
+	if (bidir) {
+		printf("Calculating L2R and R2L\n");
+		calc_zncc_bidir(imageL, imageR, w, h, MIN_DISP, max_disp,
+				disp_l2r, disp_r2l);
+	} else {
+		printf("Calculating L2R\n");
+		zncc(imageL, imageR, w, h, MIN_DISP, max_disp, disp_l2r);
+		printf("Calculating R2L\n");
+		zncc(imageR, imageL, w, h, -max_disp, MIN_DISP, disp_r2l);
+	}
+	printf("Stage zncc: %0.3f ms\n", now_ms() - t);
 	res = calloc(size, sizeof(unsigned char));
 
+	if (prune || good_score <= 1)
+		printf("Skipped: %ld candidates by bound (%ld taps), "
+			"%ld candidates by --good\n", skip_pairs, skip_taps,
+			skip_good);
+
 	printf("Post-processing...\n");
+	t = now_ms();
 
 	/* Cross checking */
 	cross_checking(disp_l2r, disp_r2l, size, res);
@@ -207,9 +1623,19 @@ int main(void)
 	occlusion_filling(res, size);
 	/* Normalize */
 	normalize(res, size);
+	printf("Stage post: %0.3f ms\n", now_ms() - t);
 
 	printf("Done, creating the output image\n");
-	lodepng_encode_file(out, res, w, h, LCT_GREY, 8);
+	t = now_ms();
+	if (upscale) {
+		big = malloc(full_w*full_h);
+		pngdown_upscale(res, w, h, big, full_w, full_h);
+		lodepng_encode_file(out, big, full_w, full_h, LCT_GREY, 8);
+		free(big);
+	} else {
+		lodepng_encode_file(out, res, w, h, LCT_GREY, 8);
+	}
+	printf("Stage save: %0.3f ms\n", now_ms() - t);
 
 	free(imageL);
 	free(imageR);
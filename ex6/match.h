@@ -0,0 +1,148 @@
+/*
+ * Matching costs with the window and the cost fixed at compile time. Every
+ * inclusion with MATCH_NAME, MATCH_COST, MATCH_W and MATCH_H defined emits
+ *
+ * long MATCH_NAME(unsigned char* il, unsigned char* ir, unsigned int w,
+ *		unsigned int h, int disp_min, int disp_max, int* guess,
+ *		int band, int* disp);
+ *
+ * which searches like zncc_search() without --prune and --good, scoring
+ * the MATCH_W x MATCH_H window around every pixel with MATCH_COST. The
+ * cost is a set of macros, so the tap is inlined and nothing is called per
+ * tap. Where the whole window is inside both images for every candidate
+ * the window loops have constant bounds; only the border pixels take the
+ * loop that is clipped to the image.
+ */
+
+#ifndef MATCH_COSTS_H
+#define MATCH_COSTS_H
+
+/*
+ * A cost declares its window sums (_SUMS), adds one tap to them (_TAP),
+ * turns them into a score of n taps over a p pixel window (_SCORE), higher
+ * is better, and names a score every candidate has to beat (_WORST).
+ */
+#define SAD_SUMS unsigned int sad = 0
+#define SAD_TAP(l, r) sad += abs((l) - (r))
+#define SAD_SCORE(n, p) (-(float)sad / (n))
+#define SAD_WORST (-INFINITY)
+
+#define SSD_SUMS unsigned int ssd = 0
+#define SSD_TAP(l, r) ssd += ((l) - (r)) * ((l) - (r))
+#define SSD_SCORE(n, p) (-(float)ssd / (n))
+#define SSD_WORST (-INFINITY)
+
+#define NCC_SUMS unsigned int sq_l = 0, sq_r = 0, cross = 0
+#define NCC_TAP(l, r) (sq_l += (l)*(l), sq_r += (r)*(r), cross += (l)*(r))
+#define NCC_SCORE(n, p) (cross / sqrt((double)sq_l * sq_r))
+#define NCC_WORST (-1)
+
+/* zncc_score() of ex6.c, --mode applies */
+#define ZNCC_SUMS unsigned int sum_l = 0, sum_r = 0, \
+	sq_l = 0, sq_r = 0, cross = 0
+#define ZNCC_TAP(l, r) (sum_l += (l), sum_r += (r), sq_l += (l)*(l), \
+	sq_r += (r)*(r), cross += (l)*(r))
+#define ZNCC_SCORE(n, p) zncc_score(sum_l, sum_r, sq_l, sq_r, cross, n, p)
+#define ZNCC_WORST (-1)
+
+#define MATCH_PASTE(a, b) a##b
+#define MATCH_OF(cost, what) MATCH_PASTE(cost, what)
+
+#endif
+
+
+long MATCH_NAME(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max, int* guess,
+		int band, int* disp)
+{
+	float cur_max;
+	float score;
+	int disp_best;
+	int x0, x1, y0, y1;
+	int lo, hi;
+	int inside;
+	long pairs = 0;
+	int l, r;
+
+	for (int i=0; i<h; i++) {
+		/* Rows of the window that are inside the image */
+		y0 = i-MATCH_H/2 < 0 ? 0 : i-MATCH_H/2;
+		y1 = i-MATCH_H/2+MATCH_H > h ? h : i-MATCH_H/2+MATCH_H;
+
+	for (int j=0; j<w; j++) {
+		lo = disp_min;
+		hi = disp_max;
+		if (guess != NULL) {
+			if (lo < guess[i*w+j]-band) lo = guess[i*w+j]-band;
+			if (hi > guess[i*w+j]+band) hi = guess[i*w+j]+band;
+		}
+		cur_max = MATCH_OF(MATCH_COST, _WORST);
+		disp_best = guess != NULL ? guess[i*w+j] : disp_max;
+
+		/* The full window in both images for every d of lo..hi */
+		inside = y1-y0 == MATCH_H
+			&& j-MATCH_W/2 >= (hi > 0 ? hi : 0)
+			&& j-MATCH_W/2+MATCH_W <= (int)w + (lo < 0 ? lo : 0);
+
+	for (int d=lo; d<=hi; d++) {
+		/* Both the left pixel x and the right pixel x-d in the image */
+		x0 = j-MATCH_W/2;
+		x1 = j-MATCH_W/2+MATCH_W;
+		if (!inside) {
+			if (x0 < 0) x0 = 0;
+			if (x0 < d) x0 = d;
+			if (x1 > w) x1 = w;
+			if (x1 > (int)w+d) x1 = w+d;
+			if (x0 >= x1)
+				continue;
+		}
+		pairs++;
+
+		{
+			MATCH_OF(MATCH_COST, _SUMS);
+
+			if (inside) {
+				unsigned char* pl = il + y0*w + x0;
+				unsigned char* pr = ir + y0*w + x0-d;
+
+				for (int y=0; y<MATCH_H; y++) {
+					for (int x=0; x<MATCH_W; x++) {
+						l = pl[y*w+x];
+						r = pr[y*w+x];
+						MATCH_OF(MATCH_COST, _TAP)(l,
+								r);
+					}
+				}
+				score = MATCH_OF(MATCH_COST, _SCORE)(
+						MATCH_W*MATCH_H,
+						MATCH_W*MATCH_H);
+			} else {
+				for (int y=y0; y<y1; y++) {
+					for (int x=x0; x<x1; x++) {
+						l = il[y*w+x];
+						r = ir[y*w+x-d];
+						MATCH_OF(MATCH_COST, _TAP)(l,
+								r);
+					}
+				}
+				score = MATCH_OF(MATCH_COST, _SCORE)(
+						(x1-x0) * (y1-y0),
+						MATCH_W*MATCH_H);
+			}
+		}
+
+		if (score > cur_max) {
+			cur_max = score;
+			disp_best = d;
+		}
+	}
+	disp[i*w+j] = disp_best;
+	}
+	}
+	return pairs;
+}
+
+#undef MATCH_NAME
+#undef MATCH_COST
+#undef MATCH_W
+#undef MATCH_H
@@ -1,21 +1,118 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "lodepng.h"
+#include "../common/pngdown.h"
+
+/*
+ * The cross term of zncc_tile() has a cross_window() for AVX-512BW, AVX2,
+ * SSE4.1 and plain C, picked at startup, see cpu_dispatch.h and --isa.
+ */
+#include "../common/cpu_dispatch.h"
 
 #define MAX_DISP 64
 #define MIN_DISP 0
+#ifndef WIN_W
 #define WIN_W 18
+#endif
+#ifndef WIN_H
 #define WIN_H 14
-#define WIN_PIXELS WIN_W*WIN_H
+#endif
+#define WIN_PIXELS (WIN_W*WIN_H)
 #define THRESHOLD 12
+#define COL_BLOCK 64
+
+/* Work split of the pixel engine, one tile is one unit of scheduling */
+#ifndef TILE_W
+#define TILE_W 64
+#endif
+#ifndef TILE_H
+#define TILE_H 8
+#endif
+
+/* How zncc_score() turns the window sums into a score, see --mode */
+#define ZNCC_FLOAT 0
+#define ZNCC_INT 1
+
+/* Integral images of I and I^2 of one input */
+struct sat {
+	unsigned int* sum;
+	unsigned int* sq;
+};
+
+/* Computes both the L2R and the R2L disparity maps */
+typedef void (*stereo_func)(unsigned char* il, unsigned char* ir,
+		unsigned int w, unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_l2r, unsigned char* disp_r2l);
+
+/* Sum of L(x)*R(x-d) over x0 <= x < x1, y0 <= y < y1 */
+typedef unsigned int (*cross_func)(unsigned char* il, unsigned char* ir,
+		unsigned int w, int d, int x0, int x1, int y0, int y1);
+
+int zncc_mode = ZNCC_FLOAT;
+
+/* cross_window() variant of zncc_tile, see cpu_dispatch() */
+cross_func cross_window;
 
 /* Prototypes */
-void calc_zncc(unsigned char* il, unsigned char* ir, unsigned int w,
+void calc_zncc_both(unsigned char* il, unsigned char* ir, unsigned int w,
 		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_l2r, unsigned char* disp_r2l);
+
+void calc_zncc_volume_both(unsigned char* il, unsigned char* ir,
+		unsigned int w, unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_l2r, unsigned char* disp_r2l);
+
+void zncc_tile(unsigned char* il, unsigned char* ir, struct sat* sat_l,
+		struct sat* sat_r, unsigned int w, unsigned int h,
+		int disp_min, int disp_max, int ty, int tx,
 		unsigned char* disp_map);
 
+unsigned int cross_window_scalar(unsigned char* il, unsigned char* ir,
+		unsigned int w, int d, int x0, int x1, int y0, int y1);
+#ifdef CPU_X86
+unsigned int cross_window_sse41(unsigned char* il, unsigned char* ir,
+		unsigned int w, int d, int x0, int x1, int y0, int y1);
+unsigned int cross_window_avx2(unsigned char* il, unsigned char* ir,
+		unsigned int w, int d, int x0, int x1, int y0, int y1);
+unsigned int cross_window_avx512(unsigned char* il, unsigned char* ir,
+		unsigned int w, int d, int x0, int x1, int y0, int y1);
+#endif
+
+void sat_create(unsigned char* img, unsigned int w, unsigned int h,
+		struct sat* sat);
+
+void sat_free(struct sat* sat);
+
+unsigned char* alloc_maps(unsigned int w, unsigned int h,
+		unsigned char** disp_r2l);
+
+void calc_zncc_volume(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map);
+
+float zncc_score(unsigned int sum_left, unsigned int sum_right,
+		unsigned int sq_left, unsigned int sq_right, unsigned int cross,
+		int n);
+
+float zncc_score_float(double sum_left, double sum_right, double sq_left,
+		double sq_right, double cross, int n);
+
+float zncc_score_int(int sum_left, int sum_right, int sq_left, int sq_right,
+		int cross, int n);
+
+void integral_image(unsigned char* img, unsigned int w, unsigned int h,
+		unsigned int* sat, unsigned int* sat_sq);
+
+unsigned int box_sum(unsigned int* sat, unsigned int w, int x0, int y0,
+		int x1, int y1);
+
 void cross_checking(unsigned char* left, unsigned char* right,
 		unsigned int size, unsigned char* out);
 
@@ -23,82 +120,313 @@ void occlusion_filling(unsigned char* res, unsigned int size);
 
 void normalize(unsigned char* res, unsigned int size);
 
+double now_ms(void);
 
 
 
-void calc_zncc(unsigned char* il, unsigned char* ir, unsigned int w,
-		unsigned int h, int disp_min, int disp_max,
+
+/*
+ * Summed-area tables of I and I^2. Both are (w+1)x(h+1) with a zero first
+ * row and column so that box_sum() needs no special cases at the borders.
+ * The tables are plain unsigned ints and are allowed to wrap: a window sum
+ * is always below 2^32, so the four-corner difference is still exact.
+ */
+void integral_image(unsigned char* img, unsigned int w, unsigned int h,
+		unsigned int* sat, unsigned int* sat_sq)
+{
+	/*
+	 * Row prefix sums first, every thread touching its own rows, then
+	 * the sums down the columns in blocks of columns
+	 */
+#pragma omp parallel for schedule(static)
+	for (int y=0; y<=h; y++) {
+		unsigned int row = 0;
+		unsigned int row_sq = 0;
+		unsigned int px;
+
+		sat[y*(w+1)] = 0;
+		sat_sq[y*(w+1)] = 0;
+		for (int x=0; x<w; x++) {
+			px = y > 0 ? img[(y-1)*w+x] : 0;
+			row += px;
+			row_sq += px*px;
+			sat[y*(w+1)+x+1] = row;
+			sat_sq[y*(w+1)+x+1] = row_sq;
+		}
+	}
+
+#pragma omp parallel for schedule(static)
+	for (int xb=0; xb<=w; xb+=COL_BLOCK) {
+		int xe = xb+COL_BLOCK > w+1 ? w+1 : xb+COL_BLOCK;
+		for (int y=1; y<=h; y++) {
+			for (int x=xb; x<xe; x++) {
+				sat[y*(w+1)+x] += sat[(y-1)*(w+1)+x];
+				sat_sq[y*(w+1)+x] += sat_sq[(y-1)*(w+1)+x];
+			}
+		}
+	}
+}
+
+void sat_create(unsigned char* img, unsigned int w, unsigned int h,
+		struct sat* sat)
+{
+	sat->sum = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat->sq = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	integral_image(img, w, h, sat->sum, sat->sq);
+}
+
+void sat_free(struct sat* sat)
+{
+	free(sat->sum);
+	free(sat->sq);
+}
+
+/*
+ * ZNCC of one window from its sums. The means are taken over the full
+ * WIN_PIXELS like the direct version always did, while n is the number of
+ * taps that were actually inside the image. Expanding the centered sums:
+ * sum (L-mL)(R-mR) = sum LR - mR*sum L - mL*sum R + n*mL*mR
+ * The terms are grouped so that swapping left and right gives bit for bit
+ * the same score.
+ */
+float zncc_score_float(double sum_left, double sum_right, double sq_left,
+		double sq_right, double cross, int n)
+{
+	double mean_left = sum_left / WIN_PIXELS;
+	double mean_right = sum_right / WIN_PIXELS;
+	double nominator;
+	double denominator1;
+	double denominator2;
+
+	nominator = cross - (mean_right*sum_left + mean_left*sum_right)
+		+ n*(mean_left*mean_right);
+	denominator1 = sq_left - 2*mean_left*sum_left
+		+ n*mean_left*mean_left;
+	denominator2 = sq_right - 2*mean_right*sum_right
+		+ n*mean_right*mean_right;
+	return nominator / (sqrt(denominator1*denominator2));
+}
+
+/*
+ * Same score with the means folded in exactly. Multiplying the centered
+ * sums by WIN_PIXELS^2 leaves only integers, e.g.
+ * P^2 * sum (L-mL)(R-mR) = P^2*sum LR - (2P-n)*sum L*sum R,
+ * which fit in 64 bits for any sane window. Only the final division is
+ * done in floating point, so the score does not depend on rounding in the
+ * sums. The window sums themselves are below 2^31.
+ */
+float zncc_score_int(int sum_left, int sum_right, int sq_left, int sq_right,
+		int cross, int n)
+{
+	const long long p2 = (long long)WIN_PIXELS * WIN_PIXELS;
+	const long long k = 2*WIN_PIXELS - n;
+	long long nominator;
+	long long denominator1;
+	long long denominator2;
+
+	nominator = p2*cross - k*sum_left*sum_right;
+	denominator1 = p2*sq_left - k*sum_left*sum_left;
+	denominator2 = p2*sq_right - k*sum_right*sum_right;
+	return nominator / sqrt((double)denominator1*denominator2);
+}
+
+float zncc_score(unsigned int sum_left, unsigned int sum_right,
+		unsigned int sq_left, unsigned int sq_right, unsigned int cross,
+		int n)
+{
+	if (zncc_mode == ZNCC_INT)
+		return zncc_score_int(sum_left, sum_right, sq_left, sq_right,
+				cross, n);
+	return zncc_score_float(sum_left, sum_right, sq_left, sq_right,
+			cross, n);
+}
+
+/* Sum over the pixels x0 <= x < x1, y0 <= y < y1 */
+unsigned int box_sum(unsigned int* sat, unsigned int w, int x0, int y0,
+		int x1, int y1)
+{
+	return sat[y1*(w+1)+x1] - sat[y0*(w+1)+x1]
+	     - sat[y1*(w+1)+x0] + sat[y0*(w+1)+x0];
+}
+
+
+/*
+ * Cross term of one clipped window. Every tap is inside both images, so
+ * there is no border test here. The SIMD variants widen the pixels to 16
+ * bits and add pairs of products with madd into 32-bit lanes, which is
+ * exact for 8-bit pixels. All variants give the same sum.
+ */
+unsigned int cross_window_scalar(unsigned char* il, unsigned char* ir,
+		unsigned int w, int d, int x0, int x1, int y0, int y1)
+{
+	unsigned int cross = 0;
+
+	for (int y=y0; y<y1; y++)
+		for (int x=x0; x<x1; x++)
+			cross += il[y*w+x] * ir[y*w+x-d];
+	return cross;
+}
+
+#ifdef CPU_X86
+/* 8 pixels at a time, the rest of the row in plain C */
+__attribute__((target("sse4.1")))
+unsigned int cross_window_sse41(unsigned char* il, unsigned char* ir,
+		unsigned int w, int d, int x0, int x1, int y0, int y1)
+{
+	__m128i acc = _mm_setzero_si128();
+	__m128i l16, r16;
+	unsigned int cross = 0;
+	int x;
+
+	for (int y=y0; y<y1; y++) {
+		unsigned char* pl = il + y*w;
+		unsigned char* pr = ir + y*w - d;
+		for (x=x0; x+8<=x1; x+=8) {
+			l16 = _mm_cvtepu8_epi16(_mm_loadl_epi64(
+				(__m128i*)(pl+x)));
+			r16 = _mm_cvtepu8_epi16(_mm_loadl_epi64(
+				(__m128i*)(pr+x)));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(l16, r16));
+		}
+		for (; x<x1; x++)
+			cross += pl[x] * pr[x];
+	}
+	acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+	acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 4));
+	return cross + _mm_cvtsi128_si32(acc);
+}
+
+/* 16 pixels at a time, then 8, then plain C */
+__attribute__((target("avx2")))
+unsigned int cross_window_avx2(unsigned char* il, unsigned char* ir,
+		unsigned int w, int d, int x0, int x1, int y0, int y1)
+{
+	__m256i acc = _mm256_setzero_si256();
+	__m128i acc8 = _mm_setzero_si128();
+	__m256i l16, r16;
+	unsigned int cross = 0;
+	int x;
+
+	for (int y=y0; y<y1; y++) {
+		unsigned char* pl = il + y*w;
+		unsigned char* pr = ir + y*w - d;
+		for (x=x0; x+16<=x1; x+=16) {
+			l16 = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+				(__m128i*)(pl+x)));
+			r16 = _mm256_cvtepu8_epi16(_mm_loadu_si128(
+				(__m128i*)(pr+x)));
+			acc = _mm256_add_epi32(acc,
+				_mm256_madd_epi16(l16, r16));
+		}
+		if (x+8 <= x1) {
+			acc8 = _mm_add_epi32(acc8, _mm_madd_epi16(
+				_mm_cvtepu8_epi16(_mm_loadl_epi64(
+				(__m128i*)(pl+x))),
+				_mm_cvtepu8_epi16(_mm_loadl_epi64(
+				(__m128i*)(pr+x)))));
+			x += 8;
+		}
+		for (; x<x1; x++)
+			cross += pl[x] * pr[x];
+	}
+	acc8 = _mm_add_epi32(acc8, _mm256_castsi256_si128(acc));
+	acc8 = _mm_add_epi32(acc8, _mm256_extracti128_si256(acc, 1));
+	acc8 = _mm_add_epi32(acc8, _mm_srli_si128(acc8, 8));
+	acc8 = _mm_add_epi32(acc8, _mm_srli_si128(acc8, 4));
+	return cross + _mm_cvtsi128_si32(acc8);
+}
+
+/* 32 pixels at a time, the end of the row with a masked load */
+__attribute__((target("avx512f,avx512bw,avx512vl")))
+unsigned int cross_window_avx512(unsigned char* il, unsigned char* ir,
+		unsigned int w, int d, int x0, int x1, int y0, int y1)
+{
+	__m512i acc = _mm512_setzero_si512();
+	__m512i l16, r16;
+	__mmask32 mask;
+
+	for (int y=y0; y<y1; y++) {
+		unsigned char* pl = il + y*w;
+		unsigned char* pr = ir + y*w - d;
+		for (int x=x0; x<x1; x+=32) {
+			mask = x1-x >= 32 ? ~(__mmask32)0 :
+				((__mmask32)1 << (x1-x)) - 1;
+			l16 = _mm512_cvtepu8_epi16(
+				_mm256_maskz_loadu_epi8(mask, pl+x));
+			r16 = _mm512_cvtepu8_epi16(
+				_mm256_maskz_loadu_epi8(mask, pr+x));
+			acc = _mm512_add_epi32(acc,
+				_mm512_madd_epi16(l16, r16));
+		}
+	}
+	return _mm512_reduce_add_epi32(acc);
+}
+#endif
+
+/* The cross_window() of every ISA_* */
+const cross_func cross_windows[N_ISA] = {
+	cross_window_scalar, ISA_VARIANT(cross_window_sse41),
+	ISA_VARIANT(cross_window_avx2), ISA_VARIANT(cross_window_avx512)
+};
+
+
+/*
+ * ZNCC search for the pixels ty <= i < ty+TILE_H, tx <= j < tx+TILE_W.
+ * All of the state lives on the stack of the calling thread, the only
+ * shared writes are to the tile's own part of disp_map.
+ */
+void zncc_tile(unsigned char* il, unsigned char* ir, struct sat* sat_l,
+		struct sat* sat_r, unsigned int w, unsigned int h,
+		int disp_min, int disp_max, int ty, int tx,
 		unsigned char* disp_map)
 {
-	float cur_max;
-	float sum_left;
-	float sum_right;
-	int idx_l;
-	int idx_r;
-	float nominator=0;
-	float denominator1=0;
-	float denominator2=0;
-	float center_left;
-	float center_right;
-	float zncc;
-	int disp_best=0;
+	int i_end = ty+TILE_H > h ? h : ty+TILE_H;
+	int j_end = tx+TILE_W > w ? w : tx+TILE_W;
 
-#pragma omp parallel for
-	for (int i=0; i<h; i++) {
-	for (int j=0; j<w; j++) {
-		cur_max = -1;
-		disp_best = disp_max;
+	for (int i=ty; i<i_end; i++) {
+		/* Rows of the window that are inside the image */
+		int y0 = i-WIN_H/2 < 0 ? 0 : i-WIN_H/2;
+		int y1 = i+WIN_H/2 > h ? h : i+WIN_H/2;
+
+	for (int j=tx; j<j_end; j++) {
+		float cur_max = -1;
+		int disp_best = disp_max;
 
 	for (int d=disp_min; d<=disp_max; d++) {
+		unsigned int sum_left, sum_right;
+		unsigned int sq_left, sq_right;
+		unsigned int cross;
+		int x0, x1, n;
+		float zncc;
+
 		/*
-		 * Calculate the mean
+		 * Clip the window so that both the left pixel x and the right
+		 * pixel x-d are inside the image. This is the same set of taps
+		 * the per-tap border check used to keep.
 		 */
-		sum_left = 0;
-		sum_right = 0;
-		for (int win_x=-WIN_H/2; win_x<WIN_H/2; win_x++) {
-		for (int win_y=-WIN_W/2; win_y<WIN_W/2; win_y++) {
-			/* Border checking */
-                         if (i+win_x < 0     || i+win_x >= h ||
-			     j+win_y < 0     || j+win_y >= w ||
-			     j+win_y-d < 0   || j+win_y-d >= w)
-				 continue;
-
-			idx_l = w * (i+win_x) +j+win_y;
-			idx_r = w *(i+win_x)+j+win_y-d;
-
-			sum_left += il[idx_l];
-			sum_right += ir[idx_r];
-		}
-		}
-		sum_left /= WIN_PIXELS;
-		sum_right /= WIN_PIXELS;
+		x0 = j-WIN_W/2;
+		if (x0 < 0) x0 = 0;
+		if (x0 < d) x0 = d;
+		x1 = j+WIN_W/2;
+		if (x1 > w) x1 = w;
+		if (x1 > (int)w+d) x1 = w+d;
+		if (x0 >= x1)
+			continue;
+		n = (x1-x0) * (y1-y0);
 
 		/*
-		 * Calcucate ZNCC
+		 * Means and variances straight from the integral images
 		 */
-		nominator = 0;
-		denominator1 = 0;
-		denominator2 = 0;
-
-		for (int win_x=-WIN_H/2; win_x<WIN_H/2; win_x++) {
-		for (int win_y=-WIN_W/2; win_y<WIN_W/2; win_y++) {
-			/* Border checking */
-                        if (i+win_x < 0     || i+win_x >= h ||
-                            j+win_y < 0     || j+win_y >= w ||
-                            j+win_y-d < 0   || j+win_y-d >= w)
-                            continue;
-			idx_l = w * (i+win_x) +j+win_y;
-			idx_r = w *(i+win_x)+j+win_y-d;
-
-			center_left = il[idx_l] - sum_left;
-			center_right = ir[idx_r] - sum_right;
-
-			nominator += center_left * center_right;
-			denominator1 += pow(center_left, 2);
-			denominator2 += pow(center_right, 2);
-		}
-		}
-		zncc = nominator / (sqrt(denominator1*denominator2));
+		sum_left = box_sum(sat_l->sum, w, x0, y0, x1, y1);
+		sum_right = box_sum(sat_r->sum, w, x0-d, y0, x1-d, y1);
+		sq_left = box_sum(sat_l->sq, w, x0, y0, x1, y1);
+		sq_right = box_sum(sat_r->sq, w, x0-d, y0, x1-d, y1);
+
+		/* Only the cross term still needs the window */
+		cross = cross_window(il, ir, w, d, x0, x1, y0, y1);
+
+		zncc = zncc_score(sum_left, sum_right, sq_left, sq_right,
+				cross, n);
 
 		if (zncc > cur_max) {
 			cur_max = zncc;
@@ -108,7 +436,238 @@ void calc_zncc(unsigned char* il, unsigned char* ir, unsigned int w,
 	disp_map[i*w+j] = (unsigned char) abs(disp_best);
 	}
 	}
+}
+
+/*
+ * The image is cut into TILE_W x TILE_H tiles that are handed out with the
+ * schedule set by --schedule (OMP_SCHEDULE otherwise). L2R and R2L are
+ * computed at the same time: the tiles of both directions are work items
+ * of one loop, so threads that run out of L2R tiles go on with R2L ones
+ * instead of waiting for the slowest thread between the two passes. The
+ * integral images are shared by both directions.
+ */
+void calc_zncc_both(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_l2r, unsigned char* disp_r2l)
+{
+	struct sat sat_l;
+	struct sat sat_r;
+	int tiles_y = (h+TILE_H-1) / TILE_H;
+	int tiles_x = (w+TILE_W-1) / TILE_W;
+
+	sat_create(il, w, h, &sat_l);
+	sat_create(ir, w, h, &sat_r);
+
+#pragma omp parallel for collapse(3) schedule(runtime)
+	for (int dir=0; dir<2; dir++)
+		for (int ty=0; ty<tiles_y; ty++)
+			for (int tx=0; tx<tiles_x; tx++) {
+				if (dir == 0)
+					zncc_tile(il, ir, &sat_l, &sat_r, w, h,
+						disp_min, disp_max,
+						ty*TILE_H, tx*TILE_W, disp_l2r);
+				else
+					zncc_tile(ir, il, &sat_r, &sat_l, w, h,
+						-disp_max, -disp_min,
+						ty*TILE_H, tx*TILE_W, disp_r2l);
+			}
+
+	sat_free(&sat_l);
+	sat_free(&sat_r);
+}
+
+/*
+ * Allocates the two disparity maps and touches them with the same loop as
+ * calc_zncc_both, so that with a static schedule each page is first written
+ * by, and placed on the NUMA node of, the thread that computes it.
+ * Returns the L2R map.
+ */
+unsigned char* alloc_maps(unsigned int w, unsigned int h,
+		unsigned char** disp_r2l)
+{
+	unsigned char* disp_l2r = malloc(w*h);
+	int tiles_y = (h+TILE_H-1) / TILE_H;
+	int tiles_x = (w+TILE_W-1) / TILE_W;
+
+	*disp_r2l = malloc(w*h);
+
+#pragma omp parallel for collapse(3) schedule(runtime)
+	for (int dir=0; dir<2; dir++)
+		for (int ty=0; ty<tiles_y; ty++)
+			for (int tx=0; tx<tiles_x; tx++) {
+				unsigned char* map = dir ? *disp_r2l : disp_l2r;
+				int i_end = ty*TILE_H+TILE_H > h ?
+					h : ty*TILE_H+TILE_H;
+				int j_end = tx*TILE_W+TILE_W > w ?
+					w : tx*TILE_W+TILE_W;
+				for (int i=ty*TILE_H; i<i_end; i++)
+					memset(map + i*w + tx*TILE_W, 0,
+						j_end - tx*TILE_W);
+			}
+
+	return disp_l2r;
+}
+
+
+/*
+ * Disparity-major version of zncc_tile(). For every d the product image
+ * L(x)*R(x-d) is box filtered with separable running sums (a row pass, then
+ * a column pass), which gives sum LR for every window at a constant cost per
+ * pixel regardless of WIN_W and WIN_H. The other sums come from the integral
+ * images, so one (pixel, d) pair costs O(1). The best score and disparity of
+ * every pixel are kept in buffers between the disparity passes.
+ *
+ * The row pass is split over rows and the column pass over blocks of
+ * columns, so every thread owns its part of the buffers.
+ */
+void calc_zncc_volume(unsigned char* il, unsigned char* ir, unsigned int w,
+		unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_map)
+{
+	unsigned int* sat_l;
+	unsigned int* sat_l_sq;
+	unsigned int* sat_r;
+	unsigned int* sat_r_sq;
+	unsigned int* row_sum;	/* row pass, w x h */
+	unsigned int* col_sum;	/* column pass, one running sum per x */
+	float* best_score;
+	int* best_disp;
+
+	int p0, p1;
+
+	sat_l = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_l_sq = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_r = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	sat_r_sq = malloc((w+1)*(h+1)*sizeof(unsigned int));
+	integral_image(il, w, h, sat_l, sat_l_sq);
+	integral_image(ir, w, h, sat_r, sat_r_sq);
+
+	row_sum = malloc(w*h*sizeof(unsigned int));
+	col_sum = malloc(w*sizeof(unsigned int));
+	best_score = malloc(w*h*sizeof(float));
+	best_disp = malloc(w*h*sizeof(int));
+
+#pragma omp parallel for
+	for (int i=0; i<w*h; i++) {
+		best_score[i] = -1;
+		best_disp[i] = disp_max;
+	}
+
+	for (int d=disp_min; d<=disp_max; d++) {
+		/* Columns where x-d is inside the image, the product is 0
+		 * elsewhere so the box filter clips the window for free */
+		p0 = d < 0 ? 0 : d;
+		p1 = d < 0 ? (int)w+d : (int)w;
+
+		/*
+		 * Row pass: row_sum(x) sums prod over [x-WIN_W/2, x+WIN_W/2)
+		 */
+#pragma omp parallel
+	{
+		/* one row of L(x)*R(x-d) per thread */
+		unsigned int* prod = malloc(w*sizeof(unsigned int));
+		unsigned int run;
+
+#pragma omp for schedule(runtime)
+		for (int y=0; y<h; y++) {
+			for (int x=0; x<w; x++)
+				prod[x] = 0;
+			for (int x=p0; x<p1; x++)
+				prod[x] = il[y*w+x] * ir[y*w+x-d];
+
+			run = 0;
+			for (int x=0; x<WIN_W/2-1 && x<w; x++)
+				run += prod[x];
+			for (int x=0; x<w; x++) {
+				if (x+WIN_W/2-1 < w)
+					run += prod[x+WIN_W/2-1];
+				if (x-WIN_W/2-1 >= 0)
+					run -= prod[x-WIN_W/2-1];
+				row_sum[y*w+x] = run;
+			}
+		}
+		free(prod);
+	}
+
+		/*
+		 * Column pass over [y-WIN_H/2, y+WIN_H/2), scoring as we go
+		 */
+#pragma omp parallel for schedule(runtime)
+		for (int xb=0; xb<w; xb+=COL_BLOCK) {
+			int xe = xb+COL_BLOCK > w ? w : xb+COL_BLOCK;
+			int x0, x1, y0, y1;
+			int n;
+			float zncc;
+
+			for (int x=xb; x<xe; x++)
+				col_sum[x] = 0;
+			for (int y=0; y<WIN_H/2-1 && y<h; y++)
+				for (int x=xb; x<xe; x++)
+					col_sum[x] += row_sum[y*w+x];
+
+			for (int i=0; i<h; i++) {
+				if (i+WIN_H/2-1 < h)
+					for (int x=xb; x<xe; x++)
+						col_sum[x] +=
+						   row_sum[(i+WIN_H/2-1)*w+x];
+				if (i-WIN_H/2-1 >= 0)
+					for (int x=xb; x<xe; x++)
+						col_sum[x] -=
+						   row_sum[(i-WIN_H/2-1)*w+x];
+
+				y0 = i-WIN_H/2 < 0 ? 0 : i-WIN_H/2;
+				y1 = i+WIN_H/2 > h ? h : i+WIN_H/2;
+
+				for (int j=xb; j<xe; j++) {
+					/* Same clipping as zncc_tile */
+					x0 = j-WIN_W/2;
+					if (x0 < p0) x0 = p0;
+					x1 = j+WIN_W/2;
+					if (x1 > p1) x1 = p1;
+					if (x0 >= x1)
+						continue;
+					n = (x1-x0) * (y1-y0);
+
+					zncc = zncc_score(
+					    box_sum(sat_l, w, x0, y0, x1, y1),
+					    box_sum(sat_r, w, x0-d, y0, x1-d,
+						    y1),
+					    box_sum(sat_l_sq, w, x0, y0, x1,
+						    y1),
+					    box_sum(sat_r_sq, w, x0-d, y0, x1-d,
+						    y1),
+					    col_sum[j], n);
+
+					if (zncc > best_score[i*w+j]) {
+						best_score[i*w+j] = zncc;
+						best_disp[i*w+j] = d;
+					}
+				}
+			}
+		}
+	}
 
+#pragma omp parallel for
+	for (int i=0; i<w*h; i++)
+		disp_map[i] = (unsigned char) abs(best_disp[i]);
+
+	free(sat_l);
+	free(sat_l_sq);
+	free(sat_r);
+	free(sat_r_sq);
+	free(row_sum);
+	free(col_sum);
+	free(best_score);
+	free(best_disp);
+}
+
+/* The volume engine is parallel inside each direction */
+void calc_zncc_volume_both(unsigned char* il, unsigned char* ir,
+		unsigned int w, unsigned int h, int disp_min, int disp_max,
+		unsigned char* disp_l2r, unsigned char* disp_r2l)
+{
+	calc_zncc_volume(il, ir, w, h, disp_min, disp_max, disp_l2r);
+	calc_zncc_volume(ir, il, w, h, -disp_max, -disp_min, disp_r2l);
 }
 
 
@@ -157,13 +716,35 @@ void normalize(unsigned char* res, unsigned int size)
 	}
 }
 
+/* Wall clock in ms */
+double now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
 
-int main(void)
+int main(int argc, char** argv)
 {
 	const char* inL = "imageL.png";
 	const char* inR = "imageR.png";
 	const char* out = "output.png";
 
+	/* pixel: calc_zncc_both, volume: calc_zncc_volume_both */
+	stereo_func stereo = calc_zncc_both;
+	int max_disp = MAX_DISP;
+	int max_isa = N_ISA-1;
+	double t;
+
+	/* Input shrink of --down and --filter, output size of --upscale */
+	int down = 1;
+	int down_filter = PNGDOWN_BOX;
+	int upscale = 0;
+	unsigned int full_w, full_h;
+	unsigned char* big;
+
 	unsigned err;
 	unsigned char* imageL=0;
 	unsigned char* imageR=0;
@@ -174,13 +755,71 @@ int main(void)
 	unsigned char* disp_r2l;
 	unsigned char* res;
 
-	/* Load images */
-	err = lodepng_decode_file(&imageL, &w, &h, inL, LCT_GREY, 8);
+	for (int i=1; i<argc; i++) {
+		if (strcmp(argv[i], "--mode=float") == 0) {
+			zncc_mode = ZNCC_FLOAT;
+		} else if (strcmp(argv[i], "--mode=int") == 0) {
+			zncc_mode = ZNCC_INT;
+		} else if (strcmp(argv[i], "--engine=pixel") == 0) {
+			stereo = calc_zncc_both;
+		} else if (strcmp(argv[i], "--engine=volume") == 0) {
+			stereo = calc_zncc_volume_both;
+#ifdef _OPENMP
+		} else if (strcmp(argv[i], "--schedule=static") == 0) {
+			omp_set_schedule(omp_sched_static, 0);
+		} else if (strcmp(argv[i], "--schedule=dynamic") == 0) {
+			omp_set_schedule(omp_sched_dynamic, 1);
+		} else if (strcmp(argv[i], "--schedule=guided") == 0) {
+			omp_set_schedule(omp_sched_guided, 1);
+#endif
+		} else if (strncmp(argv[i], "--disp=", 7) == 0) {
+			max_disp = atoi(argv[i]+7);
+			if (max_disp < 1) max_disp = 1;
+		} else if (strncmp(argv[i], "--left=", 7) == 0) {
+			inL = argv[i]+7;
+		} else if (strncmp(argv[i], "--right=", 8) == 0) {
+			inR = argv[i]+8;
+		} else if (strncmp(argv[i], "--out=", 6) == 0) {
+			out = argv[i]+6;
+		} else if (strncmp(argv[i], "--down=", 7) == 0) {
+			down = atoi(argv[i]+7);
+			if (down < 1) down = 1;
+			if (down > PNGDOWN_MAX_FACTOR)
+				down = PNGDOWN_MAX_FACTOR;
+		} else if (strcmp(argv[i], "--filter=box") == 0) {
+			down_filter = PNGDOWN_BOX;
+		} else if (strcmp(argv[i], "--filter=gauss") == 0) {
+			down_filter = PNGDOWN_GAUSS;
+		} else if (strcmp(argv[i], "--upscale") == 0) {
+			upscale = 1;
+		} else if (isa_option(argv[i], &max_isa)) {
+		} else {
+			printf("Usage: %s [--engine=pixel|volume] "
+				"[--mode=float|int] "
+				"[--schedule=static|dynamic|guided] "
+				"[--disp=N] [--left=PNG] [--right=PNG] "
+				"[--out=PNG] [--down=F] [--filter=box|gauss] "
+				"[--upscale] "
+				ISA_USAGE "\n",
+				argv[0]);
+			return 3;
+		}
+	}
+
+	/* --disp is in pixels of the full-size images */
+	max_disp = (max_disp + down-1) / down;
+	cross_window = cross_windows[cpu_dispatch(max_isa)];
+
+	/* Load images, shrunk by --down while they are decoded */
+	t = now_ms();
+	err = pngdown_decode_file(&imageL, &w, &h, &full_w, &full_h, inL,
+			down, down_filter);
 	if (err)
 		return 1;
 	temp = w*h;
 
-	err = lodepng_decode_file(&imageR, &w, &h, inR, LCT_GREY, 8);
+	err = pngdown_decode_file(&imageR, &w, &h, &full_w, &full_h, inR,
+			down, down_filter);
 	if (err)
 		return 1;
 	size = w*h;
@@ -190,17 +829,19 @@ int main(void)
 		return 2;
 	}
 
-	disp_l2r = calloc(size, sizeof(unsigned char));
-	disp_r2l = calloc(size, sizeof(unsigned char));
+	printf("Stage load: %0.3f ms\n", now_ms() - t);
+
+	disp_l2r = alloc_maps(w, h, &disp_r2l);
 
 	/* Calculate ZNCC */
-	printf("Calculating L2R\n");
-	calc_zncc(imageL, imageR, w, h, MIN_DISP, MAX_DISP, disp_l2r);
-	printf("Calculating R2L\n");
-	calc_zncc(imageR, imageL, w, h, -MAX_DISP, MIN_DISP, disp_r2l);
+	printf("Calculating L2R and R2L\n");
+	t = now_ms();
+	stereo(imageL, imageR, w, h, MIN_DISP, max_disp, disp_l2r, disp_r2l);
+	printf("Stage zncc: %0.3f ms\n", now_ms() - t);
 	res = calloc(size, sizeof(unsigned char));
 
 	printf("Post-processing...\n");
+	t = now_ms();
 
 	/* Cross checking */
 	cross_checking(disp_l2r, disp_r2l, size, res);
@@ -208,9 +849,19 @@ int main(void)
 	occlusion_filling(res, size);
 	/* Normalize */
 	normalize(res, size);
+	printf("Stage post: %0.3f ms\n", now_ms() - t);
 
 	printf("Done, creating the output image\n");
-	lodepng_encode_file(out, res, w, h, LCT_GREY, 8);
+	t = now_ms();
+	if (upscale) {
+		big = malloc(full_w*full_h);
+		pngdown_upscale(res, w, h, big, full_w, full_h);
+		lodepng_encode_file(out, big, full_w, full_h, LCT_GREY, 8);
+		free(big);
+	} else {
+		lodepng_encode_file(out, res, w, h, LCT_GREY, 8);
+	}
+	printf("Stage save: %0.3f ms\n", now_ms() - t);
 
 	free(imageL);
 	free(imageR);
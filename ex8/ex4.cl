@@ -1,13 +1,21 @@
+/* Pixels per work-item, picked by the host with -D, see --tune */
+#ifndef PPW
+#define PPW 1
+#endif
+
 __kernel void
 moving_avg(__global unsigned char* in, __global unsigned char* out,
 			unsigned int w, unsigned int h)
 {
-	int id = get_global_id(0);
+	int first = get_global_id(0) * PPW;
 	int i, j, temp;
 
-	if (id%w < 2 || id%w >=w-2 || id < 2*w || id > w*h-2*w) {
-		out[id] = in[id];
-	} else {
+	/* The global size is rounded up to whole work-groups */
+	for (int id=first; id<first+PPW && id<w*h; id++) {
+		if (id%w < 2 || id%w >=w-2 || id < 2*w || id > w*h-2*w) {
+			out[id] = in[id];
+			continue;
+		}
 		temp = 0;
 		for (i=-2; i<=2; i++) {
 			for (j=-2; j<=2; j++) {
@@ -18,3 +26,126 @@ moving_avg(__global unsigned char* in, __global unsigned char* out,
 	}
 }
 
+
+
+/*
+ * Box filter of any radius r, --engine=box: the (2r+1)x(2r+1) mean with
+ * the image edges repeated and exact rounding, (sum + n/2) / n. A row pass
+ * writes the horizontal sums to tmp, a column pass sums those and rounds.
+ * Every work-item slides a running sum over BOX_SEG pixels of one row or
+ * column, so a pixel costs one add and one subtract whatever r is.
+ */
+#ifndef BOX_SEG
+#define BOX_SEG 32
+#endif
+
+/* Global size ((w + BOX_SEG-1) / BOX_SEG) x h */
+__kernel void
+box_rows(__global unsigned char* in, __global unsigned int* tmp,
+			unsigned int w, unsigned int h, int r)
+{
+	const int x0 = get_global_id(0) * BOX_SEG;
+	const int y = get_global_id(1);
+	__global unsigned char* row = in + y*w;
+	unsigned int sum = 0;
+
+	if (x0 >= w || y >= h)
+		return;
+
+	for (int k=-r; k<=r; k++)
+		sum += row[clamp(x0+k, 0, (int)w-1)];
+	for (int x=x0; x<x0+BOX_SEG && x<w; x++) {
+		tmp[y*w+x] = sum;
+		sum += row[min(x+r+1, (int)w-1)] - row[max(x-r, 0)];
+	}
+}
+
+/* Global size w x ((h + BOX_SEG-1) / BOX_SEG), neighbours read neighbours */
+__kernel void
+box_cols(__global unsigned int* tmp, __global unsigned char* out,
+			unsigned int w, unsigned int h, int r)
+{
+	const int x = get_global_id(0);
+	const int y0 = get_global_id(1) * BOX_SEG;
+	const unsigned int n = (2*r+1) * (2*r+1);
+	unsigned int sum = 0;
+
+	if (x >= w || y0 >= h)
+		return;
+
+	for (int k=-r; k<=r; k++)
+		sum += tmp[clamp(y0+k, 0, (int)h-1)*w + x];
+	for (int y=y0; y<y0+BOX_SEG && y<h; y++) {
+		out[y*w+x] = (sum + n/2) / n;
+		sum += tmp[min(y+r+1, (int)h-1)*w + x] - tmp[max(y-r, 0)*w + x];
+	}
+}
+
+
+/*
+ * Convolutions of --conv, built for one radius with -DCONV_R so that the
+ * tap loops have constant bounds. The coefficients are __constant, the
+ * image edges are repeated and the result is rounded to nearest even and
+ * saturated, like conv_host() on the host. Global size w x h.
+ */
+#ifndef CONV_R
+#define CONV_R 1
+#endif
+#define CONV_K (2*CONV_R + 1)
+
+/* Any KxK matrix, coef is row-major */
+__kernel void
+conv2d(__global unsigned char* in, __global unsigned char* out,
+			unsigned int w, unsigned int h,
+			__constant float* coef, float bias)
+{
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	float acc = bias;
+	int yy;
+
+	if (x >= w || y >= h)
+		return;
+
+	for (int dy=-CONV_R; dy<=CONV_R; dy++) {
+		yy = clamp(y+dy, 0, (int)h-1);
+		for (int dx=-CONV_R; dx<=CONV_R; dx++)
+			acc += coef[(dy+CONV_R)*CONV_K + dx+CONV_R] *
+				in[yy*w + clamp(x+dx, 0, (int)w-1)];
+	}
+	out[y*w+x] = convert_uchar_sat_rte(acc);
+}
+
+/* First pass of a separable matrix, coef[i][j] = col[i] * row[j] */
+__kernel void
+conv_rows(__global unsigned char* in, __global float* tmp,
+			unsigned int w, unsigned int h, __constant float* row)
+{
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	float acc = 0;
+
+	if (x >= w || y >= h)
+		return;
+
+	for (int dx=-CONV_R; dx<=CONV_R; dx++)
+		acc += row[dx+CONV_R] * in[y*w + clamp(x+dx, 0, (int)w-1)];
+	tmp[y*w+x] = acc;
+}
+
+__kernel void
+conv_cols(__global float* tmp, __global unsigned char* out,
+			unsigned int w, unsigned int h,
+			__constant float* col, float bias)
+{
+	const int x = get_global_id(0);
+	const int y = get_global_id(1);
+	float acc = bias;
+
+	if (x >= w || y >= h)
+		return;
+
+	for (int dy=-CONV_R; dy<=CONV_R; dy++)
+		acc += col[dy+CONV_R] * tmp[clamp(y+dy, 0, (int)h-1)*w + x];
+	out[y*w+x] = convert_uchar_sat_rte(acc);
+}
@@ -1,6 +1,16 @@
 #include <stdio.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "lodepng.h"
+#include "../common/cl_buffer.h"
+#include "../common/cl_cache.h"
+#include "../common/tune.h"
+#include "../common/pngdown.h"
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
 #else
@@ -10,22 +20,235 @@
 
 #define PROGRAM "ex8.cl"
 #define F_ZNCC "calc_zncc"
+#define F_ZNCC_TILED "calc_zncc_tiled"
+#define F_ZNCC_BIDIR "calc_zncc_bidir"
+#define F_ZNCC_PRUNE "calc_zncc_prune"
+#define F_CENSUS "census"
+#define F_CALC_CENSUS "calc_census"
+#define F_CROSS_FILL "cross_fill_rows"
+#define F_FILL_CARRY "fill_carry"
+#define F_MINMAX "minmax"
+#define F_RESCALE "rescale"
+
+/* Census neighbourhood of --engine=census, as in ex8.cl */
+#ifndef CENSUS_W
+#define CENSUS_W 9
+#endif
+#ifndef CENSUS_H
+#define CENSUS_H 7
+#endif
+#define CENSUS_WORDS ((CENSUS_W*CENSUS_H-1 + 63) / 64)
 
+/* Work-group size of the min/max reduction, a power of two */
+#define POST_WG 256
+
+/* Defaults of --win, --threshold and --disp */
 #define WIN_W 18
 #define WIN_H 14
 #define WIN_SIZE WIN_W*WIN_H
 #define THRESHOLD 12
+#define MAX_DISP 64
+
+/* Built programs kept by get_program() */
+#define PROGRAM_CACHE 8
+
+/* File names of --stream=N, with the frame number filled in */
+#define STREAM_L "imageL_%d.png"
+#define STREAM_R "imageR_%d.png"
+#define STREAM_OUT "output_%d.png"
+/* Frames in flight in --stream */
+#define STREAM_SLOTS 3
+
+/* Work-group tile of calc_zncc_tiled, passed to the kernel build */
+#define TILE_W 16
+#define TILE_H 16
+
+/* Devices and sub-devices --multi runs on at most */
+#define MAX_DEVICES 16
+/* Rows each device computes to measure its throughput */
+#define CAL_ROWS 16
+
+/* --engine=hybrid: rows of the first tiles, and the time a tile should take */
+#define HYBRID_ROWS 4
+#define HYBRID_TARGET_MS 20.0
+
+/* Trace file variable, queues a trace follows and their track numbers */
+#define TRACE_ENV "ZNCC_TRACE"
+#define TRACE_QUEUES 32
+#define TRACE_RUN 100
+#define TRACE_WAIT 200
 
 
+struct band;
+struct frame;
+struct sat;
+struct config;
+
 void error(cl_int err, char* func_name);
 cl_device_id create_device(void);
-cl_program build_program(cl_context ctx, cl_device_id dev, const char* name);
-unsigned char* read_image(unsigned* width, unsigned* height, const char* name);
+cl_program get_program(cl_context ctx, cl_device_id dev, const char* name,
+	char* args);
+unsigned char* read_image(unsigned* width, unsigned* height,
+	unsigned* full_w, unsigned* full_h, const char* name);
+void write_image(const char* name, unsigned char* map, unsigned int w,
+	unsigned int h, unsigned int out_w, unsigned int out_h);
+double calc_zncc_bidir(cl_command_queue queue, cl_kernel kernel,
+	size_t* global_size, int disp_max);
+double census_buffers(cl_context ctx, cl_command_queue queue,
+	cl_program program, cl_mem* left, cl_mem* right, unsigned int w,
+	unsigned int h);
+double event_ms(cl_event event);
+void trace_open(void);
+void trace_close(void);
+void trace_write(const char* name, const char* cat, int tid, double ts,
+	double dur, const char* args);
+double trace_begin(void);
+void trace_span(const char* name, double start);
+void trace_sync(cl_command_queue queue, const char* label);
+void trace_event(const char* name, cl_event event);
+int decode_frame(struct frame* fr, int f, unsigned int w, unsigned int h,
+	double* ms);
+int run_stream(cl_context ctx, cl_device_id dev, cl_kernel kernel,
+	size_t* global_size, size_t* local_size, unsigned int w,
+	unsigned int h, int max_disp, int threshold, int frames);
+double post_process(cl_context ctx, cl_command_queue queue,
+	cl_program program, cl_mem l2r, cl_mem r2l, cl_mem out,
+	unsigned int w, unsigned int h);
+int find_devices(cl_device_id* devs, int max, int split);
+void enqueue_band(struct band* b, unsigned char* left, unsigned char* right,
+	unsigned int w, unsigned int h, int win_h, int max_disp,
+	unsigned char* l2r, unsigned char* r2l);
+double finish_band(struct band* b);
+int run_multi(unsigned char* left, unsigned char* right, unsigned int w,
+	unsigned int h, char* args, int win_h, int max_disp, int split,
+	unsigned char* l2r, unsigned char* r2l);
+void sat_create(unsigned char* img, unsigned int w, unsigned int h,
+	struct sat* sat);
+void sat_free(struct sat* sat);
+unsigned int box_sum(unsigned int* sat, unsigned int w, int x0, int y0,
+	int x1, int y1);
+float zncc_score(unsigned int sum_l, unsigned int sum_r, unsigned int sq_l,
+	unsigned int sq_r, unsigned int cross, int n, int p, int int_mode);
+void zncc_rows(unsigned char* il, unsigned char* ir, struct sat* sat_l,
+	struct sat* sat_r, unsigned int w, unsigned int h, int win_w,
+	int win_h, int disp_min, int disp_max, int int_mode, int row0,
+	int row1, unsigned char* disp_map);
+int run_hybrid(unsigned char* left, unsigned char* right, unsigned int w,
+	unsigned int h, char* args, int win_w, int win_h, int max_disp,
+	int int_mode, unsigned char* l2r, unsigned char* r2l);
+double run_zncc(cl_context ctx, cl_device_id dev, cl_command_queue queue,
+	const char* args, int tiled, struct config* conf, cl_mem left,
+	cl_mem right, cl_mem out, unsigned int w, unsigned int h,
+	int max_disp, int runs);
+void zncc_sizes(int tiled, struct config* conf, unsigned int w,
+	unsigned int h, size_t* global_size, size_t* local_size,
+	size_t** local);
+void zncc_set(void* arg, int i, char* conf, size_t size);
+double zncc_run(void* arg);
+void tune_zncc(cl_context ctx, cl_device_id dev, const char* args, int tiled,
+	unsigned char* left, unsigned char* right, unsigned int w,
+	unsigned int h, int max_disp, const char* key, struct config* best);
 void cross_checking(unsigned char* l2r, unsigned char* r2l, unsigned int size,
-	unsigned char* out);
+	int threshold, unsigned char* out);
 void occlusion_filling(unsigned char* res, unsigned int size);
 void normalize(unsigned char* res, unsigned int size);
 
+/* One built program per context, file and set of build options */
+struct program_cache {
+	cl_context ctx;
+	const char* name;
+	char args[256];
+	cl_program program;
+};
+
+struct program_cache programs[PROGRAM_CACHE];
+int programs_used = 0;
+
+/* Input shrink of --down and --filter, see read_image() */
+int down = 1;
+int down_filter = PNGDOWN_BOX;
+
+/* Clock of a traced queue, host ms minus device ms */
+struct trace_queue {
+	cl_command_queue queue;
+	double offset;
+};
+
+/* Open trace file, NULL when tracing is off, and the time it starts at */
+FILE* trace_file = NULL;
+double trace_start;
+struct trace_queue trace_queue[TRACE_QUEUES];
+int trace_queues = 0;
+
+/* One frame in flight in run_stream() */
+struct frame {
+	/* Decoded pair, kept as long as buff_left and buff_right wrap it */
+	unsigned char* left;
+	unsigned char* right;
+	/* Where map_output() reads the maps back to on discrete devices */
+	unsigned char* l2r;
+	unsigned char* r2l;
+	cl_mem buff_left;
+	cl_mem buff_right;
+	cl_mem buff_l2r;
+	cl_mem buff_r2l;
+	cl_event zncc[2];
+};
+
+/* One device of --multi and the rows it computes */
+struct band {
+	cl_device_id dev;
+	cl_context ctx;
+	cl_command_queue queue;
+	cl_program program;
+	cl_kernel kernel;
+	/* Rows per ms, measured */
+	double rate;
+	/* Rows computed, and rows uploaded with the window halo */
+	unsigned int row0;
+	unsigned int row1;
+	unsigned int in0;
+	unsigned int in1;
+	cl_mem buff_left;
+	cl_mem buff_right;
+	cl_mem buff_l2r;
+	cl_mem buff_r2l;
+	cl_event zncc[2];
+	cl_event readback[2];
+};
+
+/* Integral images of I and I^2 of one input */
+struct sat {
+	unsigned int* sum;
+	unsigned int* sq;
+};
+
+/*
+ * Launch of calc_zncc (local, rows x columns, 0 leaves it to the driver)
+ * and of calc_zncc_tiled (tile, which is also its local size)
+ */
+struct config {
+	size_t local[2];
+	int tile_w;
+	int tile_h;
+};
+
+/* What the tune_space callbacks of tune_zncc() work on */
+struct zncc_tune {
+	cl_context ctx;
+	cl_device_id dev;
+	cl_command_queue queue;
+	const char* args;
+	int tiled;
+	cl_mem buff_left;
+	cl_mem buff_right;
+	cl_mem buff_out;
+	unsigned int w;
+	unsigned int h;
+	int max_disp;
+	struct config conf;
+};
+
 
 void error(cl_int err, char* func_name)
 {
@@ -34,11 +257,11 @@ void error(cl_int err, char* func_name)
 }
 
 void cross_checking(unsigned char* l2r, unsigned char* r2l, unsigned int size,
-		unsigned char* out)
+		int threshold, unsigned char* out)
 {
 	int i;
 	for (i=0; i<size; i++) {
-		if (abs(l2r[i] - r2l[i]) > THRESHOLD)
+		if (abs(l2r[i] - r2l[i]) > threshold)
 			out[i] = 0;
 		else 
 			out[i] = l2r[i];
@@ -95,57 +318,51 @@ cl_device_id create_device(void)
 	return dev;
 }
 
-cl_program build_program(cl_context ctx, cl_device_id dev, const char* name)
+/*
+ * build_program() through an in-process cache, so a parameter set that was
+ * already compiled for the context is not compiled again. The caller owns
+ * a reference of its own and releases it as usual.
+ */
+cl_program get_program(cl_context ctx, cl_device_id dev, const char* name,
+	char* args)
 {
 	cl_program program;
-	FILE 	   *p_handle;
-	char 	   *p_buffer;
-	char 	   *p_log;
-	size_t 	   p_size;
-	size_t 	   log_size;
-	cl_int 	   err;
-
-	p_handle = fopen(name, "r");
-	if (p_handle == NULL) {
-		perror("Couldn't find the file");
-		exit(1);
-	}
-	fseek(p_handle, 0, SEEK_END);
-	p_size = ftell(p_handle);
-	rewind(p_handle);
-	p_buffer = (char*)malloc(p_size+1);
-	p_buffer[p_size] = '\0';
-	fread(p_buffer, sizeof(char), p_size, p_handle);
-	fclose(p_handle);
-
-	program = clCreateProgramWithSource(ctx, 1, (const char**)&p_buffer,
-			&p_size, &err);
-	if (err < 0) error(err, "clCreateProgramWithSource");
-	free(p_buffer);
-
-	err = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-	if (err < 0) {
-		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 0,
-				NULL, &log_size);
-		p_log = (char *) malloc(log_size+1);
-		p_log[log_size] = '\0';
-		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG,
-			log_size+1, p_log, NULL);
-		printf("%s\n", p_log);
-		free(p_log);
-		exit(1);
+
+	for (int i=0; i<programs_used; i++) {
+		if (programs[i].ctx == ctx &&
+		    strcmp(programs[i].name, name) == 0 &&
+		    strcmp(programs[i].args, args) == 0) {
+			clRetainProgram(programs[i].program);
+			return programs[i].program;
+		}
 	}
 
+	program = build_program(ctx, dev, name, args);
+	if (programs_used < PROGRAM_CACHE &&
+	    strlen(args) < sizeof(programs[0].args)) {
+		programs[programs_used].ctx = ctx;
+		programs[programs_used].name = name;
+		strcpy(programs[programs_used].args, args);
+		programs[programs_used].program = program;
+		clRetainProgram(program);
+		programs_used++;
+	}
 	return program;
 }
 
 
-unsigned char* read_image(unsigned* width, unsigned* height, const char* name)
+/*
+ * Grey image shrunk by --down, decoded and shrunk in one pass. full_w and
+ * full_h, unless NULL, get the size of the file.
+ */
+unsigned char* read_image(unsigned* width, unsigned* height,
+	unsigned* full_w, unsigned* full_h, const char* name)
 {
 	unsigned error;
 	unsigned char* image=0;
 
-	error = lodepng_decode_file(&image, width, height, name, LCT_GREY, 8);
+	error = pngdown_decode_file(&image, width, height, full_w, full_h,
+			name, down, down_filter);
 	if (error) {
 		printf("Error %u: %s\n", error, lodepng_error_text(error));
 		return NULL;
@@ -153,12 +370,1343 @@ unsigned char* read_image(unsigned* width, unsigned* height, const char* name)
 	return image;
 }
 
+/* map, resized to out_w x out_h for --upscale */
+void write_image(const char* name, unsigned char* map, unsigned int w,
+	unsigned int h, unsigned int out_w, unsigned int out_h)
+{
+	unsigned char* big;
+
+	if (out_w == w && out_h == h) {
+		lodepng_encode_file(name, map, w, h, LCT_GREY, 8);
+		return;
+	}
+	big = malloc((size_t)out_w * out_h);
+	pngdown_upscale(map, w, h, big, out_w, out_h);
+	lodepng_encode_file(name, big, out_w, out_h, LCT_GREY, 8);
+	free(big);
+}
+
+
+/*
+ * Chrome trace_event output, on when ZNCC_TRACE names a file. Host spans
+ * are on the track of their OpenMP thread. Every queue that went through
+ * trace_sync() has two tracks: commands from start to end, and commands
+ * waiting from queued to start with the submit time as an argument. Load
+ * the file in chrome://tracing or ui.perfetto.dev. All trace_*() calls
+ * return at once when tracing is off.
+ */
+void trace_open(void)
+{
+	const char* path = getenv(TRACE_ENV);
+
+	if (path == NULL || *path == '\0')
+		return;
+	trace_file = fopen(path, "w");
+	if (trace_file == NULL) {
+		perror(path);
+		return;
+	}
+	trace_start = now_ms();
+	fprintf(trace_file, "[\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+		"\"pid\": 0, \"tid\": 0, \"args\": {\"name\": \"host\"}}");
+	/* Also on the early returns of main() */
+	atexit(trace_close);
+}
+
+void trace_close(void)
+{
+	if (trace_file == NULL)
+		return;
+	fprintf(trace_file, "\n]\n");
+	fclose(trace_file);
+	trace_file = NULL;
+}
+
+/* One complete event, times in ms since trace_open() */
+void trace_write(const char* name, const char* cat, int tid, double ts,
+	double dur, const char* args)
+{
+#pragma omp critical(trace)
+	fprintf(trace_file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", "
+		"\"ph\": \"X\", \"pid\": 0, \"tid\": %d, \"ts\": %0.3f, "
+		"\"dur\": %0.3f%s}", name, cat, tid, ts*1000, dur*1000, args);
+}
+
+/* Start of a host span, 0 when tracing is off */
+double trace_begin(void)
+{
+	return trace_file == NULL ? 0 : now_ms();
+}
+
+/* Host span from start, a trace_begin() or now_ms(), to now */
+void trace_span(const char* name, double start)
+{
+	int tid = 0;
+
+	if (trace_file == NULL)
+		return;
+#ifdef _OPENMP
+	tid = omp_get_thread_num();
+#endif
+	trace_write(name, "host", tid, start - trace_start, now_ms() - start,
+			"");
+}
+
+/*
+ * Relates the device clock of queue to the host clock: a marker has ended
+ * by the time clFinish() returns, so device times are placed at most one
+ * finish latency early. Call it while queue is empty.
+ */
+void trace_sync(cl_command_queue queue, const char* label)
+{
+	struct trace_queue* tq;
+	cl_device_id dev;
+	cl_event marker;
+	cl_ulong end;
+	char dev_name[256] = "";
+	cl_int err;
+
+	if (trace_file == NULL || trace_queues == TRACE_QUEUES)
+		return;
+	err = clEnqueueMarkerWithWaitList(queue, 0, NULL, &marker);
+	if (err < 0) error(err, "clEnqueueMarkerWithWaitList (trace)");
+	clFinish(queue);
+	tq = &trace_queue[trace_queues];
+	tq->queue = queue;
+	tq->offset = now_ms() - trace_start;
+	err = clGetEventProfilingInfo(marker, CL_PROFILING_COMMAND_END,
+			sizeof(end), &end, NULL);
+	if (err < 0) error(err, "clGetEventProfilingInfo (trace)");
+	tq->offset -= end / 1000000.0;
+	clReleaseEvent(marker);
+
+	clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(dev), &dev, NULL);
+	clGetDeviceInfo(dev, CL_DEVICE_NAME, sizeof(dev_name), dev_name, NULL);
+	fprintf(trace_file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+		"\"pid\": 0, \"tid\": %d, \"args\": {\"name\": \"%s %d: %s\"}}"
+		",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, "
+		"\"tid\": %d, \"args\": {\"name\": \"%s %d: %s, waiting\"}}",
+		TRACE_RUN + trace_queues, label, trace_queues, dev_name,
+		TRACE_WAIT + trace_queues, label, trace_queues, dev_name);
+	trace_queues++;
+}
+
+/* A finished command of a queue that went through trace_sync() */
+void trace_event(const char* name, cl_event event)
+{
+	cl_command_queue queue;
+	cl_ulong t[4];
+	char args[64];
+	double offset;
+	int q;
+	cl_int err;
+
+	if (trace_file == NULL)
+		return;
+	clGetEventInfo(event, CL_EVENT_COMMAND_QUEUE, sizeof(queue), &queue,
+			NULL);
+	for (q=0; q<trace_queues && trace_queue[q].queue != queue; q++)
+		;
+	if (q == trace_queues)
+		return;
+	err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED,
+			sizeof(t[0]), &t[0], NULL);
+	err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT,
+			sizeof(t[1]), &t[1], NULL);
+	err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+			sizeof(t[2]), &t[2], NULL);
+	err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+			sizeof(t[3]), &t[3], NULL);
+	if (err < 0)
+		return;
+
+	offset = trace_queue[q].offset;
+	sprintf(args, ", \"args\": {\"submit_us\": %0.3f}",
+			(t[1] / 1000000.0 + offset) * 1000);
+	trace_write(name, "queued", TRACE_WAIT + q, t[0] / 1000000.0 + offset,
+			(t[2] - t[0]) / 1000000.0, args);
+	trace_write(name, "device", TRACE_RUN + q, t[2] / 1000000.0 + offset,
+			(t[3] - t[2]) / 1000000.0, "");
+}
+
+
+/*
+ * Runs calc_zncc_bidir once per disparity. Every launch updates the
+ * best_* buffers and maps of the one before, so they have to run in
+ * order, which the in-order queue already guarantees: all of them are
+ * enqueued up front and the host only waits for the last. Returns the
+ * summed kernel time in ms.
+ */
+double calc_zncc_bidir(cl_command_queue queue, cl_kernel kernel,
+		size_t* global_size, int disp_max)
+{
+	cl_event* events;
+	double total = 0;
+	cl_int err;
+
+	events = malloc((disp_max+1) * sizeof(cl_event));
+	for (int d=0; d<=disp_max; d++) {
+		/* The argument is captured at enqueue time */
+		err = clSetKernelArg(kernel, 4, sizeof(int), (void*)&d);
+		if (err < 0) error(err, "clSetKernelArg bidir");
+
+		err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL,
+				global_size, NULL, 0, NULL, &events[d]);
+		if (err < 0) error(err, "clEnqueueNDRangeKernel - bidir");
+	}
+	err = clWaitForEvents(1, &events[disp_max]);
+	if (err < 0) error(err, "clWaitForEvents bidir");
+
+	for (int d=0; d<=disp_max; d++) {
+		total += event_ms(events[d]);
+		trace_event("zncc bidir", events[d]);
+		clReleaseEvent(events[d]);
+	}
+	free(events);
+	return total;
+}
+
+
+/*
+ * --engine=census: replaces the image buffers left and right by their
+ * census descriptors, CENSUS_WORDS cl_ulongs per pixel, which is what
+ * calc_census reads. Returns the summed kernel time in ms.
+ */
+double census_buffers(cl_context ctx, cl_command_queue queue,
+	cl_program program, cl_mem* left, cl_mem* right, unsigned int w,
+	unsigned int h)
+{
+	cl_mem* images[2] = {left, right};
+	size_t global_size[2] = {h, w};
+	size_t size = (size_t)w * h * CENSUS_WORDS * sizeof(cl_ulong);
+	cl_kernel kernel;
+	cl_mem desc;
+	cl_event event;
+	double total = 0;
+	cl_int err;
+
+	kernel = clCreateKernel(program, F_CENSUS, &err);
+	if (err < 0) error(err, "clCreateKernel (census)");
+
+	for (int k=0; k<2; k++) {
+		desc = clCreateBuffer(ctx, CL_MEM_READ_WRITE, size, NULL,
+				&err);
+		if (err < 0) error(err, "clCreateBuffer (census)");
+
+		err = clSetKernelArg(kernel, 0, sizeof(cl_mem),
+				(void*)images[k]);
+		err |= clSetKernelArg(kernel, 1, sizeof(unsigned int),
+				(void*)&w);
+		err |= clSetKernelArg(kernel, 2, sizeof(unsigned int),
+				(void*)&h);
+		err |= clSetKernelArg(kernel, 3, sizeof(cl_mem),
+				(void*)&desc);
+		if (err < 0) error(err, "clSetKernelArg census");
+
+		err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL,
+				global_size, NULL, 0, NULL, &event);
+		if (err < 0) error(err, "clEnqueueNDRangeKernel - census");
+		clWaitForEvents(1, &event);
+		total += event_ms(event);
+		trace_event("census", event);
+		clReleaseEvent(event);
+
+		clReleaseMemObject(*images[k]);
+		*images[k] = desc;
+	}
+	clReleaseKernel(kernel);
+	return total;
+}
+
+/* Device time of a finished command in ms */
+double event_ms(cl_event event)
+{
+	cl_ulong start;
+	cl_ulong end;
+	cl_int err;
+
+	err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+			sizeof(start), &start, NULL);
+	err |= clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+			sizeof(end), &end, NULL);
+	if (err < 0) error(err, "clGetEventProfilingInfo");
+	return (end - start) / 1000000.0;
+}
+
+
+/*
+ * Decodes frame f of --stream into fr and adds the time to ms. Returns 1
+ * if either image is missing or not w x h.
+ */
+int decode_frame(struct frame* fr, int f, unsigned int w, unsigned int h,
+	double* ms)
+{
+	unsigned int fw, fh;
+	char name[FILENAME_MAX];
+	double t;
+
+	t = now_ms();
+	sprintf(name, STREAM_L, f);
+	fr->left = read_image(&fw, &fh, NULL, NULL, name);
+	if (fr->left == NULL || fw != w || fh != h) {
+		printf("Bad frame %s\n", name);
+		return 1;
+	}
+	sprintf(name, STREAM_R, f);
+	fr->right = read_image(&fw, &fh, NULL, NULL, name);
+	if (fr->right == NULL || fw != w || fh != h) {
+		printf("Bad frame %s\n", name);
+		return 1;
+	}
+	*ms += now_ms() - t;
+	trace_span("decode", t);
+	return 0;
+}
 
-int main(void)
+/*
+ * --stream: runs the L2R/R2L kernel over frames 0..frames-1 of STREAM_L and
+ * STREAM_R and writes STREAM_OUT. The context, kernel and buffers live for
+ * the whole run. The buffers come from input_buffer() and
+ * output_buffer(), so on devices that share memory with the host the
+ * decoded frames are used in place and the maps are mapped instead of
+ * read back. While frame N is on the device, an OpenMP task decodes frame
+ * N+1 on a second thread and this one post-processes and encodes frame
+ * N-1. Each of the STREAM_SLOTS slots has its own buffers. A slot is only
+ * decoded into again after the host has waited for its kernels and given
+ * back its maps.
+ */
+int run_stream(cl_context ctx, cl_device_id dev, cl_kernel kernel,
+	size_t* global_size, size_t* local_size, unsigned int w,
+	unsigned int h, int max_disp, int threshold, int frames)
+{
+	struct frame slots[STREAM_SLOTS];
+	struct frame* fr;
+	struct frame* next;
+	cl_command_queue q_run;
+	cl_command_queue q_down;
+	unsigned char* res;
+	unsigned char* l2r;
+	unsigned char* r2l;
+	int unified = host_unified(dev);
+	unsigned int size = w*h;
+	int min_disp = 0;
+	int r2l_min = -max_disp;
+	int bad = 0;
+	char name[FILENAME_MAX];
+	/* decode, upload, ZNCC, readback, post-process + encode */
+	double stage[5] = {0, 0, 0, 0, 0};
+	double start;
+	double t;
+	cl_int err;
+
+	q_run = clCreateCommandQueue(ctx, dev, CL_QUEUE_PROFILING_ENABLE, &err);
+	if (err < 0) error(err, "clCreateCommandQueue (zncc)");
+	q_down = clCreateCommandQueue(ctx, dev, CL_QUEUE_PROFILING_ENABLE,
+			&err);
+	if (err < 0) error(err, "clCreateCommandQueue (readback)");
+	trace_sync(q_run, "zncc");
+	trace_sync(q_down, "readback");
+
+	for (int i=0; i<STREAM_SLOTS; i++) {
+		fr = &slots[i];
+		fr->left = NULL;
+		fr->right = NULL;
+		fr->l2r = malloc(size);
+		fr->r2l = malloc(size);
+		fr->buff_left = NULL;
+		fr->buff_right = NULL;
+		fr->buff_l2r = output_buffer(ctx, unified, size);
+		fr->buff_r2l = output_buffer(ctx, unified, size);
+	}
+	res = malloc(size);
+
+	start = now_ms();
+	bad = decode_frame(&slots[0], 0, w, h, &stage[0]);
+#pragma omp parallel num_threads(2) if(!bad)
+#pragma omp single
+	for (int f=0; !bad && f<=frames; f++) {
+		if (f < frames) {
+			/*
+			 * Queue the whole device side of frame f
+			 */
+			fr = &slots[f % STREAM_SLOTS];
+
+			/* Wrapped in place, or copied on discrete devices */
+			t = now_ms();
+			fr->buff_left = input_buffer(ctx, unified, fr->left,
+					size);
+			fr->buff_right = input_buffer(ctx, unified, fr->right,
+					size);
+			stage[1] += now_ms() - t;
+			trace_span("upload", t);
+
+			/* The arguments are captured at enqueue time */
+			err = clSetKernelArg(kernel, 0, sizeof(cl_mem),
+					(void*)&fr->buff_left);
+			err |= clSetKernelArg(kernel, 1, sizeof(cl_mem),
+					(void*)&fr->buff_right);
+			err |= clSetKernelArg(kernel, 2, sizeof(unsigned int),
+					(void*)&w);
+			err |= clSetKernelArg(kernel, 3, sizeof(unsigned int),
+					(void*)&h);
+			err |= clSetKernelArg(kernel, 4, sizeof(int),
+					(void*)&min_disp);
+			err |= clSetKernelArg(kernel, 5, sizeof(int),
+					(void*)&max_disp);
+			err |= clSetKernelArg(kernel, 6, sizeof(cl_mem),
+					(void*)&fr->buff_l2r);
+			if (err < 0) error(err, "clSetKernelArg (stream L2R)");
+			err = clEnqueueNDRangeKernel(q_run, kernel, 2, NULL,
+					global_size, local_size, 0, NULL,
+					&fr->zncc[0]);
+			if (err < 0) error(err, "clEnqueueNDRangeKernel L2R");
+
+			err = clSetKernelArg(kernel, 0, sizeof(cl_mem),
+					(void*)&fr->buff_right);
+			err |= clSetKernelArg(kernel, 1, sizeof(cl_mem),
+					(void*)&fr->buff_left);
+			err |= clSetKernelArg(kernel, 4, sizeof(int),
+					(void*)&r2l_min);
+			err |= clSetKernelArg(kernel, 5, sizeof(int),
+					(void*)&min_disp);
+			err |= clSetKernelArg(kernel, 6, sizeof(cl_mem),
+					(void*)&fr->buff_r2l);
+			if (err < 0) error(err, "clSetKernelArg (stream R2L)");
+			err = clEnqueueNDRangeKernel(q_run, kernel, 2, NULL,
+					global_size, local_size, 0, NULL,
+					&fr->zncc[1]);
+			if (err < 0) error(err, "clEnqueueNDRangeKernel R2L");
+			clFlush(q_run);
+		}
+
+		/*
+		 * Decode frame f+1 on the other thread. Its slot last held
+		 * frame f+1-STREAM_SLOTS, finished two iterations ago.
+		 */
+		if (f+1 < frames) {
+			next = &slots[(f+1) % STREAM_SLOTS];
+			if (next->buff_left != NULL) {
+				clReleaseMemObject(next->buff_left);
+				clReleaseMemObject(next->buff_right);
+			}
+			free(next->left);
+			free(next->right);
+			next->buff_left = NULL;
+			next->buff_right = NULL;
+			next->left = NULL;
+			next->right = NULL;
+#pragma omp task firstprivate(next, f)
+			bad = decode_frame(next, f+1, w, h, &stage[0]);
+		}
+
+		/*
+		 * Finish frame f-1 while frame f is on the device
+		 */
+		if (f > 0) {
+			fr = &slots[(f-1) % STREAM_SLOTS];
+			clWaitForEvents(2, fr->zncc);
+			for (int k=0; k<2; k++) {
+				stage[2] += event_ms(fr->zncc[k]);
+				trace_event(k ? "zncc R2L" : "zncc L2R",
+						fr->zncc[k]);
+				clReleaseEvent(fr->zncc[k]);
+			}
+
+			t = now_ms();
+			l2r = map_output(q_down, unified, fr->buff_l2r, size,
+					fr->l2r);
+			r2l = map_output(q_down, unified, fr->buff_r2l, size,
+					fr->r2l);
+			stage[3] += now_ms() - t;
+			trace_span("readback", t);
+
+			t = now_ms();
+			cross_checking(l2r, r2l, size, threshold, res);
+			unmap_output(q_down, unified, fr->buff_l2r, l2r);
+			unmap_output(q_down, unified, fr->buff_r2l, r2l);
+			occlusion_filling(res, size);
+			normalize(res, size);
+			sprintf(name, STREAM_OUT, f-1);
+			lodepng_encode_file(name, res, w, h, LCT_GREY, 8);
+			stage[4] += now_ms() - t;
+			trace_span("post + encode", t);
+		}
+#pragma omp taskwait
+	}
+	t = now_ms() - start;
+	/* A bad frame stops the run with the frame before it in flight */
+	clFinish(q_run);
+
+	if (!bad) {
+		printf("%d frames in %0.3f ms: %0.2f fps\n", frames, t,
+				frames * 1000.0 / t);
+		printf("Per frame: decode %0.3f ms, upload %0.3f ms, "
+			"ZNCC %0.3f ms, readback %0.3f ms, post %0.3f ms\n",
+			stage[0] / frames, stage[1] / frames,
+			stage[2] / frames, stage[3] / frames,
+			stage[4] / frames);
+	}
+
+	for (int i=0; i<STREAM_SLOTS; i++) {
+		fr = &slots[i];
+		if (fr->buff_left != NULL) {
+			clReleaseMemObject(fr->buff_left);
+			clReleaseMemObject(fr->buff_right);
+		}
+		clReleaseMemObject(fr->buff_l2r);
+		clReleaseMemObject(fr->buff_r2l);
+		free(fr->left);
+		free(fr->right);
+		free(fr->l2r);
+		free(fr->r2l);
+	}
+	free(res);
+	clReleaseCommandQueue(q_run);
+	clReleaseCommandQueue(q_down);
+	return bad;
+}
+
+
+/*
+ * cross_checking(), occlusion_filling() and normalize() as kernels of
+ * ex8.cl. l2r and r2l never leave the device and the final map is written
+ * to out. Returns the summed kernel time in ms.
+ */
+double post_process(cl_context ctx, cl_command_queue queue,
+	cl_program program, cl_mem l2r, cl_mem r2l, cl_mem out,
+	unsigned int w, unsigned int h)
+{
+	cl_kernel cross_fill;
+	cl_kernel fill_carry;
+	cl_kernel minmax;
+	cl_kernel rescale;
+	cl_mem buff_row_last;
+	cl_mem buff_range;
+	cl_event events[4];
+	int range[2] = {255, 0};
+	size_t global_size;
+	size_t local_size = POST_WG;
+	size_t max_local;
+	double total = 0;
+	cl_device_id dev;
+	cl_int err;
+
+	err = clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(dev), &dev,
+			NULL);
+	if (err < 0) error(err, "clGetCommandQueueInfo");
+
+	cross_fill = clCreateKernel(program, F_CROSS_FILL, &err);
+	if (err < 0) error(err, "clCreateKernel (cross_fill_rows)");
+	fill_carry = clCreateKernel(program, F_FILL_CARRY, &err);
+	if (err < 0) error(err, "clCreateKernel (fill_carry)");
+	minmax = clCreateKernel(program, F_MINMAX, &err);
+	if (err < 0) error(err, "clCreateKernel (minmax)");
+	rescale = clCreateKernel(program, F_RESCALE, &err);
+	if (err < 0) error(err, "clCreateKernel (rescale)");
+
+	buff_row_last = clCreateBuffer(ctx, CL_MEM_READ_WRITE, h, NULL, &err);
+	if (err < 0) error(err, "clCreateBuffer (buff_row_last)");
+	buff_range = clCreateBuffer(ctx, CL_MEM_READ_WRITE |
+			CL_MEM_COPY_HOST_PTR, sizeof(range), range, &err);
+	if (err < 0) error(err, "clCreateBuffer (buff_range)");
+
+	/* Cross-check and fill every row */
+	err = clSetKernelArg(cross_fill, 0, sizeof(cl_mem), (void*)&l2r);
+	err |= clSetKernelArg(cross_fill, 1, sizeof(cl_mem), (void*)&r2l);
+	err |= clSetKernelArg(cross_fill, 2, sizeof(unsigned int), (void*)&w);
+	err |= clSetKernelArg(cross_fill, 3, sizeof(unsigned int), (void*)&h);
+	err |= clSetKernelArg(cross_fill, 4, sizeof(cl_mem), (void*)&out);
+	err |= clSetKernelArg(cross_fill, 5, sizeof(cl_mem),
+			(void*)&buff_row_last);
+	if (err < 0) error(err, "clSetKernelArg cross_fill_rows");
+	global_size = h;
+	err = clEnqueueNDRangeKernel(queue, cross_fill, 1, NULL, &global_size,
+			NULL, 0, NULL, &events[0]);
+	if (err < 0) error(err, "clEnqueueNDRangeKernel - cross_fill_rows");
+
+	/* Leading zeros of the rows */
+	err = clSetKernelArg(fill_carry, 0, sizeof(cl_mem), (void*)&out);
+	err |= clSetKernelArg(fill_carry, 1, sizeof(unsigned int), (void*)&w);
+	err |= clSetKernelArg(fill_carry, 2, sizeof(unsigned int), (void*)&h);
+	err |= clSetKernelArg(fill_carry, 3, sizeof(cl_mem),
+			(void*)&buff_row_last);
+	if (err < 0) error(err, "clSetKernelArg fill_carry");
+	err = clEnqueueNDRangeKernel(queue, fill_carry, 1, NULL, &global_size,
+			NULL, 0, NULL, &events[1]);
+	if (err < 0) error(err, "clEnqueueNDRangeKernel - fill_carry");
+
+	/*
+	 * Min and max, then the rescale to 0..255. The reduction halves the
+	 * group, so its size stays a power of two the device takes.
+	 */
+	err = clGetKernelWorkGroupInfo(minmax, dev, CL_KERNEL_WORK_GROUP_SIZE,
+			sizeof(max_local), &max_local, NULL);
+	if (err < 0) error(err, "clGetKernelWorkGroupInfo minmax");
+	while (local_size > 1 && local_size > max_local)
+		local_size /= 2;
+	err = clSetKernelArg(minmax, 0, sizeof(cl_mem), (void*)&out);
+	err |= clSetKernelArg(minmax, 1, sizeof(unsigned int), (void*)&w);
+	err |= clSetKernelArg(minmax, 2, sizeof(unsigned int), (void*)&h);
+	err |= clSetKernelArg(minmax, 3, local_size, NULL);
+	err |= clSetKernelArg(minmax, 4, local_size, NULL);
+	err |= clSetKernelArg(minmax, 5, sizeof(cl_mem), (void*)&buff_range);
+	if (err < 0) error(err, "clSetKernelArg minmax");
+	global_size = ((size_t)w*h + local_size-1) / local_size * local_size;
+	err = clEnqueueNDRangeKernel(queue, minmax, 1, NULL, &global_size,
+			&local_size, 0, NULL, &events[2]);
+	if (err < 0) error(err, "clEnqueueNDRangeKernel - minmax");
+
+	err = clSetKernelArg(rescale, 0, sizeof(cl_mem), (void*)&out);
+	err |= clSetKernelArg(rescale, 1, sizeof(unsigned int), (void*)&w);
+	err |= clSetKernelArg(rescale, 2, sizeof(unsigned int), (void*)&h);
+	err |= clSetKernelArg(rescale, 3, sizeof(cl_mem), (void*)&buff_range);
+	if (err < 0) error(err, "clSetKernelArg rescale");
+	err = clEnqueueNDRangeKernel(queue, rescale, 1, NULL, &global_size,
+			NULL, 0, NULL, &events[3]);
+	if (err < 0) error(err, "clEnqueueNDRangeKernel - rescale");
+	clFinish(queue);
+
+	trace_event(F_CROSS_FILL, events[0]);
+	trace_event(F_FILL_CARRY, events[1]);
+	trace_event(F_MINMAX, events[2]);
+	trace_event(F_RESCALE, events[3]);
+	for (int i=0; i<4; i++) {
+		total += event_ms(events[i]);
+		clReleaseEvent(events[i]);
+	}
+
+	clReleaseMemObject(buff_row_last);
+	clReleaseMemObject(buff_range);
+	clReleaseKernel(cross_fill);
+	clReleaseKernel(fill_carry);
+	clReleaseKernel(minmax);
+	clReleaseKernel(rescale);
+	return total;
+}
+
+/*
+ * Builds calc_zncc or calc_zncc_tiled for conf on top of the build
+ * options args and runs L2R runs times into out. Returns the fastest run
+ * in ms, or -1 if the device does not take the launch.
+ */
+double run_zncc(cl_context ctx, cl_device_id dev, cl_command_queue queue,
+	const char* args, int tiled, struct config* conf, cl_mem left,
+	cl_mem right, cl_mem out, unsigned int w, unsigned int h,
+	int max_disp, int runs)
+{
+	cl_program program;
+	cl_kernel kernel;
+	cl_event event;
+	size_t global_size[2];
+	size_t local_size[2];
+	size_t* local = NULL;
+	int min_disp = 0;
+	double best = -1;
+	double ms;
+	char all_args[512];
+	cl_int err;
+
+	snprintf(all_args, sizeof(all_args), "%s -DTILE_W=%d -DTILE_H=%d",
+			args, conf->tile_w, conf->tile_h);
+	program = get_program(ctx, dev, PROGRAM, all_args);
+	kernel = clCreateKernel(program, tiled ? F_ZNCC_TILED : F_ZNCC, &err);
+	if (err < 0) error(err, "clCreateKernel");
+
+	err = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&left);
+	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void*)&right);
+	err |= clSetKernelArg(kernel, 2, sizeof(unsigned int), (void*)&w);
+	err |= clSetKernelArg(kernel, 3, sizeof(unsigned int), (void*)&h);
+	err |= clSetKernelArg(kernel, 4, sizeof(int), (void*)&min_disp);
+	err |= clSetKernelArg(kernel, 5, sizeof(int), (void*)&max_disp);
+	err |= clSetKernelArg(kernel, 6, sizeof(cl_mem), (void*)&out);
+	if (err < 0) error(err, "clSetKernelArg (tune)");
+
+	zncc_sizes(tiled, conf, w, h, global_size, local_size, &local);
+	for (int r=0; r<runs; r++) {
+		err = clEnqueueNDRangeKernel(queue, kernel, 2, NULL,
+				global_size, local, 0, NULL, &event);
+		if (err < 0)
+			break;
+		clWaitForEvents(1, &event);
+		ms = event_ms(event);
+		clReleaseEvent(event);
+		if (best < 0 || ms < best)
+			best = ms;
+	}
+
+	clReleaseKernel(kernel);
+	clReleaseProgram(program);
+	return best;
+}
+
+/*
+ * Global and local size of calc_zncc or calc_zncc_tiled for conf. The
+ * tiled kernel needs whole tiles and a naive launch with a local size
+ * needs whole work-groups; the extra work-items return early.
+ */
+void zncc_sizes(int tiled, struct config* conf, unsigned int w,
+	unsigned int h, size_t* global_size, size_t* local_size,
+	size_t** local)
+{
+	if (tiled) {
+		local_size[0] = conf->tile_h;
+		local_size[1] = conf->tile_w;
+	} else {
+		local_size[0] = conf->local[0];
+		local_size[1] = conf->local[1];
+	}
+	if (local_size[0] == 0 || local_size[1] == 0) {
+		global_size[0] = h;
+		global_size[1] = w;
+		*local = NULL;
+		return;
+	}
+	global_size[0] = (h+local_size[0]-1) / local_size[0] * local_size[0];
+	global_size[1] = (w+local_size[1]-1) / local_size[1] * local_size[1];
+	*local = local_size;
+}
+
+/* Sweep of tune_zncc(): local sizes, rows x columns, or tiles, w x h */
+const size_t tune_locals[][2] = {{0, 0}, {8, 8}, {4, 16}, {8, 16},
+	{16, 16}, {4, 32}, {8, 32}, {2, 64}};
+const int tune_tiles[][2] = {{8, 8}, {16, 8}, {8, 16}, {16, 16}, {32, 8},
+	{32, 16}, {32, 32}};
+
+void zncc_set(void* arg, int i, char* conf, size_t size)
+{
+	struct zncc_tune* t = arg;
+
+	if (t->tiled) {
+		t->conf.tile_w = tune_tiles[i][0];
+		t->conf.tile_h = tune_tiles[i][1];
+	} else {
+		t->conf.local[0] = tune_locals[i][0];
+		t->conf.local[1] = tune_locals[i][1];
+	}
+	snprintf(conf, size, "local=%zux%zu tile=%dx%d", t->conf.local[0],
+			t->conf.local[1], t->conf.tile_w, t->conf.tile_h);
+}
+
+double zncc_run(void* arg)
+{
+	struct zncc_tune* t = arg;
+
+	return run_zncc(t->ctx, t->dev, t->queue, t->args, t->tiled, &t->conf,
+			t->buff_left, t->buff_right, t->buff_out, t->w, t->h,
+			t->max_disp, TUNE_RUNS);
+}
+
+/*
+ * --tune: local sizes of calc_zncc or tile sizes of calc_zncc_tiled, on
+ * the L2R pass. The first configuration that runs gives the reference
+ * map, the others have to match it.
+ */
+void tune_zncc(cl_context ctx, cl_device_id dev, const char* args, int tiled,
+	unsigned char* left, unsigned char* right, unsigned int w,
+	unsigned int h, int max_disp, const char* key, struct config* best)
+{
+	struct zncc_tune t = {ctx, dev, NULL, args, tiled, NULL, NULL, NULL,
+		w, h, max_disp, *best};
+	struct tune_space space = {
+		tiled ? sizeof(tune_tiles)/sizeof(tune_tiles[0]) :
+			sizeof(tune_locals)/sizeof(tune_locals[0]),
+		zncc_set, zncc_run, &t
+	};
+	size_t size = w*h;
+	cl_int err;
+
+	t.queue = clCreateCommandQueue(ctx, dev, CL_QUEUE_PROFILING_ENABLE,
+			&err);
+	if (err < 0) error(err, "clCreateCommandQueue (tune)");
+	t.buff_left = input_buffer(ctx, 0, left, size);
+	t.buff_right = input_buffer(ctx, 0, right, size);
+	t.buff_out = output_buffer(ctx, 0, size);
+
+	if (tune_sweep(t.queue, t.buff_out, size, NULL, key, &space) >= 0)
+		*best = t.conf;
+
+	clReleaseMemObject(t.buff_left);
+	clReleaseMemObject(t.buff_right);
+	clReleaseMemObject(t.buff_out);
+	clReleaseCommandQueue(t.queue);
+}
+
+
+/*
+ * All devices of all platforms, at most max. With split > 1 every CPU
+ * device is replaced by split sub-devices of equal compute units, so that
+ * each of them gets a band and a queue of its own.
+ */
+int find_devices(cl_device_id* devs, int max, int split)
+{
+	cl_platform_id plats[MAX_DEVICES];
+	cl_device_id found[MAX_DEVICES];
+	cl_device_id sub[MAX_DEVICES];
+	cl_device_partition_property props[3];
+	cl_device_type type;
+	cl_uint units;
+	cl_uint num_plats;
+	cl_uint num_found;
+	cl_uint num_sub;
+	char name[128];
+	int n = 0;
+	cl_int err;
+
+	err = clGetPlatformIDs(MAX_DEVICES, plats, &num_plats);
+	if (err < 0) error(err, "clGetPlatformIDs");
+
+	for (int p=0; p<num_plats && p<MAX_DEVICES; p++) {
+		err = clGetDeviceIDs(plats[p], CL_DEVICE_TYPE_ALL, MAX_DEVICES,
+				found, &num_found);
+		if (err == CL_DEVICE_NOT_FOUND)
+			continue;
+		if (err < 0) error(err, "clGetDeviceIDs");
+
+		for (int i=0; i<num_found && i<MAX_DEVICES && n<max; i++) {
+			clGetDeviceInfo(found[i], CL_DEVICE_TYPE, sizeof(type),
+					&type, NULL);
+			clGetDeviceInfo(found[i], CL_DEVICE_MAX_COMPUTE_UNITS,
+					sizeof(units), &units, NULL);
+			num_sub = 0;
+			if (split > 1 && (type & CL_DEVICE_TYPE_CPU) &&
+			    units >= split) {
+				props[0] = CL_DEVICE_PARTITION_EQUALLY;
+				props[1] = units / split;
+				props[2] = 0;
+				err = clCreateSubDevices(found[i], props,
+						MAX_DEVICES, sub, &num_sub);
+				if (err < 0)
+					num_sub = 0;
+			}
+			if (num_sub == 0) {
+				sub[0] = found[i];
+				num_sub = 1;
+			}
+
+			clGetDeviceInfo(found[i], CL_DEVICE_NAME, sizeof(name),
+					name, NULL);
+			for (int k=0; k<num_sub; k++) {
+				if (n < max) {
+					printf("Device %d: %s%s\n", n, name,
+						sub[k] != found[i] ?
+						" (sub-device)" : "");
+					devs[n++] = sub[k];
+				} else {
+					clReleaseDevice(sub[k]);
+				}
+			}
+		}
+	}
+	return n;
+}
+
+/*
+ * Queues L2R and R2L for rows row0..row1 of b and the readback of those
+ * rows into l2r and r2l. Only rows in0..in1 are uploaded: the window
+ * reaches WIN_H/2 rows past the band, and the kernel clips it at the band
+ * edges exactly like it does at the image edges, so the halo gives the
+ * same result as the whole image. The kernel runs with a global offset and
+ * keeps indexing the uploaded rows from 0.
+ */
+void enqueue_band(struct band* b, unsigned char* left, unsigned char* right,
+	unsigned int w, unsigned int h, int win_h, int max_disp,
+	unsigned char* l2r, unsigned char* r2l)
+{
+	unsigned int band_h;
+	size_t in_size;
+	size_t offset[2];
+	size_t global_size[2];
+	int min_disp = 0;
+	int r2l_min = -max_disp;
+	int unified;
+	cl_int err;
+
+	if (b->row1 <= b->row0)
+		return;
+	b->in0 = b->row0 > win_h/2 ? b->row0 - win_h/2 : 0;
+	b->in1 = b->row1 + win_h/2 < h ? b->row1 + win_h/2 : h;
+	band_h = b->in1 - b->in0;
+	in_size = (size_t)band_h * w;
+
+	unified = host_unified(b->dev);
+	b->buff_left = input_buffer(b->ctx, unified, left + b->in0*w, in_size);
+	b->buff_right = input_buffer(b->ctx, unified, right + b->in0*w,
+			in_size);
+	b->buff_l2r = output_buffer(b->ctx, 0, in_size);
+	b->buff_r2l = output_buffer(b->ctx, 0, in_size);
+
+	offset[0] = b->row0 - b->in0;
+	offset[1] = 0;
+	global_size[0] = b->row1 - b->row0;
+	global_size[1] = w;
+
+	err = clSetKernelArg(b->kernel, 0, sizeof(cl_mem),
+			(void*)&b->buff_left);
+	err |= clSetKernelArg(b->kernel, 1, sizeof(cl_mem),
+			(void*)&b->buff_right);
+	err |= clSetKernelArg(b->kernel, 2, sizeof(unsigned int), (void*)&w);
+	err |= clSetKernelArg(b->kernel, 3, sizeof(unsigned int),
+			(void*)&band_h);
+	err |= clSetKernelArg(b->kernel, 4, sizeof(int), (void*)&min_disp);
+	err |= clSetKernelArg(b->kernel, 5, sizeof(int), (void*)&max_disp);
+	err |= clSetKernelArg(b->kernel, 6, sizeof(cl_mem),
+			(void*)&b->buff_l2r);
+	if (err < 0) error(err, "clSetKernelArg (band L2R)");
+	err = clEnqueueNDRangeKernel(b->queue, b->kernel, 2, offset,
+			global_size, NULL, 0, NULL, &b->zncc[0]);
+	if (err < 0) error(err, "clEnqueueNDRangeKernel - band L2R");
+
+	err = clSetKernelArg(b->kernel, 0, sizeof(cl_mem),
+			(void*)&b->buff_right);
+	err |= clSetKernelArg(b->kernel, 1, sizeof(cl_mem),
+			(void*)&b->buff_left);
+	err |= clSetKernelArg(b->kernel, 4, sizeof(int), (void*)&r2l_min);
+	err |= clSetKernelArg(b->kernel, 5, sizeof(int), (void*)&min_disp);
+	err |= clSetKernelArg(b->kernel, 6, sizeof(cl_mem),
+			(void*)&b->buff_r2l);
+	if (err < 0) error(err, "clSetKernelArg (band R2L)");
+	err = clEnqueueNDRangeKernel(b->queue, b->kernel, 2, offset,
+			global_size, NULL, 0, NULL, &b->zncc[1]);
+	if (err < 0) error(err, "clEnqueueNDRangeKernel - band R2L");
+
+	err = clEnqueueReadBuffer(b->queue, b->buff_l2r, CL_FALSE,
+			offset[0]*w, global_size[0]*w, l2r + b->row0*w, 0,
+			NULL, &b->readback[0]);
+	err |= clEnqueueReadBuffer(b->queue, b->buff_r2l, CL_FALSE,
+			offset[0]*w, global_size[0]*w, r2l + b->row0*w, 0,
+			NULL, &b->readback[1]);
+	if (err < 0) error(err, "clEnqueueReadBuffer (band)");
+	clFlush(b->queue);
+}
+
+/* Waits for a band of enqueue_band(), returns its kernel time in ms */
+double finish_band(struct band* b)
+{
+	double total = 0;
+
+	if (b->row1 <= b->row0)
+		return 0;
+	clWaitForEvents(2, b->readback);
+	trace_event("band L2R", b->zncc[0]);
+	trace_event("band R2L", b->zncc[1]);
+	trace_event("readback L2R", b->readback[0]);
+	trace_event("readback R2L", b->readback[1]);
+	for (int k=0; k<2; k++) {
+		total += event_ms(b->zncc[k]);
+		clReleaseEvent(b->zncc[k]);
+		clReleaseEvent(b->readback[k]);
+	}
+	clReleaseMemObject(b->buff_left);
+	clReleaseMemObject(b->buff_right);
+	clReleaseMemObject(b->buff_l2r);
+	clReleaseMemObject(b->buff_r2l);
+	return total;
+}
+
+/*
+ * --multi: L2R and R2L of calc_zncc on every device of find_devices(),
+ * each in a context of its own. Every device first computes CAL_ROWS rows
+ * on its own to measure its rows per ms, then the image is cut into one
+ * band per device in proportion to those rates and all bands run at the
+ * same time. l2r and r2l get the stitched maps.
+ */
+int run_multi(unsigned char* left, unsigned char* right, unsigned int w,
+	unsigned int h, char* args, int win_h, int max_disp, int split,
+	unsigned char* l2r, unsigned char* r2l)
+{
+	cl_device_id devs[MAX_DEVICES];
+	struct band bands[MAX_DEVICES];
+	struct band* b;
+	unsigned int cal_rows = h < CAL_ROWS ? h : CAL_ROWS;
+	double rates = 0;
+	double cum = 0;
+	double t;
+	int n;
+	cl_int err;
+
+	n = find_devices(devs, MAX_DEVICES, split);
+	if (n == 0) {
+		printf("No OpenCL devices\n");
+		return 1;
+	}
+
+	for (int i=0; i<n; i++) {
+		b = &bands[i];
+		b->dev = devs[i];
+		b->ctx = clCreateContext(NULL, 1, &b->dev, NULL, NULL, &err);
+		if (err < 0) error(err, "clCreateContext");
+		b->queue = clCreateCommandQueue(b->ctx, b->dev,
+				CL_QUEUE_PROFILING_ENABLE, &err);
+		if (err < 0) error(err, "clCreateCommandQueue");
+		trace_sync(b->queue, "band");
+		b->program = get_program(b->ctx, b->dev, PROGRAM, args);
+		b->kernel = clCreateKernel(b->program, F_ZNCC, &err);
+		if (err < 0) error(err, "clCreateKernel");
+	}
+
+	/* Calibrate one device at a time on rows from the middle */
+	for (int i=0; i<n; i++) {
+		b = &bands[i];
+		b->row0 = (h - cal_rows) / 2;
+		b->row1 = b->row0 + cal_rows;
+		enqueue_band(b, left, right, w, h, win_h, max_disp, l2r, r2l);
+		t = finish_band(b);
+		b->rate = cal_rows / (t > 0 ? t : 1e-3);
+		rates += b->rate;
+	}
+
+	/* Rounding the running sum keeps the bands adjacent */
+	for (int i=0; i<n; i++) {
+		b = &bands[i];
+		b->row0 = (unsigned int)(h * cum / rates + 0.5);
+		cum += b->rate;
+		b->row1 = i == n-1 ? h : (unsigned int)(h * cum / rates + 0.5);
+	}
+
+	t = now_ms();
+	for (int i=0; i<n; i++)
+		enqueue_band(&bands[i], left, right, w, h, win_h, max_disp,
+				l2r, r2l);
+	for (int i=0; i<n; i++) {
+		b = &bands[i];
+		printf("Device %d: rows %u-%u, %0.3f ms\n", i, b->row0,
+				b->row1, finish_band(b));
+	}
+	printf("%d devices: %0.3f ms\n", n, now_ms() - t);
+	trace_span("bands", t);
+
+	for (int i=0; i<n; i++) {
+		b = &bands[i];
+		clReleaseKernel(b->kernel);
+		clReleaseProgram(b->program);
+		clReleaseCommandQueue(b->queue);
+		clReleaseDevice(b->dev);
+	}
+	for (int i=0; i<programs_used; i++)
+		clReleaseProgram(programs[i].program);
+	for (int i=0; i<n; i++)
+		clReleaseContext(bands[i].ctx);
+	return 0;
+}
+
+
+/*
+ * Summed-area tables of I and I^2 for zncc_rows(), (w+1)x(h+1) with a
+ * zero first row and column. They may wrap, a window sum is always below
+ * 2^32.
+ */
+void sat_create(unsigned char* img, unsigned int w, unsigned int h,
+	struct sat* sat)
+{
+	unsigned int px;
+
+	sat->sum = calloc((w+1)*(h+1), sizeof(unsigned int));
+	sat->sq = calloc((w+1)*(h+1), sizeof(unsigned int));
+	for (int y=1; y<=h; y++) {
+		for (int x=1; x<=w; x++) {
+			px = img[(y-1)*w+x-1];
+			sat->sum[y*(w+1)+x] = px + sat->sum[y*(w+1)+x-1]
+				+ sat->sum[(y-1)*(w+1)+x]
+				- sat->sum[(y-1)*(w+1)+x-1];
+			sat->sq[y*(w+1)+x] = px*px + sat->sq[y*(w+1)+x-1]
+				+ sat->sq[(y-1)*(w+1)+x]
+				- sat->sq[(y-1)*(w+1)+x-1];
+		}
+	}
+}
+
+void sat_free(struct sat* sat)
+{
+	free(sat->sum);
+	free(sat->sq);
+}
+
+/* Sum over the pixels x0 <= x < x1, y0 <= y < y1 */
+unsigned int box_sum(unsigned int* sat, unsigned int w, int x0, int y0,
+	int x1, int y1)
+{
+	return sat[y1*(w+1)+x1] - sat[y0*(w+1)+x1]
+	     - sat[y1*(w+1)+x0] + sat[y0*(w+1)+x0];
+}
+
+/*
+ * ZNCC of one window from its sums, p being the window size the means are
+ * taken over and n the taps inside the image. The int form is zncc_int()
+ * of ex8.cl and gives the same score bit for bit on a device with
+ * cl_khr_fp64. The float form is the one of ex7: it works in double on the
+ * expanded sums, while window_zncc() sums the centered pixels in float, so
+ * the two scores only agree to float rounding.
+ */
+float zncc_score(unsigned int sum_l, unsigned int sum_r, unsigned int sq_l,
+	unsigned int sq_r, unsigned int cross, int n, int p, int int_mode)
+{
+	double mean_l = (double)sum_l / p;
+	double mean_r = (double)sum_r / p;
+	long long p2 = (long long)p * p;
+	long long k = 2*p - n;
+
+	if (int_mode)
+		return (p2*cross - k*sum_l*sum_r) /
+			sqrt((double)(p2*sq_l - k*sum_l*sum_l) *
+			(p2*sq_r - k*sum_r*sum_r));
+	return (cross - (mean_r*sum_l + mean_l*sum_r) + n*(mean_l*mean_r)) /
+		sqrt((sq_l - 2*mean_l*sum_l + n*mean_l*mean_l) *
+		(sq_r - 2*mean_r*sum_r + n*mean_r*mean_r));
+}
+
+/*
+ * calc_zncc of ex8.cl on the host for rows row0..row1, the CPU side of
+ * --engine=hybrid. Window sums come from the summed-area tables and only
+ * the cross term is computed tap by tap. With --mode=int the rows are the
+ * ones the device would give. With --mode=float, see zncc_score(), a near
+ * tie can go the other way: at 318x218 with 207 of 218 rows on the host, 3
+ * output pixels (0.004%) differed from --engine=naive, by up to 8 levels.
+ */
+void zncc_rows(unsigned char* il, unsigned char* ir, struct sat* sat_l,
+	struct sat* sat_r, unsigned int w, unsigned int h, int win_w,
+	int win_h, int disp_min, int disp_max, int int_mode, int row0,
+	int row1, unsigned char* disp_map)
+{
+	for (int i=row0; i<row1; i++) {
+		/* Rows of the window that are inside the image */
+		int y0 = i-win_h/2 < 0 ? 0 : i-win_h/2;
+		int y1 = i+win_h/2 > h ? h : i+win_h/2;
+
+	for (int j=0; j<w; j++) {
+		float cur_max = -1;
+		int disp_best = disp_max;
+
+	for (int d=disp_min; d<=disp_max; d++) {
+		unsigned int cross = 0;
+		int x0, x1;
+		float zncc;
+
+		/* Taps with both x and x-d inside the image */
+		x0 = j-win_w/2;
+		if (x0 < 0) x0 = 0;
+		if (x0 < d) x0 = d;
+		x1 = j+win_w/2;
+		if (x1 > w) x1 = w;
+		if (x1 > (int)w+d) x1 = w+d;
+		if (x0 >= x1 || y0 >= y1)
+			continue;
+
+		for (int y=y0; y<y1; y++)
+			for (int x=x0; x<x1; x++)
+				cross += il[y*w+x] * ir[y*w+x-d];
+
+		zncc = zncc_score(box_sum(sat_l->sum, w, x0, y0, x1, y1),
+				box_sum(sat_r->sum, w, x0-d, y0, x1-d, y1),
+				box_sum(sat_l->sq, w, x0, y0, x1, y1),
+				box_sum(sat_r->sq, w, x0-d, y0, x1-d, y1),
+				cross, (x1-x0) * (y1-y0), win_w*win_h,
+				int_mode);
+		if (zncc > cur_max) {
+			cur_max = zncc;
+			disp_best = d;
+		}
+	}
+	disp_map[i*w+j] = (unsigned char) abs(disp_best);
+	}
+	}
+}
+
+/*
+ * --engine=hybrid: OpenMP threads and an OpenCL queue share one job. The
+ * rows of the image are the queue: the CPU threads take tiles of rows
+ * from the top and the OpenCL feeder takes bands from the bottom, so
+ * whichever side is faster simply takes over rows the other one would
+ * have got, and both run until they meet. A tile is L2R and R2L of its
+ * rows.
+ *
+ * Every tile is timed and each side keeps its rows per ms. A tile is
+ * sized to take HYBRID_TARGET_MS, but never more than its side's share of
+ * what is left, so the last tiles get smaller and the two sides finish
+ * together. The feeder keeps two bands in flight so the device does not
+ * wait on the host between them.
+ */
+int run_hybrid(unsigned char* left, unsigned char* right, unsigned int w,
+	unsigned int h, char* args, int win_w, int win_h, int max_disp,
+	int int_mode, unsigned char* l2r, unsigned char* r2l)
+{
+	struct band bands[2];
+	struct band* b;
+	struct sat sat_l;
+	struct sat sat_r;
+	/* Rows not taken yet are top..bottom */
+	int top = 0;
+	int bottom = h;
+	/* Rows per ms, of the device and of one CPU thread */
+	double gpu_rate = 0;
+	double cpu_rate = 0;
+	int workers = 0;
+	int gpu_rows = 0;
+	int cpu_rows = 0;
+	double start;
+	double gpu_ms = 0;
+	cl_int err;
+
+	b = &bands[0];
+	b->dev = create_device();
+	b->ctx = clCreateContext(NULL, 1, &b->dev, NULL, NULL, &err);
+	if (err < 0) error(err, "clCreateContext");
+	b->queue = clCreateCommandQueue(b->ctx, b->dev,
+			CL_QUEUE_PROFILING_ENABLE, &err);
+	if (err < 0) error(err, "clCreateCommandQueue");
+	trace_sync(b->queue, "feeder");
+	b->program = get_program(b->ctx, b->dev, PROGRAM, args);
+	b->kernel = clCreateKernel(b->program, F_ZNCC, &err);
+	if (err < 0) error(err, "clCreateKernel");
+	bands[1] = bands[0];
+
+	sat_create(left, w, h, &sat_l);
+	sat_create(right, w, h, &sat_r);
+
+	start = now_ms();
+#pragma omp parallel
+	{
+		int tid = 0;
+		int row0;
+		int row1;
+		int rows;
+		int cur = 0;
+		int busy[2] = {0, 0};
+		double t;
+
+#ifdef _OPENMP
+		tid = omp_get_thread_num();
+#pragma omp single
+		workers = omp_get_num_threads() - 1;
+#endif
+		for (;;) {
+			/*
+			 * Take the next tile. The feeder also takes nothing
+			 * when the queue is empty, it still has bands to
+			 * finish.
+			 */
+#pragma omp critical(hybrid_queue)
+			{
+				double rates = gpu_rate + cpu_rate*workers;
+				double share;
+
+				if (tid == 0)
+					share = rates > 0 ?
+						gpu_rate / rates : 0.5;
+				else
+					share = rates > 0 ?
+						cpu_rate / rates : 0.5/workers;
+				if (tid == 0 ? gpu_rate > 0 : cpu_rate > 0)
+					rows = HYBRID_TARGET_MS * (tid == 0 ?
+						gpu_rate : cpu_rate);
+				else
+					rows = HYBRID_ROWS;
+				if (rows > (bottom-top) * share)
+					rows = (bottom-top) * share;
+				if (rows < 1)
+					rows = 1;
+				if (rows > bottom-top)
+					rows = bottom-top;
+				if (tid == 0) {
+					row1 = bottom;
+					bottom -= rows;
+					row0 = bottom;
+				} else {
+					row0 = top;
+					top += rows;
+					row1 = top;
+				}
+			}
+
+			if (tid != 0) {
+				if (row0 == row1)
+					break;
+				t = now_ms();
+				zncc_rows(left, right, &sat_l, &sat_r, w, h,
+					win_w, win_h, 0, max_disp, int_mode,
+					row0, row1, l2r);
+				zncc_rows(right, left, &sat_r, &sat_l, w, h,
+					win_w, win_h, -max_disp, 0, int_mode,
+					row0, row1, r2l);
+				trace_span("cpu rows", t);
+				t = now_ms() - t;
+#pragma omp critical(hybrid_queue)
+				{
+					cpu_rows += row1 - row0;
+					/* Running average over the tiles */
+					cpu_rate = cpu_rate == 0 ?
+						(row1-row0) / t :
+						0.5*cpu_rate +
+						0.5*(row1-row0) / t;
+				}
+				continue;
+			}
+
+			/* Feeder: queue the new band, then finish the older */
+			if (row0 < row1) {
+				bands[cur].row0 = row0;
+				bands[cur].row1 = row1;
+				enqueue_band(&bands[cur], left, right, w, h,
+					win_h, max_disp, l2r, r2l);
+				busy[cur] = 1;
+			}
+			cur ^= 1;
+			if (busy[cur]) {
+				b = &bands[cur];
+				t = finish_band(b);
+				busy[cur] = 0;
+				gpu_ms += t;
+#pragma omp critical(hybrid_queue)
+				{
+					gpu_rows += b->row1 - b->row0;
+					gpu_rate = gpu_rate == 0 ?
+						(b->row1-b->row0) / t :
+						0.5*gpu_rate +
+						0.5*(b->row1-b->row0) / t;
+				}
+			}
+			if (row0 == row1 && !busy[0] && !busy[1])
+				break;
+		}
+	}
+	printf("Hybrid: %0.3f ms, device %d rows in %0.3f ms, "
+		"%d CPU threads %d rows\n", now_ms() - start, gpu_rows,
+		gpu_ms, workers, cpu_rows);
+
+	sat_free(&sat_l);
+	sat_free(&sat_r);
+	b = &bands[0];
+	clReleaseKernel(b->kernel);
+	clReleaseProgram(b->program);
+	for (int i=0; i<programs_used; i++)
+		clReleaseProgram(programs[i].program);
+	clReleaseCommandQueue(b->queue);
+	clReleaseContext(b->ctx);
+	return 0;
+}
+
+
+int main(int argc, char** argv)
 {
 	const char* inL = "imageL.png";
 	const char* inR = "imageR.png";
 	const char* out = "output.png";
+	char stream_l[FILENAME_MAX];
+	char stream_r[FILENAME_MAX];
+	int stream = 0;
+	int device_post = 1;
+	int multi = 0;
+	int split = 1;
+	int hybrid = 0;
+	int tune = 0;
+	struct config conf = {{0, 0}, TILE_W, TILE_H};
+	char key[TUNE_LINE];
+	char conf_str[TUNE_LINE];
+	char shape[128];
+	double t;
+	int upscale = 0;
+	unsigned int out_w, out_h;
+	unsigned char* map;
+	cl_mem buff_res;
 
 	unsigned char* imageL=0;
 	unsigned char* imageR=0;
@@ -169,14 +1717,30 @@ int main(void)
 	unsigned char* d_r2l;
 	unsigned char* res=0;
 
-	int max_disp;
+	int max_disp = MAX_DISP;
 	int min_disp;
+	int win_w = WIN_W;
+	int win_h = WIN_H;
+	int threshold = THRESHOLD;
+	int tiled = 1;
+	int bidir = 0;
+	int census = 0;
+	float* scores;
+	int int_mode = 0;
+	int prune = 0;
+	float good = 2;
+	unsigned int* stats;
+	long skipped[3] = {0, 0, 0};
 
 	/* For OpenCL */
 	cl_device_id device;
 	cl_context context;
 	size_t global_item_size[2];
-	size_t buff_size;
+	size_t local_item_size[2];
+	size_t* local_size;
+	int unified;
+	unsigned char* l2r;
+	unsigned char* r2l;
 
 	cl_program program;
 	cl_kernel zncc_kernel;
@@ -187,6 +1751,9 @@ int main(void)
 	cl_mem buff_right;
 	cl_mem buff_out_l2r;
 	cl_mem buff_out_r2l;
+	cl_mem buff_best_l2r;
+	cl_mem buff_best_r2l;
+	cl_mem buff_stats;
 
 	cl_event event1;
 	cl_event event2;
@@ -194,6 +1761,143 @@ int main(void)
 	cl_ulong end;
 	double total;
 	cl_int err;
+	char args[256];
+
+
+	for (int i=1; i<argc; i++) {
+		if (strcmp(argv[i], "--engine=naive") == 0) {
+			tiled = 0;
+			bidir = 0;
+			hybrid = 0;
+			census = 0;
+		} else if (strcmp(argv[i], "--engine=tiled") == 0) {
+			tiled = 1;
+			bidir = 0;
+			hybrid = 0;
+			census = 0;
+		} else if (strcmp(argv[i], "--engine=bidir") == 0) {
+			tiled = 0;
+			bidir = 1;
+			hybrid = 0;
+			census = 0;
+		} else if (strcmp(argv[i], "--engine=hybrid") == 0) {
+			tiled = 0;
+			bidir = 0;
+			hybrid = 1;
+			census = 0;
+		} else if (strcmp(argv[i], "--engine=census") == 0) {
+			tiled = 0;
+			bidir = 0;
+			hybrid = 0;
+			census = 1;
+		} else if (strcmp(argv[i], "--mode=float") == 0) {
+			int_mode = 0;
+		} else if (strcmp(argv[i], "--mode=int") == 0) {
+			int_mode = 1;
+		} else if (strncmp(argv[i], "--win=", 6) == 0) {
+			if (sscanf(argv[i]+6, "%dx%d", &win_w, &win_h) != 2 ||
+			    win_w < 1 || win_h < 1) {
+				printf("--win takes WxH, e.g. --win=18x14\n");
+				return 3;
+			}
+		} else if (strncmp(argv[i], "--threshold=", 12) == 0) {
+			threshold = atoi(argv[i]+12);
+		} else if (strncmp(argv[i], "--disp=", 7) == 0) {
+			max_disp = atoi(argv[i]+7);
+			if (max_disp < 0 || max_disp > 255) {
+				printf("--disp must be 0..255\n");
+				return 3;
+			}
+		} else if (strncmp(argv[i], "--stream=", 9) == 0) {
+			stream = atoi(argv[i]+9);
+			if (stream < 1) {
+				printf("--stream needs at least one frame\n");
+				return 3;
+			}
+		} else if (strcmp(argv[i], "--post=device") == 0) {
+			device_post = 1;
+		} else if (strcmp(argv[i], "--post=host") == 0) {
+			device_post = 0;
+		} else if (strcmp(argv[i], "--prune") == 0) {
+			prune = 1;
+		} else if (strncmp(argv[i], "--good=", 7) == 0) {
+			good = atof(argv[i]+7);
+		} else if (strcmp(argv[i], "--tune") == 0) {
+			tune = 1;
+		} else if (strcmp(argv[i], "--multi") == 0) {
+			multi = 1;
+		} else if (strncmp(argv[i], "--split=", 8) == 0) {
+			multi = 1;
+			split = atoi(argv[i]+8);
+		} else if (strncmp(argv[i], "--left=", 7) == 0) {
+			inL = argv[i]+7;
+		} else if (strncmp(argv[i], "--right=", 8) == 0) {
+			inR = argv[i]+8;
+		} else if (strncmp(argv[i], "--out=", 6) == 0) {
+			out = argv[i]+6;
+		} else if (strncmp(argv[i], "--down=", 7) == 0) {
+			down = atoi(argv[i]+7);
+			if (down < 1) down = 1;
+			if (down > PNGDOWN_MAX_FACTOR)
+				down = PNGDOWN_MAX_FACTOR;
+		} else if (strcmp(argv[i], "--filter=box") == 0) {
+			down_filter = PNGDOWN_BOX;
+		} else if (strcmp(argv[i], "--filter=gauss") == 0) {
+			down_filter = PNGDOWN_GAUSS;
+		} else if (strcmp(argv[i], "--upscale") == 0) {
+			upscale = 1;
+		} else {
+			printf("Usage: %s "
+				"[--engine=naive|tiled|bidir|hybrid|census] "
+				"[--mode=float|int] [--prune] [--good=S] "
+				"[--win=WxH] [--threshold=T] [--disp=N] "
+				"[--stream=N] [--post=device|host] "
+				"[--multi] [--split=K] [--tune] [--left=PNG] "
+				"[--right=PNG] [--out=PNG] [--down=F] "
+				"[--filter=box|gauss] [--upscale]\n", argv[0]);
+			return 3;
+		}
+	}
+	trace_open();
+	/* --disp is in pixels of the full-size images */
+	max_disp = (max_disp + down-1) / down;
+	if (stream && upscale) {
+		printf("--upscale writes single images\n");
+		return 3;
+	}
+	/* --good only exists in the pruning kernel, which is a naive one */
+	if (good <= 1)
+		prune = 1;
+	if (prune && (bidir || hybrid || census)) {
+		printf("--prune and --good need --engine=naive or tiled\n");
+		return 3;
+	}
+	if (prune)
+		tiled = 0;
+	if (stream && (prune || bidir || hybrid)) {
+		printf("--stream runs the naive or tiled engine\n");
+		return 3;
+	}
+	/* Bands run the naive kernel and are post-processed on the host */
+	if (multi && (prune || bidir || hybrid || stream)) {
+		printf("--multi runs the naive engine on single images\n");
+		return 3;
+	}
+	if (tune && (prune || bidir || hybrid || multi || census)) {
+		printf("--tune tunes the naive or tiled engine\n");
+		return 3;
+	}
+	if (census && (stream || multi)) {
+		printf("--engine=census runs on single images\n");
+		return 3;
+	}
+	/* The first frame gives the size the program is built for */
+	if (stream) {
+		sprintf(stream_l, STREAM_L, 0);
+		sprintf(stream_r, STREAM_R, 0);
+		inL = stream_l;
+		inR = stream_r;
+	}
 
 
 	/*****************************
@@ -201,18 +1905,26 @@ int main(void)
 	 *	READ IMAGES
 	 *
 	 *****************************/
-	imageL = read_image(&w, &h, inL);
+	t = now_ms();
+	imageL = read_image(&w, &h, &out_w, &out_h, inL);
 	temp = w*h;
-	imageR = read_image(&w, &h, inR);
+	imageR = read_image(&w, &h, NULL, NULL, inR);
 	size = w*h;
 	if(imageL == NULL || imageR == NULL) {
 		printf("Image is NULL!\n");
 		return 1;
 	}
+	/* The output keeps the shrunk size unless --upscale */
+	if (!upscale) {
+		out_w = w;
+		out_h = h;
+	}
 	if (temp != size) {
 		printf("Image dimensions should be the same!\n");
 		return 2;
 	}
+	printf("Stage load: %0.3f ms\n", now_ms() - t);
+	trace_span("decode", t);
 
 
 	/*****************************
@@ -224,176 +1936,366 @@ int main(void)
 	d_r2l = calloc(size, sizeof(unsigned char));
 	res = calloc(size, sizeof(unsigned char));
 
-
-	/* w x h x 4 pixels (RGBA) x sizeof */
-	buff_size = size * 4 *sizeof(unsigned char);
-	global_item_size[0] = h;
-	global_item_size[1] = w;
-	max_disp = 64;
 	min_disp = 0;
 
 
 	/*****************************
 	 *
-	 *  	DEVICE & CONTEXT
+	 *	MULTI-DEVICE & HYBRID
 	 *
 	 *****************************/
-	device = create_device();
-	context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
-	if (err < 0) error(err, "clCreateContext");
-
-
-	/*****************************
-	 *
-	 *	PROGRAM & KERNEL
-	 *
-	 *****************************/
-	program = build_program(context, device, PROGRAM);
-	zncc_kernel = clCreateKernel(program, F_ZNCC, &err);
-	if (err < 0) error(err, "clCreateKernel");
+	if (multi || hybrid) {
+		/* No -DHEIGHT, every band has a height of its own */
+		sprintf(args, "-DWIN_W=%d -DWIN_H=%d -DTHRESHOLD=%d "
+				"-DMAX_DISP=%d -DWIDTH=%u%s", win_w, win_h,
+				threshold, max_disp, w,
+				int_mode ? " -DZNCC_INT" : "");
+		t = now_ms();
+		if (multi)
+			err = run_multi(imageL, imageR, w, h, args, win_h,
+					max_disp, split, d_l2r, d_r2l);
+		else
+			err = run_hybrid(imageL, imageR, w, h, args, win_w,
+					win_h, max_disp, int_mode, d_l2r,
+					d_r2l);
+		printf("Stage zncc: %0.3f ms\n", now_ms() - t);
+		trace_span("zncc", t);
+		if (err == 0) {
+			t = now_ms();
+			cross_checking(d_l2r, d_r2l, size, threshold, res);
+			occlusion_filling(res, size);
+			normalize(res, size);
+			printf("Stage post: %0.3f ms\n", now_ms() - t);
+			trace_span("post", t);
+			t = now_ms();
+			write_image(out, res, w, h, out_w, out_h);
+			printf("Stage save: %0.3f ms\n", now_ms() - t);
+			trace_span("encode", t);
+		}
+		free(res);
+		free(imageL);
+		free(imageR);
+		free(d_l2r);
+		free(d_r2l);
+		return err;
+	}
 
 
 	/*****************************
 	 *
-	 *	QUEUE
+	 *  	DEVICE & CONTEXT
 	 *
 	 *****************************/
-	queue = clCreateCommandQueue(context, device, 
-		CL_QUEUE_PROFILING_ENABLE, &err);
-	if (err < 0) error(err, "clCreateCommandQueue");
+	t = now_ms();
+	device = create_device();
+	context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+	if (err < 0) error(err, "clCreateContext");
 
 
 	/*****************************
 	 *
-	 *	BUFFERS
+	 *	TUNING & WORK SIZES
 	 *
 	 *****************************/
-	/* IN */
-	buff_left = clCreateBuffer(context, CL_MEM_READ_ONLY |
-			CL_MEM_COPY_HOST_PTR, buff_size, imageL, &err);
-	if (err < 0) error(err, "clCreateBuffer (buff_left)");
-
-	buff_right = clCreateBuffer(context, CL_MEM_READ_ONLY |
-			CL_MEM_COPY_HOST_PTR, buff_size, imageR, &err);
-	if (err < 0) error(err, "clCreateBuffer (buff_right)");
-
-
-	/* OUT */
-	buff_out_l2r = clCreateBuffer(context, CL_MEM_WRITE_ONLY, buff_size,
-			NULL, &err);
-	if (err < 0) error(err, "ClCreateBuffer (buff_out_l2r");
+	sprintf(args, "-DWIN_W=%d -DWIN_H=%d -DTHRESHOLD=%d -DMAX_DISP=%d "
+			"-DWIDTH=%u -DHEIGHT=%u%s", win_w, win_h, threshold,
+			max_disp, w, h, int_mode ? " -DZNCC_INT" : "");
+	sprintf(shape, "%ux%u win=%dx%d disp=%d %s", w, h, win_w, win_h,
+			max_disp, int_mode ? "int" : "float");
+	tune_key(key, sizeof(key), device, tiled ? F_ZNCC_TILED : F_ZNCC,
+			shape);
+	if (tune) {
+		tune_zncc(context, device, args, tiled, imageL, imageR, w, h,
+				max_disp, key, &conf);
+	} else if (!bidir && !prune && !census &&
+	    tune_load(key, conf_str, sizeof(conf_str)) &&
+	    sscanf(conf_str, "local=%zux%zu tile=%dx%d", &conf.local[0],
+		    &conf.local[1], &conf.tile_w, &conf.tile_h) == 4) {
+		printf("Tuned: %s\n", conf_str);
+	}
 
-	buff_out_r2l = clCreateBuffer(context, CL_MEM_WRITE_ONLY, buff_size,
-			NULL, &err);
-	if (err < 0) error(err, "ClCreateBuffer (buff_out_r2l");
+	if (bidir) {
+		/* Left window centres up to WIN_W/2 past either image edge */
+		global_item_size[0] = h;
+		global_item_size[1] = w + 2*(win_w/2);
+		local_size = NULL;
+	} else if (prune) {
+		global_item_size[0] = h;
+		global_item_size[1] = w;
+		local_size = NULL;
+	} else {
+		zncc_sizes(tiled, &conf, w, h, global_item_size,
+				local_item_size, &local_size);
+	}
 
 
 	/*****************************
 	 *
-	 *	KERNEL ARGS - L2R
+	 *	PROGRAM & KERNEL
 	 *
 	 *****************************/
-	err = clSetKernelArg(zncc_kernel, 0, sizeof(cl_mem),
-			(void*)&buff_left);
-	err |= clSetKernelArg(zncc_kernel, 1, sizeof(cl_mem),
-			(void*)&buff_right);
-	err |= clSetKernelArg(zncc_kernel, 2, sizeof(unsigned int), (void*)&w);
-	err |= clSetKernelArg(zncc_kernel, 3, sizeof(unsigned int), (void*)&h);
-	err |= clSetKernelArg(zncc_kernel, 4, sizeof(int), (void*)&min_disp);
-	err |= clSetKernelArg(zncc_kernel, 5, sizeof(int), (void*)&max_disp);
-	err |= clSetKernelArg(zncc_kernel, 6, sizeof(cl_mem),
-			(void*)&buff_out_l2r);
-	if (err < 0) error(err, "clSetKernelArg L2R");
+	sprintf(args + strlen(args), " -DTILE_W=%d -DTILE_H=%d", conf.tile_w,
+			conf.tile_h);
+	program = get_program(context, device, PROGRAM, args);
+	zncc_kernel = clCreateKernel(program, census ? F_CALC_CENSUS :
+			bidir ? F_ZNCC_BIDIR : prune ? F_ZNCC_PRUNE :
+			tiled ? F_ZNCC_TILED : F_ZNCC, &err);
+	if (err < 0) error(err, "clCreateKernel");
 
 
 	/*****************************
 	 *
-	 *	ENQUEUE KERNEL L2R
+	 *	STREAM
 	 *
 	 *****************************/
-	err = clEnqueueNDRangeKernel(queue, zncc_kernel, 2, NULL,
-			global_item_size, NULL, 0, NULL, &event1);
-	if (err < 0 ) error(err, "clEnqueueNDRangeKernel - zncc");	
+	if (stream) {
+		err = run_stream(context, device, zncc_kernel,
+				global_item_size, local_size, w, h, max_disp,
+				threshold, stream);
+		clReleaseKernel(zncc_kernel);
+		clReleaseProgram(program);
+		for (int i=0; i<programs_used; i++)
+			clReleaseProgram(programs[i].program);
+		clReleaseContext(context);
+		free(res);
+		free(imageL);
+		free(imageR);
+		free(d_l2r);
+		free(d_r2l);
+		return err;
+	}
 
 
 	/*****************************
 	 *
-	 *	KERNEL ARGS - R2L
+	 *	QUEUE
 	 *
 	 *****************************/
-	max_disp = -max_disp;
-
-	err = clSetKernelArg(zncc_kernel, 0, sizeof(cl_mem),
-			(void*)&buff_right);
-	err |= clSetKernelArg(zncc_kernel, 1, sizeof(cl_mem),
-			(void*)&buff_left);
-	err |= clSetKernelArg(zncc_kernel, 2, sizeof(unsigned int), (void*)&w);
-	err |= clSetKernelArg(zncc_kernel, 3, sizeof(unsigned int), (void*)&h);
-	err |= clSetKernelArg(zncc_kernel, 4, sizeof(int), (void*)&max_disp);
-	err |= clSetKernelArg(zncc_kernel, 5, sizeof(int), (void*)&min_disp);
-	err |= clSetKernelArg(zncc_kernel, 6, sizeof(cl_mem),
-			(void*)&buff_out_r2l);
-	if (err < 0) error(err, "clSetKernelArg R2L");
+	queue = clCreateCommandQueue(context, device, 
+		CL_QUEUE_PROFILING_ENABLE, &err);
+	if (err < 0) error(err, "clCreateCommandQueue");
+	trace_sync(queue, "queue");
 
 
 	/*****************************
 	 *
-	 *	ENQUEUE KERNEL R2L
-	 *
-	 *****************************/
-	err = clEnqueueNDRangeKernel(queue, zncc_kernel, 2, NULL,
-			global_item_size, NULL, 0, NULL, &event2);
-	if (err < 0 ) error(err, "clEnqueueNDRangeKernel - zncc");
-	clFinish(queue);
-
-	/*****************************
-	 *
-	 *	BUFFER BACK TO HOST L2R
+	 *	BUFFERS
 	 *
 	 *****************************/
-	err = clEnqueueReadBuffer(queue, buff_out_l2r, CL_TRUE, 0, size, d_l2r,
-			0, NULL, NULL);
-	if (err < 0) error(err, "clEnqueueReadBuffer");
+	unified = host_unified(device);
+	printf("Buffers: %s\n", unified ? "zero-copy" : "explicit transfers");
 
+	/* IN */
+	buff_left = input_buffer(context, unified, imageL, size);
+	buff_right = input_buffer(context, unified, imageR, size);
 
-	/*****************************
-	 *
-	 *	BUFFER BACK TO HOST R2L
-	 *
-	 *****************************/
-	err = clEnqueueReadBuffer(queue, buff_out_r2l, CL_TRUE, 0, size, d_r2l,
-			0, NULL, NULL);
-	if (err < 0) error(err, "clEnqueueReadBuffer");
+	/* OUT */
+	buff_out_l2r = output_buffer(context, unified, size);
+	buff_out_r2l = output_buffer(context, unified, size);
+	printf("Stage setup: %0.3f ms\n", now_ms() - t);
+	trace_span("setup", t);
 
 
 	/*****************************
 	 *
-	 *	PROFILING
+	 *	KERNEL ARGS - PRUNE
 	 *
 	 *****************************/
-	err = clGetEventProfilingInfo(event1, CL_PROFILING_COMMAND_START,
-			sizeof(start), &start, NULL);
-	if (err < 0) error(err, "clGetEventProfilingInfo e1 start");
-	err = clGetEventProfilingInfo(event1, CL_PROFILING_COMMAND_END,
-			sizeof(end), &end, NULL);
-	if (err < 0) error(err, "clGetEventProfilingInfo e1 end");
-
-	total = (end - start) / 1000000.0;
-	printf("1st run: %0.3f ms\n", total);
+	if (prune) {
+		/* Set once, both passes add to the same counters */
+		stats = calloc(3*h, sizeof(unsigned int));
+		buff_stats = clCreateBuffer(context, CL_MEM_READ_WRITE |
+				CL_MEM_COPY_HOST_PTR, 3*h*sizeof(unsigned int),
+				stats, &err);
+		if (err < 0) error(err, "clCreateBuffer (buff_stats)");
+
+		err = clSetKernelArg(zncc_kernel, 7, sizeof(float),
+				(void*)&good);
+		err |= clSetKernelArg(zncc_kernel, 8, sizeof(cl_mem),
+				(void*)&buff_stats);
+		if (err < 0) error(err, "clSetKernelArg prune");
+	}
 
 
-	err = clGetEventProfilingInfo(event2, CL_PROFILING_COMMAND_START,
-			sizeof(start), &start, NULL);
-	if (err < 0) error(err, "clGetEventProfilingInfo e2 start");
-
-	err = clGetEventProfilingInfo(event2, CL_PROFILING_COMMAND_END,
-			sizeof(end), &end, NULL);	
-	if (err < 0) error(err, "clGetEventProfilingInfo e2 end");
-	total += (end - start) / 1000000.0;
-	printf("2nd run: %0.3f ms\n", (end-start)/1000000.0);
+	t = now_ms();
+	if (census) {
+		/* calc_census reads descriptors in place of the images */
+		printf("Census transform: %0.3f ms\n",
+				census_buffers(context, queue, program,
+				&buff_left, &buff_right, w, h));
+	}
+	if (bidir) {
+		/*****************************
+		 *
+		 *	KERNEL ARGS - BIDIR
+		 *
+		 *****************************/
+		scores = malloc(size * sizeof(float));
+		for (int i=0; i<size; i++)
+			scores[i] = -1;
+		buff_best_l2r = clCreateBuffer(context, CL_MEM_READ_WRITE |
+				CL_MEM_COPY_HOST_PTR, size * sizeof(float),
+				scores, &err);
+		if (err < 0) error(err, "clCreateBuffer (buff_best_l2r)");
+		buff_best_r2l = clCreateBuffer(context, CL_MEM_READ_WRITE |
+				CL_MEM_COPY_HOST_PTR, size * sizeof(float),
+				scores, &err);
+		if (err < 0) error(err, "clCreateBuffer (buff_best_r2l)");
+		free(scores);
+
+		/* Defaults of pixels no window ever matches */
+		memset(d_l2r, max_disp, size);
+		err = clEnqueueWriteBuffer(queue, buff_out_l2r, CL_TRUE, 0,
+				size, d_l2r, 0, NULL, NULL);
+		err |= clEnqueueWriteBuffer(queue, buff_out_r2l, CL_TRUE, 0,
+				size, d_r2l, 0, NULL, NULL);
+		if (err < 0) error(err, "clEnqueueWriteBuffer");
+
+		err = clSetKernelArg(zncc_kernel, 0, sizeof(cl_mem),
+				(void*)&buff_left);
+		err |= clSetKernelArg(zncc_kernel, 1, sizeof(cl_mem),
+				(void*)&buff_right);
+		err |= clSetKernelArg(zncc_kernel, 2, sizeof(unsigned int),
+				(void*)&w);
+		err |= clSetKernelArg(zncc_kernel, 3, sizeof(unsigned int),
+				(void*)&h);
+		err |= clSetKernelArg(zncc_kernel, 5, sizeof(cl_mem),
+				(void*)&buff_best_l2r);
+		err |= clSetKernelArg(zncc_kernel, 6, sizeof(cl_mem),
+				(void*)&buff_best_r2l);
+		err |= clSetKernelArg(zncc_kernel, 7, sizeof(cl_mem),
+				(void*)&buff_out_l2r);
+		err |= clSetKernelArg(zncc_kernel, 8, sizeof(cl_mem),
+				(void*)&buff_out_r2l);
+		if (err < 0) error(err, "clSetKernelArg bidir");
+
+
+		/*****************************
+		 *
+		 *	ENQUEUE KERNEL BIDIR
+		 *
+		 *****************************/
+		total = calc_zncc_bidir(queue, zncc_kernel, global_item_size,
+				max_disp);
+		printf("Bidirectional run: %0.3f ms\n", total);
+
+		clReleaseMemObject(buff_best_l2r);
+		clReleaseMemObject(buff_best_r2l);
+	} else {
+		/*****************************
+		 *
+		 *	KERNEL ARGS - L2R
+		 *
+		 *****************************/
+		err = clSetKernelArg(zncc_kernel, 0, sizeof(cl_mem),
+				(void*)&buff_left);
+		err |= clSetKernelArg(zncc_kernel, 1, sizeof(cl_mem),
+				(void*)&buff_right);
+		err |= clSetKernelArg(zncc_kernel, 2, sizeof(unsigned int),
+				(void*)&w);
+		err |= clSetKernelArg(zncc_kernel, 3, sizeof(unsigned int),
+				(void*)&h);
+		err |= clSetKernelArg(zncc_kernel, 4, sizeof(int),
+				(void*)&min_disp);
+		err |= clSetKernelArg(zncc_kernel, 5, sizeof(int),
+				(void*)&max_disp);
+		err |= clSetKernelArg(zncc_kernel, 6, sizeof(cl_mem),
+				(void*)&buff_out_l2r);
+		if (err < 0) error(err, "clSetKernelArg L2R");
+
+
+		/*****************************
+		 *
+		 *	ENQUEUE KERNEL L2R
+		 *
+		 *****************************/
+		err = clEnqueueNDRangeKernel(queue, zncc_kernel, 2, NULL,
+				global_item_size, local_size, 0, NULL, &event1);
+		if (err < 0 ) error(err, "clEnqueueNDRangeKernel - zncc");
+
+
+		/*****************************
+		 *
+		 *	KERNEL ARGS - R2L
+		 *
+		 *****************************/
+		max_disp = -max_disp;
+
+		err = clSetKernelArg(zncc_kernel, 0, sizeof(cl_mem),
+				(void*)&buff_right);
+		err |= clSetKernelArg(zncc_kernel, 1, sizeof(cl_mem),
+				(void*)&buff_left);
+		err |= clSetKernelArg(zncc_kernel, 2, sizeof(unsigned int),
+				(void*)&w);
+		err |= clSetKernelArg(zncc_kernel, 3, sizeof(unsigned int),
+				(void*)&h);
+		err |= clSetKernelArg(zncc_kernel, 4, sizeof(int),
+				(void*)&max_disp);
+		err |= clSetKernelArg(zncc_kernel, 5, sizeof(int),
+				(void*)&min_disp);
+		err |= clSetKernelArg(zncc_kernel, 6, sizeof(cl_mem),
+				(void*)&buff_out_r2l);
+		if (err < 0) error(err, "clSetKernelArg R2L");
+
+
+		/*****************************
+		 *
+		 *	ENQUEUE KERNEL R2L
+		 *
+		 *****************************/
+		err = clEnqueueNDRangeKernel(queue, zncc_kernel, 2, NULL,
+				global_item_size, local_size, 0, NULL, &event2);
+		if (err < 0 ) error(err, "clEnqueueNDRangeKernel - zncc");
+		clFinish(queue);
+
+		/*****************************
+		 *
+		 *	PROFILING
+		 *
+		 *****************************/
+		err = clGetEventProfilingInfo(event1,
+				CL_PROFILING_COMMAND_START,
+				sizeof(start), &start, NULL);
+		if (err < 0) error(err, "clGetEventProfilingInfo e1 start");
+		err = clGetEventProfilingInfo(event1, CL_PROFILING_COMMAND_END,
+				sizeof(end), &end, NULL);
+		if (err < 0) error(err, "clGetEventProfilingInfo e1 end");
+
+		total = (end - start) / 1000000.0;
+		printf("1st run: %0.3f ms\n", total);
+		trace_event("zncc L2R", event1);
+
+
+		err = clGetEventProfilingInfo(event2,
+				CL_PROFILING_COMMAND_START,
+				sizeof(start), &start, NULL);
+		if (err < 0) error(err, "clGetEventProfilingInfo e2 start");
+
+		err = clGetEventProfilingInfo(event2, CL_PROFILING_COMMAND_END,
+				sizeof(end), &end, NULL);	
+		if (err < 0) error(err, "clGetEventProfilingInfo e2 end");
+		total += (end - start) / 1000000.0;
+		printf("2nd run: %0.3f ms\n", (end-start)/1000000.0);
+		trace_event("zncc R2L", event2);
+	}
 
 
 	printf("ZNCC kernel execution time: %0.3f ms\n", total);
+	printf("Stage zncc: %0.3f ms\n", now_ms() - t);
+	trace_span("zncc", t);
+
+	if (prune) {
+		err = clEnqueueReadBuffer(queue, buff_stats, CL_TRUE, 0,
+				3*h*sizeof(unsigned int), stats, 0, NULL, NULL);
+		if (err < 0) error(err, "clEnqueueReadBuffer");
+		for (int i=0; i<3*h; i++)
+			skipped[i%3] += stats[i];
+		printf("Skipped: %ld candidates by bound (%ld taps), "
+			"%ld candidates by --good\n", skipped[0], skipped[1],
+			skipped[2]);
+		clReleaseMemObject(buff_stats);
+		free(stats);
+	}
 
 
 	/*****************************
@@ -401,11 +2303,39 @@ int main(void)
 	 *	POST PROCESS
 	 *
 	 *****************************/
-	cross_checking(d_l2r, d_r2l, size, res);
-	occlusion_filling(res, size);
-	normalize(res, size);
-
-	lodepng_encode_file(out, res, w, h, LCT_GREY, 8);
+	t = now_ms();
+	if (device_post) {
+		/* Only the final map comes back */
+		buff_res = output_buffer(context, unified, size);
+		printf("Post-processing kernels: %0.3f ms\n",
+				post_process(context, queue, program,
+				buff_out_l2r, buff_out_r2l, buff_res, w, h));
+		map = map_output(queue, unified, buff_res, size, res);
+		printf("Stage post: %0.3f ms\n", now_ms() - t);
+		trace_span("post", t);
+		t = now_ms();
+		write_image(out, map, w, h, out_w, out_h);
+		printf("Stage save: %0.3f ms\n", now_ms() - t);
+		trace_span("encode", t);
+		unmap_output(queue, unified, buff_res, map);
+		clReleaseMemObject(buff_res);
+	} else {
+		l2r = map_output(queue, unified, buff_out_l2r, size, d_l2r);
+		r2l = map_output(queue, unified, buff_out_r2l, size, d_r2l);
+		trace_span("readback", t);
+		cross_checking(l2r, r2l, size, threshold, res);
+		unmap_output(queue, unified, buff_out_l2r, l2r);
+		unmap_output(queue, unified, buff_out_r2l, r2l);
+		occlusion_filling(res, size);
+		normalize(res, size);
+		printf("Stage post: %0.3f ms\n", now_ms() - t);
+		trace_span("post", t);
+
+		t = now_ms();
+		write_image(out, res, w, h, out_w, out_h);
+		printf("Stage save: %0.3f ms\n", now_ms() - t);
+		trace_span("encode", t);
+	}
 
 
 	/*****************************
@@ -415,6 +2345,8 @@ int main(void)
 	 *****************************/
 	clReleaseKernel(zncc_kernel);
 	clReleaseProgram(program);
+	for (int i=0; i<programs_used; i++)
+		clReleaseProgram(programs[i].program);
 	clReleaseMemObject(buff_left);
 	clReleaseMemObject(buff_right);
 	clReleaseMemObject(buff_out_l2r);
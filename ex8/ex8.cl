@@ -1,7 +1,163 @@
+/*
+ * The host passes the window, the disparity range and the image size as
+ * -D options, so every loop bound below is a constant. The defaults only
+ * keep the file buildable on its own.
+ */
+#ifndef WIN_W
 #define WIN_W 18
+#endif
+#ifndef WIN_H
 #define WIN_H 14
+#endif
 #define WIN_PIXELS WIN_W*WIN_H
 
+/* With -DWIDTH and -DHEIGHT the w and h arguments are not read */
+#ifdef WIDTH
+#define IMG_W WIDTH
+#else
+#define IMG_W w
+#endif
+#ifdef HEIGHT
+#define IMG_H HEIGHT
+#else
+#define IMG_H h
+#endif
+
+/*
+ * With -DZNCC_INT the kernels sum I, I^2 and L*R over the window in int
+ * and only the final score is computed in floating point. Multiplying the
+ * centered sums by WIN_PIXELS^2 folds the means in exactly:
+ * P^2 * sum (L-mL)(R-mR) = P^2*sum LR - (2P-n)*sum L*sum R
+ * The square root and the division are done in double like
+ * zncc_score_int() of ex6 and ex7, so the scores are the same bit for bit.
+ * Devices without cl_khr_fp64 fall back to float, which can differ in the
+ * last bits and so flip near ties.
+ */
+#ifdef ZNCC_INT
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
+
+float zncc_int(int sum_left, int sum_right, int sq_left, int sq_right,
+		int cross, int n)
+{
+	const long p2 = (long)(WIN_PIXELS) * (WIN_PIXELS);
+	const long k = 2*(WIN_PIXELS) - n;
+	long nominator;
+	long denominator1;
+	long denominator2;
+
+	nominator = p2*cross - k*sum_left*sum_right;
+	denominator1 = p2*sq_left - k*sum_left*sum_left;
+	denominator2 = p2*sq_right - k*sum_right*sum_right;
+#ifdef cl_khr_fp64
+	return nominator / sqrt((double)denominator1 * denominator2);
+#else
+	return nominator / sqrt((float)denominator1 * (float)denominator2);
+#endif
+}
+#endif
+
+/*
+ * ZNCC of the window around (i, j) in il against the window around
+ * (i, j-d) in ir. Only taps inside both images count; a window without any
+ * gives NaN, which never wins a comparison. Swapping the images and using
+ * (i, j-d, -d) gives exactly the same value, calc_zncc_bidir relies on it.
+ */
+float window_zncc(__global unsigned char* il, __global unsigned char* ir,
+		unsigned int w, unsigned int h, int i, int j, int d)
+{
+	float sum_left;
+	float sum_right;
+	int idx_l;
+	int idx_r;
+	float nominator=0;
+	float denominator1=0;
+	float denominator2=0;
+	float center_left;
+	float center_right;
+#ifdef ZNCC_INT
+	int sum_l, sum_r, sq_l, sq_r, cross, n;
+	int px_l, px_r;
+#endif
+
+#ifdef ZNCC_INT
+	/*
+	 * All window sums in one integer pass
+	 */
+	sum_l = sum_r = sq_l = sq_r = cross = n = 0;
+	for (int win_y=-WIN_H/2; win_y<WIN_H/2; win_y++) {
+		for (int win_x=-WIN_W/2; win_x<WIN_W/2; win_x++) {
+			/* Border checking */
+			if (i+win_y < 0     || i+win_y >= IMG_H ||
+			    j+win_x < 0     || j+win_x >= IMG_W ||
+			    j+win_x-d < 0   || j+win_x-d >= IMG_W)
+				continue;
+
+			px_l = il[IMG_W * (i+win_y) + j+win_x];
+			px_r = ir[IMG_W * (i+win_y) + j+win_x-d];
+			sum_l += px_l;
+			sum_r += px_r;
+			sq_l += px_l*px_l;
+			sq_r += px_r*px_r;
+			cross += px_l*px_r;
+			n++;
+		}
+	}
+	return zncc_int(sum_l, sum_r, sq_l, sq_r, cross, n);
+#else
+	/*
+	 * Calculate the mean
+	 */
+	sum_left = 0;
+	sum_right = 0;
+	for (int win_y=-WIN_H/2; win_y<WIN_H/2; win_y++) {
+		for (int win_x=-WIN_W/2; win_x<WIN_W/2; win_x++) {
+			/* Border checking */
+			 if (i+win_y < 0     || i+win_y >= IMG_H ||
+			     j+win_x < 0     || j+win_x >= IMG_W ||
+			     j+win_x-d < 0   || j+win_x-d >= IMG_W)
+				 continue;
+
+			idx_l = IMG_W * (i+win_y) +j+win_x;
+			idx_r = IMG_W *(i+win_y)+j+win_x-d;
+
+			sum_left += il[idx_l];
+			sum_right += ir[idx_r];
+		}
+	}
+	sum_left /= WIN_PIXELS;
+	sum_right /= WIN_PIXELS;
+
+	/*
+	 * Calcucate ZNCC
+	 */
+	nominator = 0;
+	denominator1 = 0;
+	denominator2 = 0;
+
+	for (int win_y=-WIN_H/2; win_y<WIN_H/2; win_y++) {
+		for (int win_x=-WIN_W/2; win_x<WIN_W/2; win_x++) {
+			/* Border checking */
+			if (i+win_y < 0     || i+win_y >= IMG_H ||
+			    j+win_x < 0     || j+win_x >= IMG_W ||
+			    j+win_x-d < 0   || j+win_x-d >= IMG_W)
+                            		continue;
+			idx_l = IMG_W * (i+win_y) +j+win_x;
+			idx_r = IMG_W *(i+win_y)+j+win_x-d;
+
+			center_left = il[idx_l] - sum_left;
+			center_right = ir[idx_r] - sum_right;
+
+			nominator += center_left * center_right;
+			denominator1 += pow(center_left, 2);
+			denominator2 += pow(center_right, 2);
+		}
+	}
+	return nominator / (sqrt(denominator1*denominator2));
+#endif
+}
+
 __kernel void
 calc_zncc(__global unsigned char* il, __global unsigned char* ir,
 		   unsigned int w, unsigned int h, int disp_min, int disp_max,
@@ -11,23 +167,306 @@ calc_zncc(__global unsigned char* il, __global unsigned char* ir,
 	const int j = get_global_id(1);
 
 	float cur_max;
+	float zncc;
+	int disp_best=0;
+
+	/* A tuned local size rounds the global size up to whole groups */
+	if (i >= IMG_H || j >= IMG_W)
+		return;
+
+	cur_max = -1;
+	disp_best = disp_max;
+
+	for (int d=disp_min; d<=disp_max; d++) {
+		zncc = window_zncc(il, ir, w, h, i, j, d);
+		if (zncc > cur_max) {
+			cur_max = zncc;
+			disp_best = d;
+		}
+	}
+	disp_map[i*IMG_W+j] = (unsigned char) abs(disp_best);
+}
+
+
+
+
+/*
+ * Rows of the window between two bound checks of calc_zncc_prune, and how
+ * far under cur_max the bound has to be before a candidate is dropped
+ */
+#define PRUNE_ROWS 4
+#define PRUNE_SLACK 1e-4f
+
+/*
+ * window_zncc that gives up early. The first pass sums I and I^2 so the
+ * centered sums of squares of the whole window are known. The second pass
+ * goes row by row, and by Cauchy-Schwarz the rows still to come can add at
+ * most sqrt(rest_left*rest_right) to the centered cross sum. Once even that
+ * cannot lift the score above cur_max the window is dropped: the result is
+ * -1, which never wins, and *skipped gets the taps that were left out.
+ */
+float window_zncc_prune(__global unsigned char* il,
+		__global unsigned char* ir, unsigned int w, unsigned int h,
+		int i, int j, int d, float cur_max, int* skipped)
+{
+	int sum_l, sum_r, sq_l, sq_r, n;
+	int px_l, px_r;
+	int done;
 	float sum_left;
 	float sum_right;
-	int idx_l;
-	int idx_r;
+	float total_left;
+	float total_right;
 	float nominator=0;
 	float denominator1=0;
 	float denominator2=0;
 	float center_left;
 	float center_right;
+	float bound;
+#ifdef ZNCC_INT
+	int cross=0;
+#endif
+
+	*skipped = 0;
+	sum_l = sum_r = sq_l = sq_r = n = 0;
+	for (int win_y=-WIN_H/2; win_y<WIN_H/2; win_y++) {
+		for (int win_x=-WIN_W/2; win_x<WIN_W/2; win_x++) {
+			/* Border checking */
+			if (i+win_y < 0     || i+win_y >= IMG_H ||
+			    j+win_x < 0     || j+win_x >= IMG_W ||
+			    j+win_x-d < 0   || j+win_x-d >= IMG_W)
+				continue;
+
+			px_l = il[IMG_W * (i+win_y) + j+win_x];
+			px_r = ir[IMG_W * (i+win_y) + j+win_x-d];
+			sum_l += px_l;
+			sum_r += px_r;
+			sq_l += px_l*px_l;
+			sq_r += px_r*px_r;
+			n++;
+		}
+	}
+	if (n == 0)
+		return -1;
+
+	sum_left = (float)sum_l / (WIN_PIXELS);
+	sum_right = (float)sum_r / (WIN_PIXELS);
+	total_left = sq_l - 2*sum_left*sum_l + n*sum_left*sum_left;
+	total_right = sq_r - 2*sum_right*sum_r + n*sum_right*sum_right;
+
+	done = 0;
+	for (int win_y=-WIN_H/2; win_y<WIN_H/2; win_y++) {
+		for (int win_x=-WIN_W/2; win_x<WIN_W/2; win_x++) {
+			/* Border checking */
+			if (i+win_y < 0     || i+win_y >= IMG_H ||
+			    j+win_x < 0     || j+win_x >= IMG_W ||
+			    j+win_x-d < 0   || j+win_x-d >= IMG_W)
+				continue;
+
+			px_l = il[IMG_W * (i+win_y) + j+win_x];
+			px_r = ir[IMG_W * (i+win_y) + j+win_x-d];
+#ifdef ZNCC_INT
+			cross += px_l*px_r;
+#endif
+			center_left = px_l - sum_left;
+			center_right = px_r - sum_right;
+
+			nominator += center_left * center_right;
+			denominator1 += pow(center_left, 2);
+			denominator2 += pow(center_right, 2);
+			done++;
+		}
+
+		if ((win_y+WIN_H/2+1) % PRUNE_ROWS != 0 || done == 0 ||
+		    done == n || total_left*total_right <= 0)
+			continue;
+		bound = (nominator + sqrt(max(total_left-denominator1, 0.0f) *
+					  max(total_right-denominator2, 0.0f)))
+			/ sqrt(total_left*total_right);
+		if (bound < cur_max - PRUNE_SLACK) {
+			*skipped = n - done;
+			return -1;
+		}
+	}
+
+#ifdef ZNCC_INT
+	return zncc_int(sum_l, sum_r, sq_l, sq_r, cross, n);
+#else
+	return nominator / (sqrt(denominator1*denominator2));
+#endif
+}
+
+/*
+ * calc_zncc with early termination. Candidates are dropped by the bound of
+ * window_zncc_prune, and a pixel stops searching as soon as its best score
+ * reaches good (pass anything above 1 to always search the whole range).
+ * Every work-item adds what it skipped to the three counters of its row:
+ * stats[3*i] candidates dropped by the bound, stats[3*i+1] their taps that
+ * were not read, stats[3*i+2] candidates never tried because of good.
+ */
+__kernel void
+calc_zncc_prune(__global unsigned char* il, __global unsigned char* ir,
+		unsigned int w, unsigned int h, int disp_min, int disp_max,
+		__global unsigned char* disp_map, float good,
+		__global unsigned int* stats)
+{
+	const int i = get_global_id(0);
+	const int j = get_global_id(1);
+
+	float cur_max;
 	float zncc;
-	int disp_best=0;
+	int disp_best;
+	int skipped;
+	unsigned int skip_pairs = 0;
+	unsigned int skip_taps = 0;
+	unsigned int skip_good = 0;
+
+	cur_max = -1;
+	disp_best = disp_max;
+
+	for (int d=disp_min; d<=disp_max; d++) {
+		zncc = window_zncc_prune(il, ir, w, h, i, j, d, cur_max,
+				&skipped);
+		if (skipped) {
+			skip_pairs++;
+			skip_taps += skipped;
+			continue;
+		}
+		if (zncc > cur_max) {
+			cur_max = zncc;
+			disp_best = d;
+		}
+		if (cur_max >= good) {
+			skip_good += disp_max - d;
+			break;
+		}
+	}
+	disp_map[i*IMG_W+j] = (unsigned char) abs(disp_best);
+
+	atomic_add(&stats[3*i], skip_pairs);
+	atomic_add(&stats[3*i+1], skip_taps);
+	atomic_add(&stats[3*i+2], skip_good);
+}
+
+
+
+
+/*
+ * Tile size of calc_zncc_tiled, set by the host with -DTILE_W/-DTILE_H.
+ * MAX_DISP is the widest disparity range the right strip has room for.
+ */
+#ifndef TILE_W
+#define TILE_W 16
+#endif
+#ifndef TILE_H
+#define TILE_H 16
+#endif
+#ifndef MAX_DISP
+#define MAX_DISP 64
+#endif
+
+/* Left tile plus the window halo */
+#define L_ROWS (TILE_H + WIN_H - 1)
+#define L_COLS (TILE_W + WIN_W - 1)
+/* Right strip: the left tile shifted by every disparity of the range */
+#define R_COLS (L_COLS + MAX_DISP)
+
+/*
+ * Same as calc_zncc, but the work-group first copies the pixels all of its
+ * windows need into local memory and the two window passes read from there.
+ * Launch with a local size of TILE_H x TILE_W and a global size rounded up
+ * to whole tiles. disp_max - disp_min must not exceed MAX_DISP.
+ */
+__kernel void
+calc_zncc_tiled(__global unsigned char* il, __global unsigned char* ir,
+		unsigned int w, unsigned int h, int disp_min, int disp_max,
+		__global unsigned char* disp_map)
+{
+	const int i = get_global_id(0);
+	const int j = get_global_id(1);
+	const int li = get_local_id(0);
+	const int lj = get_local_id(1);
 
+	/* Image coordinates of the first element in the local buffers */
+	const int row0 = get_group_id(0) * TILE_H - WIN_H/2;
+	const int col0 = get_group_id(1) * TILE_W - WIN_W/2;
+	const int rcol0 = col0 - disp_max;
+
+	__local unsigned char tile_l[L_ROWS][L_COLS];
+	__local unsigned char tile_r[L_ROWS][R_COLS];
+
+	float cur_max;
+	float sum_left;
+	float sum_right;
+	float nominator;
+	float denominator1;
+	float denominator2;
+	float center_left;
+	float center_right;
+	float zncc;
+	int disp_best;
+	int y, x;
+#ifdef ZNCC_INT
+	int sum_l, sum_r, sq_l, sq_r, cross, n;
+	int px_l, px_r;
+#endif
+
+	/*
+	 * Stage the tiles. Pixels outside the image are never used by the
+	 * window passes, they are just zeroed.
+	 */
+	for (int k=li*TILE_W+lj; k<L_ROWS*L_COLS; k+=TILE_W*TILE_H) {
+		y = row0 + k/L_COLS;
+		x = col0 + k%L_COLS;
+		tile_l[k/L_COLS][k%L_COLS] =
+			(y >= 0 && y < IMG_H && x >= 0 && x < IMG_W) ?
+			il[y*IMG_W+x] : 0;
+	}
+	for (int k=li*TILE_W+lj; k<L_ROWS*R_COLS; k+=TILE_W*TILE_H) {
+		y = row0 + k/R_COLS;
+		x = rcol0 + k%R_COLS;
+		tile_r[k/R_COLS][k%R_COLS] =
+			(y >= 0 && y < IMG_H && x >= 0 && x < IMG_W) ?
+			ir[y*IMG_W+x] : 0;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	/* The global size is rounded up to whole tiles */
+	if (i >= IMG_H || j >= IMG_W)
+		return;
 
 	cur_max = -1;
 	disp_best = disp_max;
 
 	for (int d=disp_min; d<=disp_max; d++) {
+#ifdef ZNCC_INT
+		/*
+		 * All window sums in one integer pass
+		 */
+		sum_l = sum_r = sq_l = sq_r = cross = n = 0;
+		for (int win_y=-WIN_H/2; win_y<WIN_H/2; win_y++) {
+			for (int win_x=-WIN_W/2; win_x<WIN_W/2; win_x++) {
+				/* Border checking */
+				if (i+win_y < 0     || i+win_y >= IMG_H ||
+				    j+win_x < 0     || j+win_x >= IMG_W ||
+				    j+win_x-d < 0   || j+win_x-d >= IMG_W)
+					continue;
+
+				px_l = tile_l[li+win_y+WIN_H/2]
+					     [lj+win_x+WIN_W/2];
+				px_r = tile_r[li+win_y+WIN_H/2]
+					     [lj+win_x+WIN_W/2+disp_max-d];
+				sum_l += px_l;
+				sum_r += px_r;
+				sq_l += px_l*px_l;
+				sq_r += px_r*px_r;
+				cross += px_l*px_r;
+				n++;
+			}
+		}
+		if (n == 0)
+			continue;
+		zncc = zncc_int(sum_l, sum_r, sq_l, sq_r, cross, n);
+#else
 		/*
 		 * Calculate the mean
 		 */
@@ -36,16 +475,17 @@ calc_zncc(__global unsigned char* il, __global unsigned char* ir,
 		for (int win_y=-WIN_H/2; win_y<WIN_H/2; win_y++) {
 			for (int win_x=-WIN_W/2; win_x<WIN_W/2; win_x++) {
 				/* Border checking */
-				 if (i+win_y < 0     || i+win_y >= h ||
-				     j+win_x < 0     || j+win_x >= w ||
-				     j+win_x-d < 0   || j+win_x-d >= w)
-					 continue;
+				if (i+win_y < 0     || i+win_y >= IMG_H ||
+				    j+win_x < 0     || j+win_x >= IMG_W ||
+				    j+win_x-d < 0   || j+win_x-d >= IMG_W)
+					continue;
 
-				idx_l = w * (i+win_y) +j+win_x;
-				idx_r = w *(i+win_y)+j+win_x-d;
+				/* Tile coordinates of the left tap */
+				int ty = li+win_y+WIN_H/2;
+				int tx = lj+win_x+WIN_W/2;
 
-				sum_left += il[idx_l];
-				sum_right += ir[idx_r];
+				sum_left += tile_l[ty][tx];
+				sum_right += tile_r[ty][tx+disp_max-d];
 			}
 		}
 		sum_left /= WIN_PIXELS;
@@ -61,29 +501,285 @@ calc_zncc(__global unsigned char* il, __global unsigned char* ir,
 		for (int win_y=-WIN_H/2; win_y<WIN_H/2; win_y++) {
 			for (int win_x=-WIN_W/2; win_x<WIN_W/2; win_x++) {
 				/* Border checking */
-				if (i+win_y < 0     || i+win_y >= h ||
-				    j+win_x < 0     || j+win_x >= w ||
-				    j+win_x-d < 0   || j+win_x-d >= w)
-                            		continue;
-				idx_l = w * (i+win_y) +j+win_x;
-				idx_r = w *(i+win_y)+j+win_x-d;
+				if (i+win_y < 0     || i+win_y >= IMG_H ||
+				    j+win_x < 0     || j+win_x >= IMG_W ||
+				    j+win_x-d < 0   || j+win_x-d >= IMG_W)
+					continue;
+
+				int ty = li+win_y+WIN_H/2;
+				int tx = lj+win_x+WIN_W/2;
 
-				center_left = il[idx_l] - sum_left;
-				center_right = ir[idx_r] - sum_right;
+				center_left = tile_l[ty][tx] - sum_left;
+				center_right = tile_r[ty][tx+disp_max-d] -
+						sum_right;
 
 				nominator += center_left * center_right;
-				denominator1 += pow(center_left, 2);
-				denominator2 += pow(center_right, 2);
+				denominator1 += center_left * center_left;
+				denominator2 += center_right * center_right;
 			}
 		}
 		zncc = nominator / (sqrt(denominator1*denominator2));
+#endif
 
 		if (zncc > cur_max) {
 			cur_max = zncc;
 			disp_best = d;
 		}
 	}
-	disp_map[i*w+j] = (unsigned char) abs(disp_best);
+	disp_map[i*IMG_W+j] = (unsigned char) abs(disp_best);
+}
+
+
+
+/*
+ * One disparity step of both matching directions. The score of the left
+ * window at j against the right window at j-d is also the score of the
+ * right window at j-d against the left one at j with disparity -d, so it
+ * is computed once and offered to both maps.
+ *
+ * Launch once per d = 0..disp_max, in order, over h x (w + WIN_W) work-items:
+ * the extra columns are left centres past the image edges whose window
+ * still overlaps a right pixel. Within one launch j -> j-d is one-to-one,
+ * so no two work-items touch the same R2L entry. best_* start at -1, the
+ * L2R map at disp_max and the R2L map at 0. The R2L search of calc_zncc
+ * runs d' = -disp_max..0 and keeps the first maximum; this loop sees the
+ * same scores in the reverse order, so it keeps the last one (>=).
+ */
+__kernel void
+calc_zncc_bidir(__global unsigned char* il, __global unsigned char* ir,
+		unsigned int w, unsigned int h, int d,
+		__global float* best_l2r, __global float* best_r2l,
+		__global unsigned char* disp_l2r,
+		__global unsigned char* disp_r2l)
+{
+	const int i = get_global_id(0);
+	const int j = get_global_id(1) - WIN_W/2;
+
+	float zncc;
+
+	zncc = window_zncc(il, ir, w, h, i, j, d);
+
+	if (j >= 0 && j < IMG_W && zncc > best_l2r[i*IMG_W+j]) {
+		best_l2r[i*IMG_W+j] = zncc;
+		disp_l2r[i*IMG_W+j] = (unsigned char) abs(d);
+	}
+	if (j-d >= 0 && j-d < IMG_W && zncc > -1 &&
+	    zncc >= best_r2l[i*IMG_W+j-d]) {
+		best_r2l[i*IMG_W+j-d] = zncc;
+		disp_r2l[i*IMG_W+j-d] = (unsigned char) abs(d);
+	}
+}
+
+
+
+/*
+ * --engine=census: one bit per pixel of the CENSUS_W x CENSUS_H
+ * neighbourhood but the centre, set where it is darker than the centre,
+ * CENSUS_WORDS words per pixel. Neighbours outside the image are clamped
+ * to the edge. Launch over h x w once per image.
+ */
+#ifndef CENSUS_W
+#define CENSUS_W 9
+#endif
+#ifndef CENSUS_H
+#define CENSUS_H 7
+#endif
+#define CENSUS_WORDS ((CENSUS_W*CENSUS_H-1 + 63) / 64)
+
+__kernel void
+census(__global unsigned char* img, unsigned int w, unsigned int h,
+		__global ulong* desc)
+{
+	const int i = get_global_id(0);
+	const int j = get_global_id(1);
+
+	unsigned char c;
+	ulong word = 0;
+	int bit = 0;
+	int k = 0;
+	int x, y;
+
+	if (i >= IMG_H || j >= IMG_W)
+		return;
+
+	c = img[i*IMG_W+j];
+	for (int dy=-CENSUS_H/2; dy<=CENSUS_H/2; dy++) {
+		y = clamp(i+dy, 0, (int)IMG_H-1);
+		for (int dx=-CENSUS_W/2; dx<=CENSUS_W/2; dx++) {
+			if (dx == 0 && dy == 0)
+				continue;
+			x = clamp(j+dx, 0, (int)IMG_W-1);
+			word |= (ulong)(img[y*IMG_W+x] < c) << bit;
+			if (++bit == 64) {
+				desc[(i*IMG_W+j)*CENSUS_WORDS+k++] = word;
+				word = 0;
+				bit = 0;
+			}
+		}
+	}
+	if (bit)
+		desc[(i*IMG_W+j)*CENSUS_WORDS+k] = word;
+}
+
+/*
+ * Census matching: the Hamming distances of the descriptors over the
+ * window, restricted like window_zncc to taps where both images exist.
+ * The lowest mean distance wins, compared exactly as sum_a*n_b <
+ * sum_b*n_a so that it matches the host engine bit for bit.
+ */
+__kernel void
+calc_census(__global ulong* dl, __global ulong* dr,
+		unsigned int w, unsigned int h, int disp_min, int disp_max,
+		__global unsigned char* disp_map)
+{
+	const int i = get_global_id(0);
+	const int j = get_global_id(1);
+
+	const int y0 = max(i-WIN_H/2, 0);
+	const int y1 = min(i+WIN_H/2, (int)IMG_H);
+	ulong best_sum = 0;
+	ulong best_n = 0;
+	int disp_best;
+	uint sum;
+	int x0, x1;
+	int n;
+	int p;
+
+	if (i >= IMG_H || j >= IMG_W)
+		return;
+
+	disp_best = disp_max;
+	for (int d=disp_min; d<=disp_max; d++) {
+		/* Columns where x-d is inside the image */
+		x0 = max(j-WIN_W/2, max(d, 0));
+		x1 = min(j+WIN_W/2, (int)IMG_W + min(d, 0));
+		if (x0 >= x1)
+			continue;
+		n = (x1-x0) * (y1-y0);
+
+		sum = 0;
+		for (int y=y0; y<y1; y++) {
+			for (int x=x0; x<x1; x++) {
+				p = (y*IMG_W+x) * CENSUS_WORDS;
+				for (int k=0; k<CENSUS_WORDS; k++)
+					sum += popcount(dl[p+k] ^
+						dr[p-d*CENSUS_WORDS+k]);
+			}
+		}
+
+		if (best_n == 0 || (ulong)sum*best_n < best_sum*n) {
+			best_sum = sum;
+			best_n = n;
+			disp_best = d;
+		}
+	}
+	disp_map[i*IMG_W+j] = (unsigned char) abs(disp_best);
+}
+
+
+
+
+/*
+ * Post-processing on the device. Together these give the same map as
+ * cross_checking(), occlusion_filling() and normalize() on the host, so
+ * only the final map has to leave the device.
+ */
+#ifndef THRESHOLD
+#define THRESHOLD 12
+#endif
+
+/*
+ * Cross-check fused with the fill of one row, one work-item per row. A
+ * pixel keeps its L2R disparity when R2L agrees within THRESHOLD, anything
+ * else takes the last kept value to its left. Zeros before the first kept
+ * pixel of the row are left for fill_carry, row_last gets the last value.
+ */
+__kernel void
+cross_fill_rows(__global unsigned char* l2r, __global unsigned char* r2l,
+		unsigned int w, unsigned int h, __global unsigned char* res,
+		__global unsigned char* row_last)
+{
+	const int i = get_global_id(0);
+
+	unsigned char nn_color = 0;
+	unsigned char v;
+
+	for (int j=0; j<IMG_W; j++) {
+		v = l2r[i*IMG_W+j];
+		if (abs(v - r2l[i*IMG_W+j]) > THRESHOLD)
+			v = 0;
+		if (v == 0)
+			v = nn_color;
+		else
+			nn_color = v;
+		res[i*IMG_W+j] = v;
+	}
+	row_last[i] = nn_color;
+}
+
+/*
+ * The host fill runs over the whole image, so the leading zeros of a row
+ * take the last value of the nearest row above that had one.
+ */
+__kernel void
+fill_carry(__global unsigned char* res, unsigned int w, unsigned int h,
+		__global unsigned char* row_last)
+{
+	const int i = get_global_id(0);
+
+	unsigned char carry = 0;
+
+	for (int k=i-1; k>=0 && carry==0; k--)
+		carry = row_last[k];
+	if (carry == 0)
+		return;
+	for (int j=0; j<IMG_W && res[i*IMG_W+j]==0; j++)
+		res[i*IMG_W+j] = carry;
+}
+
+/*
+ * Min and max of the map. Every work-group reduces its part in local
+ * memory and merges the result into range[0] (min) and range[1] (max),
+ * which start at 255 and 0. The local size has to be a power of two.
+ */
+__kernel void
+minmax(__global unsigned char* res, unsigned int w, unsigned int h,
+		__local unsigned char* lmin, __local unsigned char* lmax,
+		__global int* range)
+{
+	const int gid = get_global_id(0);
+	const int lid = get_local_id(0);
+
+	lmin[lid] = gid < IMG_W*IMG_H ? res[gid] : 255;
+	lmax[lid] = gid < IMG_W*IMG_H ? res[gid] : 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int s=get_local_size(0)/2; s>0; s>>=1) {
+		if (lid < s) {
+			lmin[lid] = min(lmin[lid], lmin[lid+s]);
+			lmax[lid] = max(lmax[lid], lmax[lid+s]);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (lid == 0) {
+		atomic_min(&range[0], lmin[0]);
+		atomic_max(&range[1], lmax[0]);
+	}
 }
 
+__kernel void
+rescale(__global unsigned char* res, unsigned int w, unsigned int h,
+		__global int* range)
+{
+	const int gid = get_global_id(0);
+	const int lo = range[0];
+	const int hi = range[1];
 
+	if (gid >= IMG_W*IMG_H)
+		return;
+	if (hi == lo)
+		res[gid] = 0;
+	else
+		res[gid] = (unsigned char) (255 * (res[gid]-lo) / (hi-lo));
+}
@@ -1,6 +1,12 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <math.h>
 #include "lodepng.h"
+#include "../common/cl_buffer.h"
+#include "../common/cl_cache.h"
+#include "../common/tune.h"
 #ifdef __APPLE__
 #include <OpenCL/cl.h>
 #else
@@ -11,12 +17,24 @@
 #define PROGRAM "lpf.cl"
 #define FUNC "lpf"
 
+/* Launch of lpf; a local size of 0 leaves it to the driver */
+struct config {
+	size_t local;
+	int rows;
+};
+
 
 void error(cl_int err, char* func_name);
 cl_device_id create_device(void);
-cl_program build_program(cl_context ctx, cl_device_id dev, const char* name, 
-	char* args);
 unsigned char* read_image(unsigned* width, unsigned* height, const char* name);
+double run_lpf(cl_context ctx, cl_device_id dev, cl_command_queue queue,
+	struct config* conf, cl_mem buff_in, cl_mem buff_out, unsigned int w,
+	unsigned int h, int runs);
+void lpf_set(void* arg, int i, char* conf, size_t size);
+double lpf_run(void* arg);
+void tune_lpf(cl_context ctx, cl_device_id dev, cl_command_queue queue,
+	cl_mem buff_in, cl_mem buff_out, unsigned int w, unsigned int h,
+	const char* key, struct config* best);
 
 
 void error(cl_int err, char* func_name)
@@ -41,52 +59,6 @@ cl_device_id create_device(void)
 	return dev;
 }
 
-cl_program build_program(cl_context ctx, cl_device_id dev, const char* name,
-	char* args)
-{
-	cl_program program;
-	FILE 	   *p_handle;
-	char 	   *p_buffer;
-	char 	   *p_log;
-	size_t 	   p_size;
-	size_t 	   log_size;
-	cl_int 	   err;
-
-	p_handle = fopen(name, "r");
-	if (p_handle == NULL) {
-		perror("Couldn't find the file");
-		exit(1);
-	}
-	fseek(p_handle, 0, SEEK_END);
-	p_size = ftell(p_handle);
-	rewind(p_handle);
-	p_buffer = (char*)malloc(p_size+1);
-	p_buffer[p_size] = '\0';
-	fread(p_buffer, sizeof(char), p_size, p_handle);
-	fclose(p_handle);
-
-	program = clCreateProgramWithSource(ctx, 1, (const char**)&p_buffer,
-			&p_size, &err);
-	if (err < 0) error(err, "clCreateProgramWithSource");
-	free(p_buffer);
-
-	err = clBuildProgram(program, 0, NULL, args, NULL, NULL);
-	if (err < 0) {
-		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG, 0,
-				NULL, &log_size);
-		p_log = (char *) malloc(log_size+1);
-		p_log[log_size] = '\0';
-		clGetProgramBuildInfo(program, dev, CL_PROGRAM_BUILD_LOG,
-			log_size+1, p_log, NULL);
-		printf("%s\n", p_log);
-		free(p_log);
-		exit(1);
-	}
-
-	return program;
-}
-
-
 unsigned char* read_image(unsigned* width, unsigned* height, const char* name)
 {
 	unsigned error;
@@ -100,97 +72,205 @@ unsigned char* read_image(unsigned* width, unsigned* height, const char* name)
 	return image;
 }
 
+/*
+ * Builds lpf for conf and runs it runs times. Returns the fastest run in
+ * ms, or -1 if the device does not take the launch.
+ */
+double run_lpf(cl_context ctx, cl_device_id dev, cl_command_queue queue,
+	struct config* conf, cl_mem buff_in, cl_mem buff_out, unsigned int w,
+	unsigned int h, int runs)
+{
+	cl_program program;
+	cl_kernel kernel;
+	cl_event event;
+	cl_ulong start, end;
+	size_t global_item_size;
+	size_t max_local;
+	double best = -1;
+	cl_int err;
+	char args[64];
 
-int main(void)
+	/* https://software.intel.com/en-us/forums/opencl/topic/520001 */
+	sprintf(args, "-DWIDTH=%u -DROWS=%d", w, conf->rows);
+	program = build_program(ctx, dev, PROGRAM, args);
+	kernel = clCreateKernel(program, FUNC, &err);
+	if (err < 0) error(err, "clCreateKernel");
+
+	err = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&buff_in);
+	err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&buff_out);
+	err |= clSetKernelArg(kernel, 2, sizeof(unsigned int), (void *)&w);
+	err |= clSetKernelArg(kernel, 3, sizeof(unsigned int), (void *)&h);
+	if (err < 0) error(err, "clSetKernelArg");
+
+	clGetKernelWorkGroupInfo(kernel, dev, CL_KERNEL_WORK_GROUP_SIZE,
+		sizeof(max_local), &max_local, NULL);
+	global_item_size = (h + conf->rows-1) / conf->rows;
+	if (conf->local > 0)
+		global_item_size = (global_item_size + conf->local-1) /
+			conf->local * conf->local;
+
+	for (int r=0; conf->local <= max_local && r<runs; r++) {
+		err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL,
+			&global_item_size, conf->local ? &conf->local : NULL,
+			0, NULL, &event);
+		if (err < 0)
+			break;
+		clWaitForEvents(1, &event);
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+			sizeof(start), &start, NULL);
+		clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END,
+			sizeof(end), &end, NULL);
+		clReleaseEvent(event);
+		if (best < 0 || (end-start)/1000000.0 < best)
+			best = (end-start)/1000000.0;
+	}
+
+	clReleaseKernel(kernel);
+	clReleaseProgram(program);
+	return best;
+}
+
+/* Sweep of tune_lpf(), every local size and rows per work-item */
+const size_t tune_locals[] = {0, 8, 16, 32, 64, 128};
+const int tune_rows[] = {1, 2, 4, 8};
+#define N_TUNE_ROWS (sizeof(tune_rows)/sizeof(tune_rows[0]))
+
+/* What the tune_space callbacks of lpf work on */
+struct lpf_tune {
+	cl_context ctx;
+	cl_device_id dev;
+	cl_command_queue queue;
+	cl_mem buff_in;
+	cl_mem buff_out;
+	unsigned int w;
+	unsigned int h;
+	struct config conf;
+};
+
+void lpf_set(void* arg, int i, char* conf, size_t size)
+{
+	struct lpf_tune* t = arg;
+
+	t->conf.local = tune_locals[i / N_TUNE_ROWS];
+	t->conf.rows = tune_rows[i % N_TUNE_ROWS];
+	snprintf(conf, size, "local=%zu rows=%d", t->conf.local, t->conf.rows);
+}
+
+double lpf_run(void* arg)
+{
+	struct lpf_tune* t = arg;
+
+	return run_lpf(t->ctx, t->dev, t->queue, &t->conf, t->buff_in,
+		t->buff_out, t->w, t->h, TUNE_RUNS);
+}
+
+/*
+ * --tune: the first configuration that runs gives the reference image,
+ * the others have to match it.
+ */
+void tune_lpf(cl_context ctx, cl_device_id dev, cl_command_queue queue,
+	cl_mem buff_in, cl_mem buff_out, unsigned int w, unsigned int h,
+	const char* key, struct config* best)
+{
+	struct lpf_tune t = {ctx, dev, queue, buff_in, buff_out, w, h, *best};
+	struct tune_space space = {
+		sizeof(tune_locals)/sizeof(tune_locals[0]) * N_TUNE_ROWS,
+		lpf_set, lpf_run, &t
+	};
+
+	if (tune_sweep(queue, buff_out, w*h, NULL, key, &space) >= 0)
+		*best = t.conf;
+}
+
+int main(int argc, char** argv)
 {	
 	const char* in = "input.png";
 	const char* out = "output.png";
 
 	unsigned char* image=0;
 	unsigned char* res=0;
+	unsigned char* host_res=0;
+	int unified;
 	unsigned int w;
 	unsigned int h;
 
 	cl_device_id device;
 	cl_context context;
-	cl_program program;
-	cl_kernel kernel;
 	cl_command_queue queue;
 
-	cl_event event;
-	cl_ulong start, end;
 	double total;
 
 	cl_mem buff_in;
 	cl_mem buff_out;
 	size_t buff_size;
-	size_t global_item_size;
 
 	cl_int err;
-	char args[64];
+	struct config conf = {0, 1};
+	char key[TUNE_LINE];
+	char conf_str[TUNE_LINE];
+	char shape[32];
+	int tune = 0;
+
+
+	if (argc == 2 && strcmp(argv[1], "--tune") == 0) {
+		tune = 1;
+	} else if (argc > 1) {
+		printf("Usage: %s [--tune]\n", argv[0]);
+		return 3;
+	}
 
 
 	image = read_image(&w, &h, in);
-	buff_size = w * h * 4 * sizeof(unsigned char);
-	res = calloc(buff_size, sizeof(unsigned char));	
+	buff_size = w * h * sizeof(unsigned char);
 
 	device = create_device();
 	context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
 	if (err < 0) error(err, "clCreateContext");
 
-	/* https://software.intel.com/en-us/forums/opencl/topic/520001 */
-	sprintf(args, "-DWIDTH=%d", w);
-	program = build_program(context, device, PROGRAM, args);
-	kernel = clCreateKernel(program, FUNC, &err);
-	if (err < 0) error(err, "clCreateKernel");
-
 	queue = clCreateCommandQueue(context, device, 
 		CL_QUEUE_PROFILING_ENABLE, &err);
 	if (err < 0) error(err, "clCreateCommandQueue");
 
-	buff_in = clCreateBuffer(context, CL_MEM_READ_ONLY | 
-			CL_MEM_COPY_HOST_PTR, buff_size, image, &err);
-	if (err < 0) error(err, "clCreateBuffer - in");
-	buff_out = clCreateBuffer(context, CL_MEM_WRITE_ONLY, buff_size, NULL, 
-			&err);
-	if (err < 0) error(err, "clCreateBuffer - out");
-
-	global_item_size = (size_t)h;
-	err = clSetKernelArg(kernel, 0, sizeof(cl_mem), (void *)&buff_in);
-	if (err < 0) error(err, "clSetKernelArg");
-	err = clSetKernelArg(kernel, 1, sizeof(cl_mem), (void *)&buff_out);
-	if (err < 0) error(err, "clSetKernelArg");
-	err = clSetKernelArg(kernel, 2, sizeof(unsigned int), (void *)&w);
-	if (err < 0) error(err, "clSetKernelArg");
-	
-
-	err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global_item_size,
-		NULL, 0, NULL, &event);
-	if (err < 0) error(err, "clEnqueueNDRangeKernel");
-
-	err = clEnqueueReadBuffer(queue, buff_out, CL_TRUE, 0, buff_size, 
-		res, 0, NULL, NULL);
-	if (err < 0) error(err, "clEnqueueReadBuffer");
-
+	unified = host_unified(device);
+	if (!unified)
+		host_res = malloc(buff_size);
+	buff_in = input_buffer(context, unified, image, buff_size);
+	buff_out = output_buffer(context, unified, buff_size);
+
+	/* Work items: swept with --tune, else the stored configuration */
+	sprintf(shape, "%ux%u", w, h);
+	tune_key(key, sizeof(key), device, FUNC, shape);
+	if (tune) {
+		tune_lpf(context, device, queue, buff_in, buff_out, w, h, key,
+			&conf);
+	} else if (tune_load(key, conf_str, sizeof(conf_str)) &&
+	    sscanf(conf_str, "local=%zu rows=%d", &conf.local,
+		    &conf.rows) == 2) {
+		printf("Tuned: %s\n", conf_str);
+	}
 
-	err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, 
-		sizeof(start), &start, NULL);
-	err = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, 
-		sizeof(end), &end, NULL);
-	total = (end-start)/1000000.0;
+	total = run_lpf(context, device, queue, &conf, buff_in, buff_out, w,
+		h, 1);
+	if (total < 0) {
+		printf("The device does not take local size %zu\n",
+			conf.local);
+		exit(1);
+	}
 	printf("LPF kernel execution time: %0.3f ms\n", total);
 
+	res = map_output(queue, unified, buff_out, buff_size, host_res);
+
 	lodepng_encode_file(out, res, w, h, LCT_GREY, 8);
+	unmap_output(queue, unified, buff_out, res);
 	
 
-	clReleaseKernel(kernel);
-	clReleaseProgram(program);
 	clReleaseMemObject(buff_in);
 	clReleaseMemObject(buff_out);
 	clReleaseCommandQueue(queue);
 	clReleaseContext(context);
 
 	free(image);
+	free(host_res);
 
 
 }
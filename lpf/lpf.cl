@@ -1,20 +1,28 @@
+/* Rows per work-item, picked by the host with -D, see --tune */
+#ifndef ROWS
+#define ROWS 1
+#endif
+
 __kernel void
-lpf(__global unsigned char* in, __global unsigned char* out, unsigned int w)
+lpf(__global unsigned char* in, __global unsigned char* out, unsigned int w,
+	unsigned int h)
 {
 	int i;	
-	const int j = get_global_id(0);
+	const int first = get_global_id(0) * ROWS;
 	__private unsigned char row[WIDTH];
 
-	/* Prefetch the row */
-	for (i=0; i<w; i++)
-		row[i] = in[j*w+i];
+	/* The global size is rounded up to whole work-groups */
+	for (int j=first; j<first+ROWS && j<h; j++) {
+		/* Prefetch the row */
+		for (i=0; i<w; i++)
+			row[i] = in[j*w+i];
 
-	/* First px of the row */
-	out[j*w] = row[0];
+		/* First px of the row */
+		out[j*w] = row[0];
 
-	/* LPF - calculate the rest pxs */
-	for (i=1; i<w; i++)
-		/* I_new(i,j) = [I(i,j) + I(i-1, j)]/2 */
-		out[j*w + i] = (row[i] + row[i-1])/2;
-	
+		/* LPF - calculate the rest pxs */
+		for (i=1; i<w; i++)
+			/* I_new(i,j) = [I(i,j) + I(i-1, j)]/2 */
+			out[j*w + i] = (row[i] + row[i-1])/2;
+	}
 }